@@ -0,0 +1,180 @@
+/*
+ * Microbenchmark for the bs_thread completion path
+ *
+ * Compares the old completion scheme of usr/bs.c (global mutex protected
+ * list plus kill(SIGUSR2) per command, drained through signalfd) with the
+ * lock-free per-LU stack that kicks an eventfd only when it goes from
+ * empty to non-empty.
+ *
+ *	cc -O2 -pthread -o bs-completion-bench scripts/bs-completion-bench.c
+ *	./bs-completion-bench [nr_workers] [completions per worker]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+struct node {
+	struct node *next;
+};
+
+static int nr_workers = 4;
+static long nr_per_worker = 200000;
+
+static struct node *nodes;
+
+/* old scheme */
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node *finished_head;
+
+/* new scheme */
+static struct node *done_head;
+static int done_fd;
+
+static void *signal_worker(void *arg)
+{
+	struct node *n = arg;
+	long i;
+
+	for (i = 0; i < nr_per_worker; i++, n++) {
+		pthread_mutex_lock(&finished_lock);
+		n->next = finished_head;
+		finished_head = n;
+		pthread_mutex_unlock(&finished_lock);
+
+		kill(getpid(), SIGUSR2);
+	}
+	return NULL;
+}
+
+static void *eventfd_worker(void *arg)
+{
+	struct node *n = arg, *head;
+	long i;
+
+	for (i = 0; i < nr_per_worker; i++, n++) {
+		head = __atomic_load_n(&done_head, __ATOMIC_RELAXED);
+		do {
+			n->next = head;
+		} while (!__atomic_compare_exchange_n(&done_head, &head, n, 1,
+						      __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+		if (!head)
+			eventfd_write(done_fd, 1);
+	}
+	return NULL;
+}
+
+static long drain(struct node *n)
+{
+	long nr = 0;
+
+	for (; n; n = n->next)
+		nr++;
+	return nr;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, int use_eventfd)
+{
+	struct signalfd_siginfo si[16];
+	struct epoll_event ev;
+	pthread_t *th;
+	long total = (long)nr_workers * nr_per_worker, done = 0, wakeups = 0;
+	struct node *list;
+	sigset_t mask;
+	double start;
+	int i, fd, ep;
+	eventfd_t val;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	if (use_eventfd)
+		fd = done_fd = eventfd(0, EFD_NONBLOCK);
+	else
+		fd = signalfd(-1, &mask, SFD_NONBLOCK);
+
+	ep = epoll_create1(0);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+
+	th = calloc(nr_workers, sizeof(*th));
+	start = now();
+	for (i = 0; i < nr_workers; i++)
+		pthread_create(&th[i], NULL,
+			       use_eventfd ? eventfd_worker : signal_worker,
+			       nodes + i * nr_per_worker);
+
+	while (done < total) {
+		if (epoll_wait(ep, &ev, 1, 1000) <= 0)
+			continue;
+		wakeups++;
+
+		if (use_eventfd) {
+			eventfd_read(fd, &val);
+			list = __atomic_exchange_n(&done_head, NULL,
+						   __ATOMIC_ACQUIRE);
+		} else {
+			while (read(fd, si, sizeof(si)) > 0)
+				;
+			pthread_mutex_lock(&finished_lock);
+			list = finished_head;
+			finished_head = NULL;
+			pthread_mutex_unlock(&finished_lock);
+		}
+		done += drain(list);
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(th[i], NULL);
+
+	printf("%-24s %12.0f completions/s %10ld wakeups (%.1f per wakeup)\n",
+	       name, total / (now() - start), wakeups,
+	       (double)total / wakeups);
+
+	free(th);
+	close(ep);
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		nr_workers = atoi(argv[1]);
+	if (argc > 2)
+		nr_per_worker = atol(argv[2]);
+
+	nodes = calloc((long)nr_workers * nr_per_worker, sizeof(*nodes));
+	if (!nodes) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("%d workers, %ld completions each\n", nr_workers,
+	       nr_per_worker);
+	run("mutex + SIGUSR2", 0);
+	run("lock-free + eventfd", 1);
+
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Known-answer check and microbenchmark for usr/libcrc32c.c
+ *
+ * Every crc32c implementation the CPU supports is checked against the
+ * iSCSI test vectors of RFC 3720 B.4 and against the byte-wise table
+ * loop for all lengths and alignments around the interleaving block
+ * sizes, then timed over typical PDU sizes.  Exits non-zero on a
+ * mismatch.
+ *
+ *	cc -O2 -D_GNU_SOURCE -Iusr -o crc32c-bench scripts/crc32c-bench.c
+ *	./crc32c-bench [seconds per size]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcrc32c.c"
+
+typedef uint32_t (*crc_fn)(uint32_t crc, unsigned char const *p, size_t len);
+
+struct impl {
+	const char *name;
+	crc_fn fn;
+	int supported;
+};
+
+/* the loop libcrc32c.c used to have */
+static uint32_t crc32c_bytewise(uint32_t crc, unsigned char const *p,
+				size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static struct impl impls[] = {
+	{ "byte-wise", crc32c_bytewise, 1 },
+	{ "slicing-by-8", crc32c_sw, 1 },
+#ifdef __x86_64__
+	{ "sse4.2", crc32c_sse42, 0 },
+	{ "sse4.2+pclmul", crc32c_sse42_pclmul, 0 },
+#endif
+#if defined(__aarch64__) && !defined(__AARCH64EB__)
+	{ "armv8", crc32c_armv8, 0 },
+#endif
+};
+
+#define NR_IMPLS	(sizeof(impls) / sizeof(impls[0]))
+
+static double seconds = 0.5;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void detect(void)
+{
+	int i;
+
+	for (i = 0; i < NR_IMPLS; i++) {
+#ifdef __x86_64__
+		if (!strcmp(impls[i].name, "sse4.2"))
+			impls[i].supported = __builtin_cpu_supports("sse4.2");
+		if (!strcmp(impls[i].name, "sse4.2+pclmul"))
+			impls[i].supported =
+				__builtin_cpu_supports("sse4.2") &&
+				__builtin_cpu_supports("pclmul");
+#endif
+#if defined(__aarch64__) && !defined(__AARCH64EB__)
+		if (!strcmp(impls[i].name, "armv8"))
+			impls[i].supported =
+				!!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+	}
+}
+
+static uint32_t digest(crc_fn fn, unsigned char const *p, size_t len)
+{
+	return ~fn(~0, p, len);
+}
+
+static int check_vectors(struct impl *im)
+{
+	static const unsigned char read_pdu[48] = {
+		0x01, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+		0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x18,
+		0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	unsigned char buf[32];
+	int i, err = 0;
+
+#define EXPECT(what, p, len, crc)					\
+	do {								\
+		uint32_t c = digest(im->fn, p, len);			\
+		if (c != (crc)) {					\
+			printf("%s: %s: 0x%08x, expected 0x%08x\n",	\
+			       im->name, what, c, crc);			\
+			err++;						\
+		}							\
+	} while (0)
+
+	EXPECT("\"123456789\"", (const unsigned char *)"123456789", 9,
+	       0xe3069283);
+
+	memset(buf, 0, sizeof(buf));
+	EXPECT("32 bytes of zeroes", buf, 32, 0x8a9136aa);
+	memset(buf, 0xff, sizeof(buf));
+	EXPECT("32 bytes of ones", buf, 32, 0x62a8ab43);
+	for (i = 0; i < 32; i++)
+		buf[i] = i;
+	EXPECT("32 incrementing bytes", buf, 32, 0x46dd794e);
+	for (i = 0; i < 32; i++)
+		buf[i] = 31 - i;
+	EXPECT("32 decrementing bytes", buf, 32, 0x113fdb5c);
+	EXPECT("iSCSI read PDU", read_pdu, sizeof(read_pdu), 0xd9963a56);
+
+	return err;
+}
+
+/* chained calls over every split must give the crc of the whole buffer */
+static int check_buffers(struct impl *im, unsigned char *buf, size_t size)
+{
+	static const size_t lens[] = {
+		0, 1, 7, 8, 9, 63, 255, 256, 257, 767, 768, 769, 1000, 4096,
+		3 * 8192 - 1, 3 * 8192, 3 * 8192 + 1, 3 * 8192 + 3 * 256 + 9,
+		6 * 8192 + 17, 262144 + 48,
+	};
+	size_t off, len, split;
+	uint32_t want, got;
+	int i, err = 0;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		len = lens[i];
+		for (off = 0; off < 16 && off + len <= size; off++) {
+			want = crc32c_bytewise(~0, buf + off, len);
+			got = im->fn(~0, buf + off, len);
+			if (got != want) {
+				printf("%s: len %zu off %zu: 0x%08x, expected "
+				       "0x%08x\n", im->name, len, off, got,
+				       want);
+				err++;
+			}
+
+			split = len / 3 + off;
+			if (split > len)
+				continue;
+			got = im->fn(im->fn(~0, buf + off, split),
+				     buf + off + split, len - split);
+			if (got != want) {
+				printf("%s: len %zu off %zu split %zu: 0x%08x, "
+				       "expected 0x%08x\n", im->name, len, off,
+				       split, got, want);
+				err++;
+			}
+		}
+	}
+
+	return err;
+}
+
+static void bench(struct impl *im, unsigned char *buf)
+{
+	static const size_t sizes[] = { 48, 512, 4096, 65536, 262144 };
+	volatile uint32_t sink;
+	double start, t;
+	long n, loops;
+	int i;
+
+	printf("%-14s", im->name);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		loops = 0;
+		start = now();
+		do {
+			for (n = 0; n < 64; n++)
+				sink = im->fn(~0, buf, sizes[i]);
+			loops += n;
+			t = now() - start;
+		} while (t < seconds);
+		printf(" %10.2f", (double)loops * sizes[i] / t / 1e9);
+	}
+	printf("\n");
+	(void)sink;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = 1024 * 1024;
+	unsigned char *buf;
+	int i, err = 0;
+
+	if (argc > 1)
+		seconds = atof(argv[1]);
+
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	srandom(1);
+	for (i = 0; i < size; i++)
+		buf[i] = random();
+
+	detect();
+	printf("crc32c_le() uses %s\n", crc32c_name());
+
+	for (i = 0; i < NR_IMPLS; i++) {
+		if (!impls[i].supported) {
+			printf("%s: not supported by this CPU\n",
+			       impls[i].name);
+			continue;
+		}
+		err += check_vectors(&impls[i]);
+		err += check_buffers(&impls[i], buf, size);
+	}
+	if (err) {
+		printf("%d mismatches\n", err);
+		return 1;
+	}
+	printf("known answers OK\n\n");
+
+	printf("%-14s %10s %10s %10s %10s %10s  (GB/s)\n", "", "48B", "512B",
+	       "4KB", "64KB", "256KB");
+	for (i = 0; i < NR_IMPLS; i++)
+		if (impls[i].supported)
+			bench(&impls[i], buf);
+
+	return 0;
+}
@@ -0,0 +1,507 @@
+/*
+ * Minimal iSCSI initiator load generator, for benchmarks on machines
+ * without open-iscsi or fio.
+ *
+ * Every session is a thread of its own with a TCP connection, that
+ * logs in to the target without authentication and keeps QD random
+ * READ(10)s or WRITE(10)s of BS bytes in flight on LUN 1, within the
+ * CmdSN window the target gives.  Writes go as immediate data, so BS
+ * may not be larger than 64k for them.  After the run it prints the
+ * IOPS, MB/s and the number of commands that did not complete with
+ * GOOD status.
+ *
+ *	cc -O2 -D_GNU_SOURCE -pthread -o iscsi-loadgen scripts/iscsi-loadgen.c
+ *	./iscsi-loadgen -T iqn [-a addr] [-p port] [-s sessions] [-q qd]
+ *		[-b bs] [-t seconds] [-S span] [-w]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define BHS_SIZE	48
+#define MAX_QD		256
+#define MAX_RECV_DLEN	262144
+
+#define OP_NOOP_OUT	0x00
+#define OP_SCSI_CMD	0x01
+#define OP_LOGIN	0x03
+#define OP_NOOP_IN	0x20
+#define OP_SCSI_RSP	0x21
+#define OP_LOGIN_RSP	0x23
+#define OP_DATA_IN	0x25
+#define OP_REJECT	0x3f
+
+static const char *addr = "127.0.0.1";
+static const char *port = "3260";
+static const char *target;
+static int nr_sessions = 1;
+static int qd = 32;
+static unsigned int bs = 4096;
+static unsigned long long span = 64 << 20;
+static int seconds = 10;
+static int do_write;
+
+static volatile int running = 1;
+static pthread_barrier_t logged_in;
+
+struct session {
+	pthread_t thread;
+	int fd;
+	int id;
+	uint32_t cmdsn;
+	uint32_t max_cmdsn;
+	uint32_t exp_statsn;
+	uint16_t tsih;
+	unsigned int seed;
+	unsigned long long done;
+	unsigned long long errors;
+	unsigned char *buf;
+	int failed;
+};
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t get_be32(unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int full_write(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(fd, iov, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int full_read(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int send_pdu(struct session *s, unsigned char *bhs, void *data,
+		    unsigned int len)
+{
+	static unsigned char pad[4];
+	struct iovec iov[3];
+	int cnt = 1;
+
+	bhs[5] = len >> 16;
+	bhs[6] = len >> 8;
+	bhs[7] = len;
+
+	iov[0].iov_base = bhs;
+	iov[0].iov_len = BHS_SIZE;
+	if (len) {
+		iov[cnt].iov_base = data;
+		iov[cnt++].iov_len = len;
+		if (len & 3) {
+			iov[cnt].iov_base = pad;
+			iov[cnt++].iov_len = 4 - (len & 3);
+		}
+	}
+
+	return full_write(s->fd, iov, cnt);
+}
+
+/* reads a PDU into bhs and s->buf, returns the data length */
+static int recv_pdu(struct session *s, unsigned char *bhs)
+{
+	unsigned int len;
+	unsigned char op;
+
+	if (full_read(s->fd, bhs, BHS_SIZE))
+		return -1;
+
+	len = bhs[5] << 16 | bhs[6] << 8 | bhs[7];
+	if (bhs[4] || len > MAX_RECV_DLEN)
+		return -1;
+	if (len && full_read(s->fd, s->buf, (len + 3) & ~3))
+		return -1;
+
+	op = bhs[0] & 0x3f;
+	if (op == OP_SCSI_RSP || op == OP_NOOP_IN || op == OP_LOGIN_RSP ||
+	    (op == OP_DATA_IN && (bhs[1] & 0x01)))
+		s->exp_statsn = get_be32(bhs + 24) + 1;
+	if (op != OP_LOGIN_RSP)
+		s->max_cmdsn = get_be32(bhs + 32);
+
+	return len;
+}
+
+/* returns the flags of the login response */
+static int login_stage(struct session *s, int csg, int nsg, char *keys,
+		       int len)
+{
+	unsigned char bhs[BHS_SIZE];
+	int ret;
+
+	memset(bhs, 0, sizeof(bhs));
+	bhs[0] = 0x40 | OP_LOGIN;
+	bhs[1] = 0x80 | csg << 2 | nsg;
+	/* random qualifier ISID, one per session */
+	bhs[8] = 0x80;
+	put_be32(bhs + 9, getpid() << 8);
+	bhs[12] = s->id >> 8;
+	bhs[13] = s->id;
+	bhs[14] = s->tsih >> 8;
+	bhs[15] = s->tsih;
+	put_be32(bhs + 24, s->cmdsn);
+	put_be32(bhs + 28, s->exp_statsn);
+
+	if (send_pdu(s, bhs, keys, len))
+		return -1;
+
+	ret = recv_pdu(s, bhs);
+	if (ret < 0 || (bhs[0] & 0x3f) != OP_LOGIN_RSP)
+		return -1;
+	if (bhs[36]) {
+		fprintf(stderr, "session %d: login failed, %02x %02x\n",
+			s->id, bhs[36], bhs[37]);
+		return -1;
+	}
+
+	s->tsih = bhs[14] << 8 | bhs[15];
+	s->max_cmdsn = get_be32(bhs + 32);
+	return bhs[1];
+}
+
+static int login(struct session *s)
+{
+	char keys[1024];
+	int len, flags;
+
+	len = snprintf(keys, sizeof(keys),
+		       "InitiatorName=iqn.2007-03:iscsi-loadgen:%d%c"
+		       "TargetName=%s%cSessionType=Normal%c"
+		       "AuthMethod=None%c", s->id, 0, target, 0, 0, 0);
+	if (login_stage(s, 0, 1, keys, len) < 0)
+		return -1;
+
+	len = snprintf(keys, sizeof(keys),
+		       "HeaderDigest=None%cDataDigest=None%c"
+		       "MaxRecvDataSegmentLength=%d%c"
+		       "InitialR2T=Yes%cImmediateData=Yes%c"
+		       "MaxBurstLength=262144%cFirstBurstLength=65536%c"
+		       "ErrorRecoveryLevel=0%c", 0, 0, MAX_RECV_DLEN, 0,
+		       0, 0, 0, 0, 0);
+	flags = login_stage(s, 1, 3, keys, len);
+
+	/* the target answers with its own keys before it lets us go on */
+	while (flags >= 0 && !(flags & 0x80))
+		flags = login_stage(s, 1, 3, NULL, 0);
+
+	return flags < 0 ? -1 : 0;
+}
+
+static int connect_target(struct session *s)
+{
+	struct addrinfo hints, *res;
+	int opt = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr, port, &hints, &res)) {
+		fprintf(stderr, "can't resolve %s\n", addr);
+		return -1;
+	}
+
+	s->fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (s->fd < 0 || connect(s->fd, res->ai_addr, res->ai_addrlen)) {
+		perror("connect");
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	return 0;
+}
+
+/* clears the unit attention of the new I_T nexus */
+static int test_unit_ready(struct session *s)
+{
+	unsigned char bhs[BHS_SIZE];
+	int op;
+
+	memset(bhs, 0, sizeof(bhs));
+	bhs[0] = OP_SCSI_CMD;
+	bhs[1] = 0x80 | 0x01;
+	bhs[9] = 1;
+	put_be32(bhs + 16, MAX_QD);
+	put_be32(bhs + 24, s->cmdsn++);
+	put_be32(bhs + 28, s->exp_statsn);
+
+	if (send_pdu(s, bhs, NULL, 0))
+		return -1;
+
+	do {
+		if (recv_pdu(s, bhs) < 0)
+			return -1;
+		op = bhs[0] & 0x3f;
+	} while (op != OP_SCSI_RSP && op != OP_REJECT);
+
+	return op == OP_SCSI_RSP ? 0 : -1;
+}
+
+static int submit(struct session *s, uint32_t itt)
+{
+	unsigned char bhs[BHS_SIZE], *cdb = bhs + 32;
+	uint32_t blocks = bs / 512;
+	uint32_t lba;
+
+	lba = (rand_r(&s->seed) % (span / bs)) * blocks;
+
+	memset(bhs, 0, sizeof(bhs));
+	bhs[0] = OP_SCSI_CMD;
+	/* final, simple task attribute */
+	bhs[1] = 0x80 | (do_write ? 0x20 : 0x40) | 0x01;
+	bhs[9] = 1;
+	put_be32(bhs + 16, itt);
+	put_be32(bhs + 20, bs);
+	put_be32(bhs + 24, s->cmdsn++);
+	put_be32(bhs + 28, s->exp_statsn);
+
+	cdb[0] = do_write ? 0x2a : 0x28;
+	put_be32(cdb + 2, lba);
+	cdb[7] = blocks >> 8;
+	cdb[8] = blocks;
+
+	return send_pdu(s, bhs, s->buf + MAX_RECV_DLEN,
+			do_write ? bs : 0);
+}
+
+static int nop_reply(struct session *s, unsigned char *in)
+{
+	unsigned char bhs[BHS_SIZE];
+
+	memset(bhs, 0, sizeof(bhs));
+	bhs[0] = 0x40 | OP_NOOP_OUT;
+	bhs[1] = 0x80;
+	memcpy(bhs + 8, in + 8, 8);
+	put_be32(bhs + 16, 0xffffffff);
+	memcpy(bhs + 20, in + 20, 4);
+	put_be32(bhs + 24, s->cmdsn);
+	put_be32(bhs + 28, s->exp_statsn);
+
+	return send_pdu(s, bhs, NULL, 0);
+}
+
+/* CmdSN serial arithmetic, RFC 1982 */
+static inline int cmdsn_in_window(struct session *s)
+{
+	return (int32_t)(s->cmdsn - s->max_cmdsn) <= 0;
+}
+
+static void *session_run(void *arg)
+{
+	struct session *s = arg;
+	unsigned char bhs[BHS_SIZE];
+	uint32_t free_itts[MAX_QD];
+	int nr_free = 0, i, op;
+
+	s->buf = malloc(MAX_RECV_DLEN + bs);
+	if (!s->buf || connect_target(s) || login(s) || test_unit_ready(s))
+		s->failed = 1;
+
+	/* the clock starts when all the sessions are there */
+	pthread_barrier_wait(&logged_in);
+	if (s->failed) {
+		fprintf(stderr, "session %d: login failed\n", s->id);
+		return NULL;
+	}
+	memset(s->buf + MAX_RECV_DLEN, 0x5a, bs);
+
+	for (i = 0; i < qd; i++)
+		free_itts[nr_free++] = i;
+
+	while (1) {
+		while (running && nr_free && cmdsn_in_window(s))
+			if (submit(s, free_itts[--nr_free]))
+				goto fail;
+
+		if (nr_free == qd)
+			break;
+
+		if (recv_pdu(s, bhs) < 0)
+			goto fail;
+
+		op = bhs[0] & 0x3f;
+		switch (op) {
+		case OP_DATA_IN:
+			if (!(bhs[1] & 0x01))
+				break;
+			if (bhs[3])
+				s->errors++;
+			s->done++;
+			free_itts[nr_free++] = get_be32(bhs + 16);
+			break;
+		case OP_SCSI_RSP:
+			if (bhs[2] || bhs[3])
+				s->errors++;
+			s->done++;
+			free_itts[nr_free++] = get_be32(bhs + 16);
+			break;
+		case OP_NOOP_IN:
+			if (get_be32(bhs + 20) != 0xffffffff &&
+			    nop_reply(s, bhs))
+				goto fail;
+			break;
+		case OP_REJECT:
+			fprintf(stderr, "session %d: PDU rejected, %02x\n",
+				s->id, bhs[2]);
+			goto fail;
+		}
+	}
+
+	close(s->fd);
+	return NULL;
+fail:
+	fprintf(stderr, "session %d: connection lost\n", s->id);
+	s->failed = 1;
+	close(s->fd);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: iscsi-loadgen -T iqn [-a addr] [-p port] "
+		"[-s sessions] [-q qd] [-b bs] [-t seconds] [-S span] "
+		"[-w]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct session *sessions;
+	struct timespec start, end;
+	unsigned long long done = 0, errors = 0;
+	double elapsed;
+	int i, c, failed = 0;
+
+	while ((c = getopt(argc, argv, "a:p:T:s:q:b:t:S:w")) != -1) {
+		switch (c) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'T':
+			target = optarg;
+			break;
+		case 's':
+			nr_sessions = atoi(optarg);
+			break;
+		case 'q':
+			qd = atoi(optarg);
+			break;
+		case 'b':
+			bs = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'S':
+			span = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			do_write = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!target || nr_sessions < 1 || qd < 1 || qd > MAX_QD ||
+	    !bs || bs % 512 || bs > MAX_RECV_DLEN || span < bs ||
+	    (do_write && bs > 65536))
+		usage();
+
+	sessions = calloc(nr_sessions, sizeof(*sessions));
+	if (!sessions)
+		return 1;
+
+	pthread_barrier_init(&logged_in, NULL, nr_sessions + 1);
+	for (i = 0; i < nr_sessions; i++) {
+		sessions[i].id = i;
+		sessions[i].seed = getpid() + i;
+		sessions[i].cmdsn = 1;
+		if (pthread_create(&sessions[i].thread, NULL, session_run,
+				   &sessions[i]))
+			return 1;
+	}
+
+	pthread_barrier_wait(&logged_in);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sleep(seconds);
+	running = 0;
+
+	for (i = 0; i < nr_sessions; i++) {
+		pthread_join(sessions[i].thread, NULL);
+		done += sessions[i].done;
+		errors += sessions[i].errors;
+		failed += sessions[i].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%.0f %.1f %llu\n", done / elapsed,
+	       done * (double)bs / elapsed / (1 << 20), errors);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+#
+# Common parts of the tgt-*-bench scripts, which source this file.
+#
+# A bench starts a fresh tgtd on a private control port with a loopback
+# portal, exports targets with null backed LUNs and logs open-iscsi
+# sessions in to them.  The script sets IQN, the target its sessions go
+# to, before sourcing this file.  TGTD, TGTADM, PORT and CPORT can be
+# set in the environment.
+#
+
+TGTD=${TGTD:-tgtd}
+TGTADM=${TGTADM:-tgtadm}
+PORT=${PORT:-3261}
+CPORT=${CPORT:-77}
+PORTAL=127.0.0.1:$PORT
+HZ=`getconf CLK_TCK`
+
+# exits unless the given programs, tgtd and tgtadm are there
+need_tools() {
+	local p
+
+	for p in "$@" $TGTD $TGTADM; do
+		if ! which $p > /dev/null 2>&1; then
+			echo "$p not found"
+			exit 1
+		fi
+	done
+}
+
+# the main tgtd process, the newest one may be the logger it forks
+tgtd_pid() {
+	local pid=`pgrep -n -x tgtd`
+	local ppid=`ps -o ppid= -p $pid`
+
+	[ "`ps -o comm= -p $ppid`" = tgtd ] && pid=$ppid
+	echo $pid
+}
+
+# starts tgtd with the given arguments, ISCSI_OPTS goes after the portal
+start_tgtd() {
+	$TGTD -C $CPORT "$@" --iscsi portal=$PORTAL$ISCSI_OPTS
+	sleep 1
+	TGTD_PID=`tgtd_pid`
+}
+
+# add_target tid iqn [luns], with null backed LUNs 1 to luns
+add_target() {
+	local lun
+
+	$TGTADM -C $CPORT --lld iscsi --mode target --op new --tid $1 -T $2
+	for lun in `seq 1 ${3:-1}`; do
+		$TGTADM -C $CPORT --lld iscsi --mode logicalunit --op new \
+			--tid $1 --lun $lun --bstype null -b /dev/null/$lun
+	done
+	$TGTADM -C $CPORT --lld iscsi --mode target --op bind --tid $1 -I ALL
+}
+
+# login_sessions count [name=value...], the node settings for each
+login_sessions() {
+	local i kv n=$1
+
+	shift
+	iscsiadm -m discovery -t st -p $PORTAL > /dev/null
+	for i in `seq 1 $n`; do
+		iscsiadm -m iface -I bench$i -o new > /dev/null 2>&1
+		iscsiadm -m node -T $IQN -p $PORTAL -I bench$i \
+			-o new > /dev/null 2>&1
+		for kv in "$@"; do
+			iscsiadm -m node -T $IQN -p $PORTAL -I bench$i \
+				-o update -n ${kv%%=*} -v ${kv#*=} > /dev/null
+		done
+		iscsiadm -m node -T $IQN -p $PORTAL -I bench$i -l > /dev/null
+	done
+	sleep 2
+}
+
+# logout_all count [iface prefix] [iqn]
+logout_all() {
+	local i
+
+	for i in `seq 1 $1`; do
+		iscsiadm -m node -T ${3:-$IQN} -p $PORTAL -I ${2:-bench}$i \
+			-u > /dev/null 2>&1
+		iscsiadm -m iface -I ${2:-bench}$i -o delete > /dev/null 2>&1
+	done
+}
+
+# the disks of the given LUN of all the sessions, as a fio file list
+bench_disks() {
+	local devs
+
+	# the by-path names have colons, which fio takes as separators
+	devs=`ls /dev/disk/by-path/ | grep "$PORTAL-iscsi-$IQN-lun-$1\$" | \
+		sed 's,^,/dev/disk/by-path/,' | xargs -r readlink -f`
+	if [ -z "$devs" ]; then
+		echo "no iSCSI disks found" >&2
+		return 1
+	fi
+	echo $devs | tr ' ' ':'
+}
+
+# logs out everything on the portal and stops tgtd
+cleanup() {
+	local tid
+
+	iscsiadm -m node -p $PORTAL -u > /dev/null 2>&1
+	iscsiadm -m node -p $PORTAL -o delete > /dev/null 2>&1
+	for tid in `$TGTADM -C $CPORT --lld iscsi --mode target --op show \
+		2> /dev/null | awk '/^Target/ { print $2 + 0 }'`; do
+		$TGTADM -C $CPORT --lld iscsi --mode target --op delete \
+			--force --tid $tid > /dev/null 2>&1
+	done
+	$TGTADM -C $CPORT --op delete --mode system > /dev/null 2>&1
+	sleep 1
+}
+
+# user plus system clock ticks of the process
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+# tgtd CPU usecs per I/O between two cpu_ticks readings: t0 t1 ios
+us_per_io() {
+	awk "BEGIN { if ($3) printf \"%.2f\", ($2 - $1) * 1e6 / $HZ / $3 }"
+}
+
+# prints the given completion latency percentile of fio json in usecs
+clat() {
+	awk -F: "/\"$1\" :/ { gsub(/[ ,]/, \"\", \$2);
+		printf \"%.0f\", \$2 / 1000; exit }"
+}
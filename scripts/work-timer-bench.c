@@ -0,0 +1,322 @@
+/*
+ * Benchmark for the work.c timer wheel
+ *
+ * Builds usr/work.c in with a simulated clock and compares it with the
+ * old scheduler: a sorted list with O(n) insertion, and NOP-In keepalive
+ * done by one global work that sweeps every connection once a second.
+ * First it checks that works with random due times run right when they
+ * are due, and fails if one does not.
+ *
+ *	cc -O2 -D_GNU_SOURCE -Iusr -o work-timer-bench scripts/work-timer-bench.c
+ *	./work-timer-bench [nr_timers] [nop_interval]
+ *
+ * The sorted list is quadratic, that part alone takes a while with 50k.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned int fake_msecs;
+
+static int fake_clock_gettime(clockid_t id, struct timespec *t)
+{
+	t->tv_sec = fake_msecs / 1000;
+	t->tv_nsec = (fake_msecs % 1000) * 1000000L;
+	return 0;
+}
+
+#define clock_gettime(id, t)	fake_clock_gettime(id, t)
+#include "work.c"
+#undef clock_gettime
+
+int is_debug;
+
+void log_error(const char *fmt, ...)
+{
+}
+
+void log_debug(const char *fmt, ...)
+{
+}
+
+int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+{
+	return 0;
+}
+
+void tgt_event_del(int fd)
+{
+}
+
+static int nr_timers = 50000;
+static int interval = 5;
+static long nr_expired;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the old add_work(): sorted list, insertion walks from the head */
+static LIST_HEAD(sorted_list);
+
+static void list_add_work(struct tgt_work *work, unsigned int msecs)
+{
+	struct tgt_work *ent;
+
+	work->when = fake_msecs + msecs;
+
+	list_for_each_entry(ent, &sorted_list, entry) {
+		if (before(work->when, ent->when))
+			break;
+	}
+	list_add_tail(&work->entry, &ent->entry);
+}
+
+/* roughly the size of struct iscsi_tcp_connection */
+struct conn {
+	struct tgt_work nop_work;
+	struct list_head siblings;
+	char pad[2048];
+	int nop_tick;
+};
+
+static struct conn **conns;
+static LIST_HEAD(conn_list);
+
+static void nop_expired(void *data)
+{
+	struct conn *c = data;
+
+	nr_expired++;
+	add_work(&c->nop_work, interval);
+}
+
+struct check_work {
+	struct tgt_work work;
+	unsigned int due;
+	int rearm;
+};
+
+static long nr_checked, nr_late;
+
+/* spread over tv1 and the tvn levels */
+static unsigned int check_delay(void)
+{
+	switch (random() % 5) {
+	case 0:
+		return random() % TVR_SIZE;
+	case 1:
+		return random() % (1U << TV_SHIFT(0));
+	case 2:
+		return random() % (1U << TV_SHIFT(1));
+	case 3:
+		return random() % (1U << TV_SHIFT(2));
+	default:
+		return random() % (1U << TV_SHIFT(3));
+	}
+}
+
+static void check_expired(void *data)
+{
+	struct check_work *c = data;
+	unsigned int msecs;
+
+	nr_checked++;
+	if (fake_msecs != c->due && nr_late++ < 10)
+		printf("work due at %u ran at %u\n", c->due, fake_msecs);
+
+	/* a running work adds the next one, like a NOP-In timer */
+	if (c->rearm-- > 0) {
+		msecs = 1 + check_delay();
+		c->due = fake_msecs + msecs;
+		add_work_msecs(&c->work, msecs);
+	}
+}
+
+/*
+ * Works are added in batches in between timer runs, at random times
+ * and on 256 msec boundaries, and the clock only moves to where tgtd
+ * would arm the timer.  Every work has to run at its due time.
+ */
+static int check_expiry(int nr)
+{
+	struct check_work *works, *c;
+	unsigned int next_add, msecs;
+	int i, added = 0;
+
+	works = calloc(nr, sizeof(*works));
+	if (!works) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srandom(3);
+	timer_started = 1;
+	next_add = fake_msecs;
+
+	while (added < nr || nr_works) {
+		if (added < nr &&
+		    (!timer_armed || !before(timer_expires, next_add))) {
+			fake_msecs = next_add;
+			for (i = 0; i < 16 && added < nr; i++) {
+				c = &works[added++];
+				INIT_LIST_HEAD(&c->work.entry);
+				c->work.func = check_expired;
+				c->work.data = c;
+				c->rearm = random() % 3;
+
+				msecs = check_delay();
+				c->due = fake_msecs + msecs;
+				add_work_msecs(&c->work, msecs);
+			}
+
+			next_add = fake_msecs + random() % 2000;
+			if (random() % 2)
+				next_add = (next_add | TVR_MASK) + 1;
+			continue;
+		}
+
+		if (before(fake_msecs, timer_expires))
+			fake_msecs = timer_expires;
+		timer_armed = 0;
+		execute_work();
+	}
+
+	timer_started = 0;
+	free(works);
+
+	printf("%-34s %10ld works, %ld late\n", "expiry check", nr_checked,
+	       nr_late);
+	return nr_late ? 1 : 0;
+}
+
+static void bench_add_del(void)
+{
+	double t;
+	int i;
+
+	srandom(1);
+	t = now();
+	for (i = 0; i < nr_timers; i++)
+		list_add_work(&conns[i]->nop_work, random() % 60000);
+	printf("%-34s %10.1f ns/op\n", "sorted list add",
+	       (now() - t) * 1e9 / nr_timers);
+	for (i = 0; i < nr_timers; i++)
+		list_del_init(&conns[i]->nop_work.entry);
+
+	srandom(1);
+	t = now();
+	for (i = 0; i < nr_timers; i++)
+		add_work_msecs(&conns[i]->nop_work, random() % 60000);
+	printf("%-34s %10.1f ns/op\n", "timer wheel add",
+	       (now() - t) * 1e9 / nr_timers);
+
+	t = now();
+	for (i = 0; i < nr_timers; i++)
+		del_work(&conns[i]->nop_work);
+	printf("%-34s %10.1f ns/op\n", "timer wheel del",
+	       (now() - t) * 1e9 / nr_timers);
+}
+
+static void bench_keepalive(int seconds)
+{
+	struct conn *c;
+	unsigned int end;
+	double t;
+	int i, s;
+
+	/*
+	 * old: one work a second walks the connection list, which is in
+	 * no particular memory order once connections come and go
+	 */
+	srandom(2);
+	for (i = 0; i < nr_timers; i++) {
+		c = conns[random() % nr_timers];
+		if (list_empty(&c->siblings)) {
+			c->nop_tick = 1 + i % interval;
+			list_add(&c->siblings, &conn_list);
+		}
+	}
+	for (i = 0; i < nr_timers; i++) {
+		if (list_empty(&conns[i]->siblings)) {
+			conns[i]->nop_tick = 1 + i % interval;
+			list_add(&conns[i]->siblings, &conn_list);
+		}
+	}
+
+	t = now();
+	for (s = 0; s < seconds; s++) {
+		list_for_each_entry(c, &conn_list, siblings) {
+			if (--c->nop_tick > 0)
+				continue;
+			c->nop_tick = interval;
+			nr_expired++;
+		}
+	}
+	t = now() - t;
+	printf("%-34s %10.3f ms CPU per simulated second (%ld pings)\n",
+	       "global NOP sweep", t * 1e3 / seconds, nr_expired);
+
+	/* new: one timer per connection, the wheel wakes at expiry only */
+	nr_expired = 0;
+	for (i = 0; i < nr_timers; i++) {
+		INIT_LIST_HEAD(&conns[i]->nop_work.entry);
+		conns[i]->nop_work.func = nop_expired;
+		conns[i]->nop_work.data = conns[i];
+		add_work_msecs(&conns[i]->nop_work,
+			       (i * (interval * 1000 / 97)) % (interval * 1000));
+	}
+
+	end = fake_msecs + seconds * 1000;
+	t = now();
+	while (before(fake_msecs, end)) {
+		fake_msecs = next_expiry();
+		execute_work();
+	}
+	t = now() - t;
+	printf("%-34s %10.3f ms CPU per simulated second (%ld pings)\n",
+	       "per-connection timers", t * 1e3 / seconds, nr_expired);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc > 1)
+		nr_timers = atoi(argv[1]);
+	if (argc > 2)
+		interval = atoi(argv[2]);
+
+	conns = calloc(nr_timers, sizeof(*conns));
+	for (i = 0; conns && i < nr_timers; i++) {
+		conns[i] = calloc(1, sizeof(**conns));
+		if (!conns[i])
+			break;
+		INIT_LIST_HEAD(&conns[i]->siblings);
+	}
+	if (!conns || i < nr_timers) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	fake_msecs = 1000;
+	wheel_init();
+
+	if (check_expiry(20000))
+		return 1;
+
+	printf("%d timers, NOP interval %d seconds\n", nr_timers, interval);
+	bench_add_del();
+	bench_keepalive(60);
+
+	return 0;
+}
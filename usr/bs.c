@@ -37,7 +37,9 @@
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <linux/types.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
 
 #include "list.h"
@@ -52,10 +54,11 @@ LIST_HEAD(bst_list);
 static LIST_HEAD(finished_list);
 static pthread_mutex_t finished_lock;
 
-/* used by both bs_rdwr.c and bs_rbd.c */
+/* size of the worker pool shared by the thread based backing stores */
 int nr_iothreads = 16;
 
-static int sig_fd = -1;
+/* per-LU eventfd completion, otherwise the notify thread below */
+static int use_eventfd;
 
 static int command_fd[2];
 static int done_fd[2];
@@ -186,78 +189,223 @@ rewrite:
 	}
 }
 
-static void bs_sig_request_done(int fd, int events, void *data)
+static void bs_thread_eventfd_done(int fd, int events, void *data)
 {
-	int ret;
+	struct bs_thread_info *info = data;
+	struct list_head *node, *next, *ready, *prev = NULL;
 	struct scsi_cmd *cmd;
-	struct signalfd_siginfo siginfo[16];
-	LIST_HEAD(list);
+	eventfd_t val;
 
-	ret = read(fd, (char *)siginfo, sizeof(siginfo));
-	if (ret <= 0) {
-		return;
+	/* read before taking the stack so that no kick is lost */
+	eventfd_read(fd, &val);
+
+	/*
+	 * A worker reports progress before it completes a command, so
+	 * taking the done stack first means that every progress report
+	 * of a command completed here is in the ready stack taken next.
+	 */
+	node = __atomic_exchange_n(&info->done_head, NULL, __ATOMIC_ACQUIRE);
+	ready = __atomic_exchange_n(&info->ready_head, NULL, __ATOMIC_ACQUIRE);
+
+	for (; ready; ready = next) {
+		next = ready->next;
+		cmd = list_entry(ready, struct scsi_cmd, bs_ready);
+		__atomic_store_n(&cmd->bs_ready_queued, 0, __ATOMIC_SEQ_CST);
+		target_cmd_data_ready(cmd);
 	}
 
-	pthread_mutex_lock(&finished_lock);
-	list_splice_init(&finished_list, &list);
-	pthread_mutex_unlock(&finished_lock);
+	/* the stack is LIFO, reverse it to complete in order */
+	while (node) {
+		next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
+	}
 
-	while (!list_empty(&list)) {
-		cmd = list_first_entry(&list, struct scsi_cmd, bs_list);
+	for (node = prev; node; node = next) {
+		next = node->next;
+		cmd = list_entry(node, struct scsi_cmd, bs_list);
+		target_cmd_io_done(cmd, scsi_get_result(cmd));
+	}
+}
 
-		list_del(&cmd->bs_list);
+static void bs_thread_push(struct bs_thread_info *info,
+			   struct list_head **stack, struct list_head *node)
+{
+	struct list_head *head;
+
+	head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	do {
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(stack, &head, node, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/* tgtd drains everything, only the first one needs a wakeup */
+	if (!head)
+		eventfd_write(info->done_fd, 1);
+}
 
-		target_cmd_io_done(cmd, scsi_get_result(cmd));
+static void bs_thread_complete(struct bs_thread_info *info,
+			       struct scsi_cmd *cmd)
+{
+	bs_thread_push(info, &info->done_head, &cmd->bs_list);
+}
+
+/*
+ * Called by request_fn of a TGT_CMD_STREAM command when the first len
+ * bytes of the in buffer are filled. The transport is told from tgtd;
+ * a command is on the ready stack at most once, tgtd reads the latest
+ * length when it gets to it.
+ */
+void bs_thread_cmd_data_ready(struct scsi_cmd *cmd, uint32_t len)
+{
+	struct bs_thread_info *info = BS_THREAD_I(cmd->dev);
+
+	__atomic_store_n(&cmd->in_ready, len, __ATOMIC_RELEASE);
+
+	if (!__atomic_exchange_n(&cmd->bs_ready_queued, 1, __ATOMIC_SEQ_CST))
+		bs_thread_push(info, &info->ready_head, &cmd->bs_ready);
+}
+
+/* iterations a worker polls for new commands before it sleeps */
+#define BS_POOL_SPIN	4096
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static struct bs_thread_pool *shared_pool;
+static LIST_HEAD(bs_pool_batch_list);
+
+static void bs_pool_wake(struct bs_thread_pool *pool)
+{
+	/* a spinning worker will see nr_pending by itself */
+	if (__atomic_load_n(&pool->nr_spinning, __ATOMIC_SEQ_CST) ||
+	    !__atomic_load_n(&pool->nr_sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static struct scsi_cmd *bs_pool_take(struct bs_pool_worker *w)
+{
+	struct bs_thread_pool *pool = w->pool;
+	struct bs_pool_worker *victim;
+	struct scsi_cmd *cmd = NULL;
+	int i, idx = w - pool->workers;
+
+	for (i = 0; i < pool->nr_workers && !cmd; i++) {
+		victim = &pool->workers[(idx + i) % pool->nr_workers];
+
+		pthread_mutex_lock(&victim->lock);
+		if (!list_empty(&victim->queue)) {
+			/* FIFO for our own queue, steal the newest otherwise */
+			if (victim == w)
+				cmd = list_first_entry(&victim->queue,
+						       struct scsi_cmd, bs_list);
+			else
+				cmd = list_entry(victim->queue.prev,
+						 struct scsi_cmd, bs_list);
+			list_del(&cmd->bs_list);
+		}
+		pthread_mutex_unlock(&victim->lock);
 	}
+
+	if (cmd)
+		__atomic_sub_fetch(&pool->nr_pending, 1, __ATOMIC_SEQ_CST);
+
+	return cmd;
 }
 
-/* Unlock mutex even if thread is cancelled */
-static void mutex_cleanup(void *mutex)
+static void bs_pool_wait(struct bs_thread_pool *pool)
 {
-	pthread_mutex_unlock(mutex);
+	int i;
+
+	__atomic_add_fetch(&pool->nr_spinning, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < BS_POOL_SPIN; i++) {
+		if (__atomic_load_n(&pool->nr_pending, __ATOMIC_RELAXED))
+			break;
+		cpu_relax();
+	}
+	__atomic_sub_fetch(&pool->nr_spinning, 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * nr_sleeping is raised before nr_pending is checked and the
+	 * submitter raises nr_pending before checking nr_sleeping, so
+	 * one of the two always sees the other.
+	 */
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&pool->nr_pending, __ATOMIC_SEQ_CST) &&
+	       !pool->stop)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	__atomic_sub_fetch(&pool->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
 }
 
 static void *bs_thread_worker_fn(void *arg)
 {
-	struct bs_thread_info *info = arg;
+	struct bs_pool_worker *w = arg;
+	struct bs_thread_pool *pool = w->pool;
+	struct bs_thread_info *info;
 	struct scsi_cmd *cmd;
 	sigset_t set;
 
 	sigfillset(&set);
 	sigprocmask(SIG_BLOCK, &set, NULL);
 
-	while (1) {
-		pthread_mutex_lock(&info->pending_lock);
-		pthread_cleanup_push(mutex_cleanup, &info->pending_lock);
-
-		while (list_empty(&info->pending_list))
-			pthread_cond_wait(&info->pending_cond,
-					  &info->pending_lock);
+	/* allocations made by the backing store come from the LU's node */
+	if (pool->numa_node >= 0) {
+		unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+		int bits = 8 * sizeof(unsigned long);
+
+		memset(mask, 0, sizeof(mask));
+		mask[pool->numa_node / bits] |= 1UL << (pool->numa_node % bits);
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			    sizeof(mask) * 8))
+			eprintf("can't set memory policy to node %d, %m\n",
+				pool->numa_node);
+	}
 
-		cmd = list_first_entry(&info->pending_list,
-				       struct scsi_cmd, bs_list);
+	while (!pool->stop) {
+		cmd = bs_pool_take(w);
+		if (!cmd) {
+			bs_pool_wait(pool);
+			continue;
+		}
 
-		list_del(&cmd->bs_list);
-		pthread_cleanup_pop(1); /* Unlock pending_lock mutex */
+		/* more work queued, get another worker going */
+		if (__atomic_load_n(&pool->nr_pending, __ATOMIC_SEQ_CST))
+			bs_pool_wake(pool);
 
+		info = BS_THREAD_I(cmd->dev);
 		info->request_fn(cmd);
 
+		if (use_eventfd) {
+			bs_thread_complete(info, cmd);
+			continue;
+		}
+
 		pthread_mutex_lock(&finished_lock);
 		list_add_tail(&cmd->bs_list, &finished_list);
 		pthread_mutex_unlock(&finished_lock);
 
-		if (sig_fd < 0)
-			pthread_cond_signal(&finished_cond);
-		else
-			kill(getpid(), SIGUSR2);
+		pthread_cond_signal(&finished_cond);
 	}
 
 	pthread_exit(NULL);
 }
 
-static int bs_init_signalfd(void)
+static void bs_init_modules(void)
 {
-	sigset_t mask;
 	int ret;
 	DIR *dir;
 
@@ -304,25 +452,18 @@ static int bs_init_signalfd(void)
 		}
 		closedir(dir);
 	}
+}
 
-	pthread_mutex_init(&finished_lock, NULL);
-
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGUSR2);
-	sigprocmask(SIG_BLOCK, &mask, NULL);
-
-	sig_fd = __signalfd(-1, &mask, 0);
-	if (sig_fd < 0)
-		return 1;
-
-	ret = tgt_event_add(sig_fd, EPOLLIN, bs_sig_request_done, NULL);
-	if (ret < 0) {
-		close (sig_fd);
-		sig_fd = -1;
+static int bs_init_eventfd(void)
+{
+	int fd;
 
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0)
 		return 1;
-	}
+	close(fd);
 
+	use_eventfd = 1;
 	return 0;
 }
 
@@ -382,9 +523,11 @@ int bs_init(void)
 {
 	int ret;
 
-	ret = bs_init_signalfd();
+	bs_init_modules();
+
+	ret = bs_init_eventfd();
 	if (!ret) {
-		eprintf("use signalfd notification\n");
+		eprintf("use eventfd notification\n");
 		return 0;
 	}
 
@@ -397,83 +540,389 @@ int bs_init(void)
 	return 1;
 }
 
-tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
-			  int nr_threads)
+static void bs_pool_stop(struct bs_thread_pool *pool, int nr)
 {
-	int i, ret;
+	int i;
 
-	info->worker_thread = zalloc(sizeof(pthread_t) * nr_threads);
-	if (!info->worker_thread)
-		return TGTADM_NOMEM;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
 
-	eprintf("%d\n", nr_threads);
-	info->request_fn = rfn;
+	for (i = 0; i < nr; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
 
-	INIT_LIST_HEAD(&info->pending_list);
+static struct bs_thread_pool *bs_pool_create(int nr_threads, cpu_set_t *cpus,
+					     int numa_node)
+{
+	struct bs_thread_pool *pool;
+	struct bs_pool_worker *w;
+	int i, j, ret;
+
+	pool = zalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = zalloc(sizeof(*w) * nr_threads);
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
 
-	pthread_cond_init(&info->pending_cond, NULL);
-	pthread_mutex_init(&info->pending_lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	INIT_LIST_HEAD(&pool->batch);
+	INIT_LIST_HEAD(&pool->batch_siblings);
+	pool->nr_workers = nr_threads;
+	pool->numa_node = numa_node;
+	if (cpus) {
+		pool->cpus = *cpus;
+		pool->nr_cpus = CPU_COUNT(cpus);
+	}
 
+	/* a running worker steals from all the others */
 	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&info->worker_thread[i], NULL,
-				     bs_thread_worker_fn, info);
+		w = &pool->workers[i];
+		w->pool = pool;
+		pthread_mutex_init(&w->lock, NULL);
+		INIT_LIST_HEAD(&w->queue);
+	}
 
+	for (i = 0; i < nr_threads; i++) {
+		w = &pool->workers[i];
+		ret = pthread_create(&w->thread, NULL, bs_thread_worker_fn, w);
 		if (ret) {
 			eprintf("failed to create a worker thread, %d %s\n",
 				i, strerror(ret));
+			for (j = i; j < nr_threads; j++)
+				pthread_mutex_destroy(&pool->workers[j].lock);
+			bs_pool_stop(pool, i);
+			return NULL;
+		}
+
+		if (pool->nr_cpus) {
+			ret = pthread_setaffinity_np(w->thread,
+						     sizeof(pool->cpus),
+						     &pool->cpus);
 			if (ret)
-				goto destroy_threads;
+				eprintf("can't pin worker thread %d, %s\n",
+					i, strerror(ret));
+		}
+	}
+
+	dprintf("%d worker threads\n", nr_threads);
+
+	return pool;
+}
+
+static void bs_pool_put(struct bs_thread_pool *pool)
+{
+	if (--pool->refcnt)
+		return;
+
+	if (pool == shared_pool)
+		shared_pool = NULL;
+
+	if (!list_empty(&pool->batch_siblings))
+		list_del(&pool->batch_siblings);
+
+	bs_pool_stop(pool, pool->nr_workers);
+}
+
+static tgtadm_err bs_thread_attach(struct bs_thread_info *info,
+				   request_func_t *rfn,
+				   struct bs_thread_pool *pool)
+{
+	int ret;
+
+	if (!pool)
+		return TGTADM_NOMEM;
+	pool->refcnt++;
+
+	info->pool = pool;
+	info->request_fn = rfn;
+
+	info->done_head = NULL;
+	info->ready_head = NULL;
+	info->done_fd = -1;
+	if (use_eventfd) {
+		info->done_fd = eventfd(0, EFD_NONBLOCK);
+		if (info->done_fd < 0) {
+			eprintf("failed to create eventfd, %m\n");
+			goto put_pool;
+		}
+
+		ret = tgt_event_add(info->done_fd, EPOLLIN,
+				    bs_thread_eventfd_done, info);
+		if (ret) {
+			close(info->done_fd);
+			goto put_pool;
 		}
 	}
-	info->nr_worker_threads = nr_threads;
 
 	return TGTADM_SUCCESS;
-destroy_threads:
+put_pool:
+	bs_pool_put(pool);
+	return TGTADM_NOMEM;
+}
+
+tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
+			  int nr_threads)
+{
+	struct bs_thread_pool *pool;
+
+	if (nr_threads == BS_SHARED_POOL) {
+		if (!shared_pool)
+			shared_pool = bs_pool_create(nr_iothreads, NULL, -1);
+		pool = shared_pool;
+	} else
+		pool = bs_pool_create(nr_threads, NULL, -1);
+
+	return bs_thread_attach(info, rfn, pool);
+}
 
-	for (; i > 0; i--) {
-		if (info->worker_thread[i - 1]) {
-			pthread_cancel(info->worker_thread[i - 1]);
-			pthread_join(info->worker_thread[i - 1], NULL);
-			eprintf("stopped the worker thread %d\n", i - 1);
+/* "0-3,8" or "0-3:8", bsopts can't carry commas */
+static int bs_parse_cpulist(char *str, cpu_set_t *set)
+{
+	char *p, *end;
+	long first, last;
+
+	CPU_ZERO(set);
+	for (p = str; *p; ) {
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return -EINVAL;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				return -EINVAL;
 		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		if (*end == ',' || *end == ':')
+			end++;
+		else if (*end && *end != '\n')
+			return -EINVAL;
+		else
+			break;
+		p = end;
 	}
 
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-	free(info->worker_thread);
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
 
-	return TGTADM_NOMEM;
+static int bs_numa_node_cpus(int node, cpu_set_t *set)
+{
+	char path[64], buf[4096];
+	int fd, ret;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return -EINVAL;
+	buf[ret] = '\0';
+
+	return bs_parse_cpulist(buf, set);
+}
+
+/*
+ * threads=N, cpus=LIST and numa=NODE in bsopts give the LU a private
+ * pool sized and pinned as asked; without them the LU uses the shared
+ * pool. Other keys are left to the backing store.
+ */
+tgtadm_err bs_thread_open_opts(struct bs_thread_info *info,
+			       request_func_t *rfn, char *bsopts)
+{
+	char *p, *opts, *val;
+	cpu_set_t cpus, node_cpus;
+	int nr_threads = BS_SHARED_POOL, numa_node = -1, pinned = 0;
+
+	if (!bsopts)
+		return bs_thread_open(info, rfn, BS_SHARED_POOL);
+
+	opts = strdup(bsopts);
+	if (!opts)
+		return TGTADM_NOMEM;
+
+	for (p = opts; (val = strsep(&p, ";")); ) {
+		if (!strncmp(val, "threads=", 8)) {
+			if (str_to_int_range(val + 8, nr_threads, 1, 1024))
+				goto err;
+		} else if (!strncmp(val, "cpus=", 5)) {
+			if (bs_parse_cpulist(val + 5, &cpus))
+				goto err;
+			pinned = 1;
+		} else if (!strncmp(val, "numa=", 5)) {
+			if (str_to_int_range(val + 5, numa_node, 0, 1023))
+				goto err;
+		}
+	}
+
+	if (numa_node >= 0) {
+		if (bs_numa_node_cpus(numa_node, &node_cpus)) {
+			eprintf("can't find cpus of numa node %d\n",
+				numa_node);
+			free(opts);
+			return TGTADM_INVALID_REQUEST;
+		}
+		if (pinned)
+			CPU_AND(&cpus, &cpus, &node_cpus);
+		else
+			cpus = node_cpus;
+		pinned = 1;
+
+		if (!CPU_COUNT(&cpus)) {
+			eprintf("no cpus left on numa node %d\n", numa_node);
+			free(opts);
+			return TGTADM_INVALID_REQUEST;
+		}
+	}
+	free(opts);
+
+	if (nr_threads == BS_SHARED_POOL && !pinned)
+		return bs_thread_open(info, rfn, BS_SHARED_POOL);
+
+	if (nr_threads == BS_SHARED_POOL)
+		nr_threads = nr_iothreads;
+
+	return bs_thread_attach(info, rfn,
+				bs_pool_create(nr_threads,
+					       pinned ? &cpus : NULL,
+					       numa_node));
+err:
+	eprintf("bad backing store thread option \"%s\"\n", val);
+	free(opts);
+	return TGTADM_INVALID_REQUEST;
 }
 
 void bs_thread_close(struct bs_thread_info *info)
 {
-	int i;
+	bs_pool_put(info->pool);
 
-	for (i = 0; i < info->nr_worker_threads && info->worker_thread[i]; i++) {
-		pthread_cancel(info->worker_thread[i]);
-		pthread_join(info->worker_thread[i], NULL);
+	if (info->done_fd >= 0) {
+		tgt_event_del(info->done_fd);
+		close(info->done_fd);
 	}
+}
+
+static void bs_pool_flush(struct bs_thread_pool *pool)
+{
+	struct bs_pool_worker *w;
+	int nr = pool->nr_batch;
+
+	w = &pool->workers[pool->next++ % pool->nr_workers];
 
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-	free(info->worker_thread);
+	pthread_mutex_lock(&w->lock);
+	list_splice_tail_init(&pool->batch, &w->queue);
+	pthread_mutex_unlock(&w->lock);
+
+	pool->nr_batch = 0;
+	list_del_init(&pool->batch_siblings);
+
+	__atomic_add_fetch(&pool->nr_pending, nr, __ATOMIC_SEQ_CST);
+	bs_pool_wake(pool);
 }
 
 int bs_thread_cmd_submit(struct scsi_cmd *cmd)
 {
 	struct scsi_lu *lu = cmd->dev;
 	struct bs_thread_info *info = BS_THREAD_I(lu);
+	struct bs_thread_pool *pool = info->pool, *next;
 
-	pthread_mutex_lock(&info->pending_lock);
-
-	list_add_tail(&cmd->bs_list, &info->pending_list);
+	list_add_tail(&cmd->bs_list, &pool->batch);
+	if (!pool->nr_batch++)
+		list_add_tail(&pool->batch_siblings, &bs_pool_batch_list);
 
-	pthread_mutex_unlock(&info->pending_lock);
+	set_cmd_async(cmd);
 
-	pthread_cond_signal(&info->pending_cond);
+	/* progress is only reported through the eventfd */
+	if (!use_eventfd)
+		clear_cmd_stream(cmd);
 
-	set_cmd_async(cmd);
+	/* hand the batch over to the workers with the last command */
+	if (!cmd_not_last(cmd))
+		list_for_each_entry_safe(pool, next, &bs_pool_batch_list,
+					 batch_siblings)
+			bs_pool_flush(pool);
 
 	return 0;
 }
 
+/*
+ * A transport that marks commands not_last cannot always tell which one
+ * is the last to reach a backing store, so it calls this at the end of
+ * its batch to submit whatever is still held back.
+ */
+void bs_cmd_flush(void)
+{
+	struct backingstore_template *bst;
+	struct bs_thread_pool *pool, *next;
+
+	list_for_each_entry_safe(pool, next, &bs_pool_batch_list,
+				 batch_siblings)
+		bs_pool_flush(pool);
+
+	list_for_each_entry(bst, &bst_list, backingstore_siblings)
+		if (bst->bs_flush)
+			bst->bs_flush();
+}
+
+static void cpuset_to_str(cpu_set_t *set, char *buf, int len)
+{
+	int i, first = -1, n = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i <= CPU_SETSIZE && n < len; i++) {
+		if (i < CPU_SETSIZE && CPU_ISSET(i, set)) {
+			if (first < 0)
+				first = i;
+			continue;
+		}
+		if (first < 0)
+			continue;
+
+		if (first == i - 1)
+			n += snprintf(buf + n, len - n, "%s%d",
+				      n ? "," : "", first);
+		else
+			n += snprintf(buf + n, len - n, "%s%d-%d",
+				      n ? "," : "", first, i - 1);
+		first = -1;
+	}
+}
+
+void bs_thread_show(struct scsi_lu *lu, struct concat_buf *b)
+{
+	struct bs_thread_pool *pool = BS_THREAD_I(lu)->pool;
+	char cpus[256];
+
+	concat_printf(b, _TAB3 "Backing store threads: %d%s\n",
+		      pool->nr_workers,
+		      pool == shared_pool ? " (shared)" : "");
+
+	if (pool->nr_cpus) {
+		cpuset_to_str(&pool->cpus, cpus, sizeof(cpus));
+		concat_printf(b, _TAB3 "Backing store CPUs: %s\n", cpus);
+	}
+	if (pool->numa_node >= 0)
+		concat_printf(b, _TAB3 "Backing store NUMA node: %d\n",
+			      pool->numa_node);
+}
@@ -196,6 +196,11 @@ static int bs_aio_submit_all_devs(void)
 	return 0;
 }
 
+static void bs_aio_flush(void)
+{
+	bs_aio_submit_all_devs();
+}
+
 static int bs_aio_cmd_submit(struct scsi_cmd *cmd)
 {
 	struct scsi_lu *lu = cmd->dev;
@@ -420,6 +425,7 @@ static struct backingstore_template aio_bst = {
 	.bs_open		= bs_aio_open,
 	.bs_close       	= bs_aio_close,
 	.bs_cmd_submit  	= bs_aio_cmd_submit,
+	.bs_flush		= bs_aio_flush,
 };
 
 __attribute__((constructor)) static void register_bs_module(void)
@@ -511,6 +511,7 @@ static tgtadm_err bs_glfs_init(struct scsi_lu *lu, char *bsopts)
 	char *logfile = NULL;
 	int loglevel = 0;
 	char *sloglevel;
+	char *thread_opts = bsopts;
 
 	while (bsopts && strlen(bsopts)) {
 		if (is_opt("logfile", bsopts))
@@ -518,13 +519,14 @@ static tgtadm_err bs_glfs_init(struct scsi_lu *lu, char *bsopts)
 		else if (is_opt("loglevel", bsopts)) {
 			sloglevel = slurp_value(&bsopts);
 			loglevel = atoi(sloglevel);
-		}
+		} else
+			free(slurp_to_semi(&bsopts));
 	}
 
 	GFSP(lu)->logfile = logfile;
 	GFSP(lu)->loglevel = loglevel;
 
-	return bs_thread_open(info, bs_glfs_request, nr_iothreads);
+	return bs_thread_open_opts(info, bs_glfs_request, thread_opts);
 }
 
 static void bs_glfs_exit(struct scsi_lu *lu)
@@ -549,6 +551,7 @@ static struct backingstore_template glfs_bst = {
 	.bs_init		= bs_glfs_init,
 	.bs_exit		= bs_glfs_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = ALLOWED_BSOFLAGS
 };
 
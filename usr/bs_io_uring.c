@@ -0,0 +1,955 @@
+/*
+ * io_uring backing store
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "target.h"
+#include "scsi.h"
+#include "spc.h"
+
+#define URING_DEF_IODEPTH	128
+#define URING_MAX_IODEPTH	4096
+#define URING_SQPOLL_IDLE	2000	/* ms */
+
+/* WRITE SAME without UNMAP is written in chunks of this size */
+#define URING_WS_CHUNK		(256 * 1024)
+
+/* user_data tag: the completion must match uring_req->xfer_len */
+#define URING_XFER		1UL
+
+enum uring_stage {
+	URING_DONE,
+	URING_COMPARE,		/* COMPARE AND WRITE read done, compare */
+	URING_OR,		/* ORWRITE read done, OR and write */
+	URING_VERIFY,		/* write done, read back for verify */
+	URING_VERIFY_CMP,	/* verify read done, compare */
+	URING_WRITE_SAME,	/* chunk written, fill and write the next */
+};
+
+struct uring_req {
+	struct scsi_cmd *cmd;
+	struct list_head list;
+
+	enum uring_stage stage;
+	int inflight;
+
+	int result;
+	uint8_t key;
+	uint16_t asc;
+
+	uint32_t xfer_len;
+	uint64_t offset;
+	uint32_t remain;
+	char *buf;
+};
+
+struct bs_uring_info {
+	struct scsi_lu *lu;
+	struct io_uring ring;
+	int evt_fd;
+
+	unsigned int iodepth;
+	int sqpoll;
+	int fixed_files;
+	int files_registered;
+
+	/* SQEs prepared but not submitted yet */
+	unsigned int nqueued;
+	struct list_head dev_list_entry;
+
+	/* commands waiting for a free request slot */
+	struct list_head cmd_wait_list;
+	/* requests finished without any I/O, completed from the eventfd */
+	struct list_head done_list;
+
+	struct list_head free_list;
+	struct uring_req *reqs;
+};
+
+static LIST_HEAD(bs_uring_dev_list);
+
+static inline struct bs_uring_info *BS_URING_I(struct scsi_lu *lu)
+{
+	return (struct bs_uring_info *) ((char *)lu + sizeof(*lu));
+}
+
+static void uring_set_error(struct uring_req *req, uint8_t key, uint16_t asc)
+{
+	if (req->result != SAM_STAT_GOOD)
+		return;
+
+	req->result = SAM_STAT_CHECK_CONDITION;
+	req->key = key;
+	req->asc = asc;
+}
+
+/* makes sure that the next nr io_uring_get_sqe() calls succeed */
+static int uring_reserve_sqes(struct bs_uring_info *info, unsigned int nr)
+{
+	int ret;
+
+	if (likely(io_uring_sq_space_left(&info->ring) >= nr))
+		return 0;
+
+	/* the SQ ring is full, push it to the kernel and retry */
+	ret = io_uring_submit(&info->ring);
+	if (io_uring_sq_space_left(&info->ring) >= nr)
+		return 0;
+
+	eprintf("no free sqe for tgt:%d lun:%" PRIu64 ", %d\n",
+		info->lu->tgt->tid, info->lu->lun, ret);
+	return -EBUSY;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct bs_uring_info *info,
+					  struct uring_req *req,
+					  unsigned long tag)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring_reserve_sqes(info, 1))
+		return NULL;
+
+	sqe = io_uring_get_sqe(&info->ring);
+	if (unlikely(!sqe))
+		return NULL;
+
+	io_uring_sqe_set_data(sqe, (void *)((unsigned long)req | tag));
+	req->inflight++;
+
+	if (!info->nqueued++)
+		list_add_tail(&info->dev_list_entry, &bs_uring_dev_list);
+
+	return sqe;
+}
+
+static void uring_set_file(struct bs_uring_info *info,
+			   struct io_uring_sqe *sqe)
+{
+	if (info->files_registered) {
+		sqe->fd = 0;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+}
+
+static int uring_prep_rw(struct bs_uring_info *info, struct uring_req *req,
+			 int write, void *buf, uint32_t length,
+			 uint64_t offset, int sync)
+{
+	struct io_uring_sqe *sqe, *fsqe;
+	int fd = info->lu->fd;
+
+	/* room for the flush too, so that the pair goes out together */
+	if (sync && uring_reserve_sqes(info, 2))
+		return -EBUSY;
+
+	sqe = uring_get_sqe(info, req, URING_XFER);
+	if (!sqe)
+		return -EBUSY;
+
+	if (write)
+		io_uring_prep_write(sqe, fd, buf, length, offset);
+	else
+		io_uring_prep_read(sqe, fd, buf, length, offset);
+	uring_set_file(info, sqe);
+	req->xfer_len = length;
+
+	if (!sync)
+		return 0;
+
+	fsqe = uring_get_sqe(info, req, 0);
+	if (!fsqe)
+		return -EBUSY;
+
+	io_uring_prep_fsync(fsqe, fd, IORING_FSYNC_DATASYNC);
+	uring_set_file(info, fsqe);
+
+	/*
+	 * The flush only runs if the write completed in full.  Link only
+	 * once the flush SQE is there, a write flagged IOSQE_IO_LINK with
+	 * nothing behind it would link to another command's SQE.
+	 */
+	sqe->flags |= IOSQE_IO_LINK;
+
+	return 0;
+}
+
+static int uring_prep_fsync(struct bs_uring_info *info, struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(info, req, 0);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_fsync(sqe, info->lu->fd, IORING_FSYNC_DATASYNC);
+	uring_set_file(info, sqe);
+
+	return 0;
+}
+
+static int uring_prep_punch_hole(struct bs_uring_info *info,
+				 struct uring_req *req, uint64_t offset,
+				 uint32_t length)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(info, req, 0);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_fallocate(sqe, info->lu->fd,
+				FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+				offset, length);
+	uring_set_file(info, sqe);
+
+	return 0;
+}
+
+/* write cache disabled or FUA set: the write needs a flush */
+static int uring_write_needs_sync(struct scsi_cmd *cmd, int *err)
+{
+	struct mode_pg *pg;
+
+	*err = 0;
+	pg = find_mode_page(cmd->dev, 0x08, 0);
+	if (!pg) {
+		*err = 1;
+		return 0;
+	}
+
+	return ((cmd->scb[0] != WRITE_6) && (cmd->scb[1] & 0x8)) ||
+		!(pg->mode_data[0] & 0x04);
+}
+
+static int uring_prep_write(struct bs_uring_info *info, struct uring_req *req,
+			    void *buf, uint32_t length)
+{
+	struct scsi_cmd *cmd = req->cmd;
+	int sync, err;
+
+	sync = uring_write_needs_sync(cmd, &err);
+	if (err) {
+		uring_set_error(req, ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+		return 0;
+	}
+
+	return uring_prep_rw(info, req, 1, buf, length, req->offset, sync);
+}
+
+static void uring_fill_write_same(struct uring_req *req, uint32_t length)
+{
+	struct scsi_cmd *cmd = req->cmd;
+	uint32_t blocksize = 1 << cmd->dev->blk_shift;
+	uint64_t offset = req->offset;
+	char *p;
+
+	for (p = req->buf; p < req->buf + length; p += blocksize) {
+		memcpy(p, scsi_get_out_buffer(cmd), blocksize);
+
+		switch (cmd->scb[1] & 0x06) {
+		case 0x02: /* PBDATA==0 LBDATA==1 */
+			put_unaligned_be32(offset, p);
+			break;
+		case 0x04: /* PBDATA==1 LBDATA==0 */
+			/* physical sector format */
+			put_unaligned_be64(offset, p);
+			break;
+		}
+		offset += blocksize;
+	}
+}
+
+static int uring_prep_write_same(struct bs_uring_info *info,
+				 struct uring_req *req)
+{
+	uint32_t length = min_t(uint32_t, req->remain, URING_WS_CHUNK);
+
+	uring_fill_write_same(req, length);
+	req->stage = URING_WRITE_SAME;
+
+	return uring_prep_rw(info, req, 1, req->buf, length, req->offset, 0);
+}
+
+static int uring_prep_unmap(struct bs_uring_info *info, struct uring_req *req)
+{
+	struct scsi_cmd *cmd = req->cmd;
+	uint32_t length = scsi_get_out_length(cmd);
+	char *p = scsi_get_out_buffer(cmd);
+	uint64_t offset;
+	uint32_t tl;
+	int ret;
+
+	if (!cmd->dev->attrs.thinprovisioning) {
+		uring_set_error(req, ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+		return 0;
+	}
+
+	if (length < 8)
+		return 0;
+
+	length -= 8;
+	p += 8;
+
+	while (length >= 16) {
+		offset = get_unaligned_be64(&p[0]);
+		offset = offset << cmd->dev->blk_shift;
+
+		tl = get_unaligned_be32(&p[8]);
+		tl = tl << cmd->dev->blk_shift;
+
+		if (offset + tl > cmd->dev->size) {
+			eprintf("UNMAP beyond EOF\n");
+			uring_set_error(req, ILLEGAL_REQUEST,
+					ASC_LBA_OUT_OF_RANGE);
+			return 0;
+		}
+
+		if (tl) {
+			ret = uring_prep_punch_hole(info, req, offset, tl);
+			if (ret)
+				return ret;
+		}
+
+		length -= 16;
+		p += 16;
+	}
+	return 0;
+}
+
+static int uring_req_start(struct bs_uring_info *info, struct uring_req *req)
+{
+	struct scsi_cmd *cmd = req->cmd;
+	struct io_uring_sqe *sqe;
+	uint32_t length;
+
+	req->offset = cmd->offset;
+
+	switch (cmd->scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return uring_prep_rw(info, req, 0, scsi_get_in_buffer(cmd),
+				     scsi_get_in_length(cmd), req->offset, 0);
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		req->stage = URING_VERIFY;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		return uring_prep_write(info, req, scsi_get_out_buffer(cmd),
+					scsi_get_out_length(cmd));
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		if (cmd->scb[1] & 0x2) {
+			uring_set_error(req, ILLEGAL_REQUEST,
+					ASC_INVALID_FIELD_IN_CDB);
+			return 0;
+		}
+		return uring_prep_fsync(info, req);
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		/* WRITE_SAME used to punch hole in file */
+		if (cmd->scb[1] & 0x08) {
+			req->key = HARDWARE_ERROR;
+			req->asc = ASC_INTERNAL_TGT_FAILURE;
+			return uring_prep_punch_hole(info, req, req->offset,
+						     cmd->tl);
+		}
+		req->remain = cmd->tl;
+		req->buf = malloc(min_t(uint32_t, cmd->tl, URING_WS_CHUNK));
+		break;
+	case UNMAP:
+		req->key = HARDWARE_ERROR;
+		req->asc = ASC_INTERNAL_TGT_FAILURE;
+		return uring_prep_unmap(info, req);
+	case PRE_FETCH_10:
+	case PRE_FETCH_16:
+		sqe = uring_get_sqe(info, req, 0);
+		if (!sqe)
+			return -EBUSY;
+		io_uring_prep_fadvise(sqe, cmd->dev->fd, req->offset, cmd->tl,
+				      POSIX_FADV_WILLNEED);
+		uring_set_file(info, sqe);
+		return 0;
+	case VERIFY_10:
+	case VERIFY_12:
+	case VERIFY_16:
+		length = scsi_get_out_length(cmd);
+		if (!length)
+			return 0;
+		req->stage = URING_VERIFY_CMP;
+		req->buf = malloc(length);
+		if (!req->buf)
+			break;
+		return uring_prep_rw(info, req, 0, req->buf, length,
+				     req->offset, 0);
+	case COMPARE_AND_WRITE:
+		/*
+		 * Blocks are transferred twice, first the set that
+		 * we compare to the existing data, and second the set
+		 * to write if the compare was successful.
+		 */
+		length = scsi_get_out_length(cmd) / 2;
+		if (length != cmd->tl) {
+			uring_set_error(req, ILLEGAL_REQUEST,
+					ASC_INVALID_FIELD_IN_CDB);
+			return 0;
+		}
+		req->stage = URING_COMPARE;
+		req->buf = malloc(length);
+		if (!req->buf)
+			break;
+		return uring_prep_rw(info, req, 0, req->buf, length,
+				     req->offset, 0);
+	case ORWRITE_16:
+		length = scsi_get_out_length(cmd);
+		req->stage = URING_OR;
+		req->buf = malloc(length);
+		if (!req->buf)
+			break;
+		return uring_prep_rw(info, req, 0, req->buf, length,
+				     req->offset, 0);
+	default:
+		return 0;
+	}
+
+	if (!req->buf) {
+		uring_set_error(req, HARDWARE_ERROR, ASC_INTERNAL_TGT_FAILURE);
+		return 0;
+	}
+
+	return uring_prep_write_same(info, req);
+}
+
+/* called when all the SQEs of the current stage have completed */
+static int uring_req_next(struct bs_uring_info *info, struct uring_req *req)
+{
+	struct scsi_cmd *cmd = req->cmd;
+	uint32_t i, length = req->xfer_len;
+	char *p;
+
+	if (req->result != SAM_STAT_GOOD)
+		return 0;
+
+	switch (req->stage) {
+	case URING_DONE:
+		break;
+	case URING_COMPARE:
+		req->stage = URING_DONE;
+		if (memcmp(scsi_get_out_buffer(cmd), req->buf, length)) {
+			uring_set_error(req, MISCOMPARE,
+					ASC_MISCOMPARE_DURING_VERIFY_OPERATION);
+			break;
+		}
+		return uring_prep_write(info, req,
+					scsi_get_out_buffer(cmd) + length,
+					length);
+	case URING_OR:
+		req->stage = URING_DONE;
+		p = scsi_get_out_buffer(cmd);
+		for (i = 0; i < length; i++)
+			p[i] |= req->buf[i];
+		return uring_prep_write(info, req, p, length);
+	case URING_VERIFY:
+		req->stage = URING_VERIFY_CMP;
+		req->buf = malloc(length);
+		if (!req->buf) {
+			uring_set_error(req, HARDWARE_ERROR,
+					ASC_INTERNAL_TGT_FAILURE);
+			break;
+		}
+		return uring_prep_rw(info, req, 0, req->buf, length,
+				     req->offset, 0);
+	case URING_VERIFY_CMP:
+		req->stage = URING_DONE;
+		if (memcmp(scsi_get_out_buffer(cmd), req->buf, length))
+			uring_set_error(req, MISCOMPARE,
+					ASC_MISCOMPARE_DURING_VERIFY_OPERATION);
+		break;
+	case URING_WRITE_SAME:
+		req->offset += length;
+		req->remain -= length;
+		if (!req->remain) {
+			req->stage = URING_DONE;
+			break;
+		}
+		return uring_prep_write_same(info, req);
+	}
+	return 0;
+}
+
+static int bs_uring_submit_dev(struct bs_uring_info *info)
+{
+	int ret;
+
+	if (!info->nqueued)
+		return 0;
+
+	do {
+		ret = io_uring_submit(&info->ring);
+	} while (ret == -EINTR);
+
+	if (unlikely(ret < 0)) {
+		if (ret != -EAGAIN && ret != -EBUSY) {
+			eprintf("failed to submit to tgt:%d lun:%" PRIu64
+				", %d\n", info->lu->tgt->tid, info->lu->lun,
+				-ret);
+			return ret;
+		}
+	} else
+		dprintf("submitted %d sqes to tgt:%d lun:%" PRIu64 "\n", ret,
+			info->lu->tgt->tid, info->lu->lun);
+
+	/*
+	 * The kernel can take only part of the ring, or none with EAGAIN
+	 * or EBUSY.  The rest stays queued; poke our eventfd so that the
+	 * completion handler reaps the CQ and submits again on the next
+	 * pass of the event loop rather than when new I/O comes in.  With
+	 * SQPOLL the kernel thread picks up the SQ ring on its own.
+	 */
+	if (!info->sqpoll && io_uring_sq_ready(&info->ring)) {
+		info->nqueued = io_uring_sq_ready(&info->ring);
+		eventfd_write(info->evt_fd, 1);
+		return 0;
+	}
+
+	info->nqueued = 0;
+	list_del(&info->dev_list_entry);
+
+	return 0;
+}
+
+static int bs_uring_submit_all_devs(void)
+{
+	struct bs_uring_info *info, *next;
+	int err;
+
+	list_for_each_entry_safe(info, next, &bs_uring_dev_list,
+				 dev_list_entry) {
+		err = bs_uring_submit_dev(info);
+		if (unlikely(err))
+			return err;
+	}
+	return 0;
+}
+
+static void bs_uring_flush(void)
+{
+	bs_uring_submit_all_devs();
+}
+
+static void uring_req_queue(struct bs_uring_info *info, struct uring_req *req)
+{
+	int ret;
+
+	ret = uring_req_start(info, req);
+	if (ret)
+		uring_set_error(req, HARDWARE_ERROR, ASC_INTERNAL_TGT_FAILURE);
+
+	if (!req->inflight) {
+		/* nothing to wait for, complete from the eventfd handler */
+		list_add_tail(&req->list, &info->done_list);
+		eventfd_write(info->evt_fd, 1);
+	}
+}
+
+static int bs_uring_cmd_submit(struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct bs_uring_info *info = BS_URING_I(lu);
+	struct uring_req *req;
+
+	set_cmd_async(cmd);
+
+	if (list_empty(&info->free_list)) {
+		list_add_tail(&cmd->bs_list, &info->cmd_wait_list);
+		return 0;
+	}
+
+	req = list_first_entry(&info->free_list, struct uring_req, list);
+	list_del(&req->list);
+
+	memset(req, 0, sizeof(*req));
+	req->cmd = cmd;
+	req->result = SAM_STAT_GOOD;
+	req->key = MEDIUM_ERROR;
+	req->asc = ASC_READ_ERROR;
+
+	uring_req_queue(info, req);
+
+	if (!cmd_not_last(cmd)) /* last cmd in batch */
+		return bs_uring_submit_all_devs();
+
+	return 0;
+}
+
+static void uring_req_done(struct bs_uring_info *info, struct uring_req *req)
+{
+	struct scsi_cmd *cmd = req->cmd;
+
+	if (req->result != SAM_STAT_GOOD) {
+		eprintf("io error %p %x %" PRIu64 "\n", cmd, cmd->scb[0],
+			req->offset);
+		sense_data_build(cmd, req->key, req->asc);
+	}
+
+	free(req->buf);
+	req->buf = NULL;
+	list_add(&req->list, &info->free_list);
+
+	dprintf("cmd: %p\n", cmd);
+	target_cmd_io_done(cmd, req->result);
+
+	if (!list_empty(&info->cmd_wait_list)) {
+		cmd = list_first_entry(&info->cmd_wait_list, struct scsi_cmd,
+				       bs_list);
+		list_del(&cmd->bs_list);
+
+		req = list_first_entry(&info->free_list, struct uring_req,
+				       list);
+		list_del(&req->list);
+
+		memset(req, 0, sizeof(*req));
+		req->cmd = cmd;
+		req->result = SAM_STAT_GOOD;
+		req->key = MEDIUM_ERROR;
+		req->asc = ASC_READ_ERROR;
+
+		uring_req_queue(info, req);
+	}
+}
+
+static void bs_uring_complete_one(struct bs_uring_info *info,
+				  struct io_uring_cqe *cqe)
+{
+	unsigned long data = (unsigned long)io_uring_cqe_get_data(cqe);
+	struct uring_req *req = (void *)(data & ~URING_XFER);
+
+	req->inflight--;
+
+	if (unlikely(cqe->res < 0 ||
+		     ((data & URING_XFER) && cqe->res != req->xfer_len))) {
+		dprintf("cmd: %p op:%x res:%d\n", req->cmd, req->cmd->scb[0],
+			cqe->res);
+		uring_set_error(req, req->key, req->asc);
+	}
+
+	if (req->inflight)
+		return;
+
+	if (uring_req_next(info, req))
+		uring_set_error(req, HARDWARE_ERROR, ASC_INTERNAL_TGT_FAILURE);
+
+	if (!req->inflight)
+		uring_req_done(info, req);
+}
+
+static void bs_uring_get_completions(int fd, int events, void *data)
+{
+	struct bs_uring_info *info = data;
+	struct io_uring_cqe *cqe;
+	struct uring_req *req, *next;
+	LIST_HEAD(done_list);
+	unsigned int head, nr;
+	eventfd_t val;
+	int ret;
+
+retry_read:
+	ret = eventfd_read(info->evt_fd, &val);
+	if (unlikely(ret < 0)) {
+		if (errno == EINTR)
+			goto retry_read;
+		if (errno != EAGAIN) {
+			eprintf("failed to read io_uring completions, %m\n");
+			return;
+		}
+	}
+
+	list_splice_init(&info->done_list, &done_list);
+	list_for_each_entry_safe(req, next, &done_list, list) {
+		list_del(&req->list);
+		uring_req_done(info, req);
+	}
+
+	do {
+		nr = 0;
+		io_uring_for_each_cqe(&info->ring, head, cqe) {
+			bs_uring_complete_one(info, cqe);
+			nr++;
+		}
+		io_uring_cq_advance(&info->ring, nr);
+	} while (nr);
+
+	/* next stages and commands that waited for a request slot */
+	bs_uring_submit_dev(info);
+}
+
+static int bs_uring_open(struct scsi_lu *lu, char *path, int *fd,
+			 uint64_t *size)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	uint32_t blksize = 0;
+	int ret;
+
+	*fd = backed_file_open(path, O_RDWR|O_LARGEFILE|lu->bsoflags, size,
+				&blksize);
+	/* If we get access denied, try opening the file in readonly mode */
+	if (*fd == -1 && (errno == EACCES || errno == EROFS)) {
+		*fd = backed_file_open(path, O_RDONLY|O_LARGEFILE|lu->bsoflags,
+				       size, &blksize);
+		lu->attrs.readonly = 1;
+	}
+	if (*fd < 0)
+		return *fd;
+
+	if (info->fixed_files) {
+		ret = io_uring_register_files(&info->ring, fd, 1);
+		if (ret)
+			eprintf("can't register %s for tgt:%d lun:%" PRIu64
+				", %d\n", path, lu->tgt->tid, lu->lun, -ret);
+		else
+			info->files_registered = 1;
+	}
+
+	if (!lu->attrs.no_auto_lbppbe)
+		update_lbppbe(lu, blksize);
+
+	return 0;
+}
+
+static void bs_uring_close(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+
+	if (info->files_registered) {
+		io_uring_unregister_files(&info->ring);
+		info->files_registered = 0;
+	}
+	close(lu->fd);
+}
+
+static int uring_parse_opts(struct bs_uring_info *info, char *bsopts)
+{
+	char *p, *opts, *val;
+	unsigned int depth;
+
+	if (!bsopts)
+		return 0;
+
+	opts = strdup(bsopts);
+	if (!opts)
+		return -ENOMEM;
+
+	for (p = opts; (val = strsep(&p, ";")); ) {
+		if (!*val)
+			continue;
+
+		if (!strncmp(val, "iodepth=", 8)) {
+			if (str_to_int_range(val + 8, depth, 1,
+					     URING_MAX_IODEPTH))
+				goto err;
+			info->iodepth = depth;
+		} else if (!strcmp(val, "sqpoll=1"))
+			info->sqpoll = 1;
+		else if (!strcmp(val, "sqpoll=0"))
+			info->sqpoll = 0;
+		else if (!strcmp(val, "fixed_files=1"))
+			info->fixed_files = 1;
+		else if (!strcmp(val, "fixed_files=0"))
+			info->fixed_files = 0;
+		else
+			goto err;
+	}
+	free(opts);
+	return 0;
+err:
+	eprintf("bad io_uring option \"%s\"\n", val);
+	free(opts);
+	return -EINVAL;
+}
+
+static tgtadm_err bs_uring_init(struct scsi_lu *lu, char *bsopts)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	struct io_uring_params params;
+	int i, ret;
+
+	memset(info, 0, sizeof(*info));
+	INIT_LIST_HEAD(&info->dev_list_entry);
+	INIT_LIST_HEAD(&info->cmd_wait_list);
+	INIT_LIST_HEAD(&info->done_list);
+	INIT_LIST_HEAD(&info->free_list);
+	info->lu = lu;
+	info->iodepth = URING_DEF_IODEPTH;
+
+	if (uring_parse_opts(info, bsopts))
+		return TGTADM_INVALID_REQUEST;
+
+	/* SQPOLL needs fixed files on older kernels */
+	if (info->sqpoll)
+		info->fixed_files = 1;
+
+	info->reqs = calloc(info->iodepth, sizeof(*info->reqs));
+	if (!info->reqs)
+		return TGTADM_NOMEM;
+
+	for (i = 0; i < info->iodepth; i++)
+		list_add_tail(&info->reqs[i].list, &info->free_list);
+
+	memset(&params, 0, sizeof(params));
+	if (info->sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQPOLL_IDLE;
+	}
+
+	/* UNMAP and linked flushes take more than one SQE per command */
+	ret = io_uring_queue_init_params(info->iodepth * 2, &info->ring,
+					 &params);
+	if (ret) {
+		eprintf("failed to create io_uring for tgt:%d lun:%" PRIu64
+			", %d\n", lu->tgt->tid, lu->lun, -ret);
+		goto free_reqs;
+	}
+
+	info->evt_fd = eventfd(0, EFD_NONBLOCK);
+	if (info->evt_fd < 0) {
+		eprintf("failed to create eventfd for tgt:%d lun:%" PRIu64
+			", %m\n", lu->tgt->tid, lu->lun);
+		goto exit_ring;
+	}
+
+	ret = io_uring_register_eventfd(&info->ring, info->evt_fd);
+	if (ret) {
+		eprintf("failed to register eventfd, %d\n", -ret);
+		goto close_eventfd;
+	}
+
+	ret = tgt_event_add(info->evt_fd, EPOLLIN, bs_uring_get_completions,
+			    info);
+	if (ret)
+		goto close_eventfd;
+
+	dprintf("io_uring for tgt:%d lun:%" PRIu64 " depth:%u sqpoll:%d "
+		"fixed_files:%d\n", lu->tgt->tid, lu->lun, info->iodepth,
+		info->sqpoll, info->fixed_files);
+
+	return TGTADM_SUCCESS;
+
+close_eventfd:
+	close(info->evt_fd);
+exit_ring:
+	io_uring_queue_exit(&info->ring);
+free_reqs:
+	free(info->reqs);
+	return TGTADM_UNKNOWN_ERR;
+}
+
+static void bs_uring_exit(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+
+	tgt_event_del(info->evt_fd);
+	close(info->evt_fd);
+	if (info->nqueued)
+		list_del(&info->dev_list_entry);
+	io_uring_queue_exit(&info->ring);
+	free(info->reqs);
+}
+
+static struct backingstore_template io_uring_bst = {
+	.bs_name		= "io_uring",
+	.bs_datasize		= sizeof(struct bs_uring_info),
+	.bs_open		= bs_uring_open,
+	.bs_close		= bs_uring_close,
+	.bs_init		= bs_uring_init,
+	.bs_exit		= bs_uring_exit,
+	.bs_cmd_submit		= bs_uring_cmd_submit,
+	.bs_flush		= bs_uring_flush,
+	.bs_oflags_supported    = O_SYNC | O_DIRECT,
+};
+
+__attribute__((constructor)) static void bs_uring_constructor(void)
+{
+	unsigned char sbc_opcodes[] = {
+		ALLOW_MEDIUM_REMOVAL,
+		COMPARE_AND_WRITE,
+		FORMAT_UNIT,
+		INQUIRY,
+		MAINT_PROTOCOL_IN,
+		MODE_SELECT,
+		MODE_SELECT_10,
+		MODE_SENSE,
+		MODE_SENSE_10,
+		ORWRITE_16,
+		PERSISTENT_RESERVE_IN,
+		PERSISTENT_RESERVE_OUT,
+		PRE_FETCH_10,
+		PRE_FETCH_16,
+		READ_10,
+		READ_12,
+		READ_16,
+		READ_6,
+		READ_CAPACITY,
+		RELEASE,
+		REPORT_LUNS,
+		REQUEST_SENSE,
+		RESERVE,
+		SEND_DIAGNOSTIC,
+		SERVICE_ACTION_IN,
+		START_STOP,
+		SYNCHRONIZE_CACHE,
+		SYNCHRONIZE_CACHE_16,
+		TEST_UNIT_READY,
+		UNMAP,
+		VERIFY_10,
+		VERIFY_12,
+		VERIFY_16,
+		WRITE_10,
+		WRITE_12,
+		WRITE_16,
+		WRITE_6,
+		WRITE_SAME,
+		WRITE_SAME_16,
+		WRITE_VERIFY,
+		WRITE_VERIFY_12,
+		WRITE_VERIFY_16
+	};
+	bs_create_opcode_map(&io_uring_bst, sbc_opcodes,
+			     ARRAY_SIZE(sbc_opcodes));
+	register_backingstore_template(&io_uring_bst);
+}
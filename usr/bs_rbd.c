@@ -523,6 +523,7 @@ static tgtadm_err bs_rbd_init(struct scsi_lu *lu, char *bsopts)
 	char *clustername = NULL;
 	char clientid_full[128];
 	char *ignore = NULL;
+	char *thread_opts = bsopts;
 
 	dprintf("bs_rbd_init bsopts: \"%s\"\n", bsopts);
 
@@ -649,7 +650,7 @@ static tgtadm_err bs_rbd_init(struct scsi_lu *lu, char *bsopts)
 		eprintf("bs_rbd_init: rados_connect: %d\n", rados_ret);
 		goto fail;
 	}
-	ret = bs_thread_open(info, bs_rbd_request, nr_iothreads);
+	ret = bs_thread_open_opts(info, bs_rbd_request, thread_opts);
 fail:
 	if (confname)
 		free(confname);
@@ -682,6 +683,7 @@ static struct backingstore_template rbd_bst = {
 	.bs_init		= bs_rbd_init,
 	.bs_exit		= bs_rbd_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
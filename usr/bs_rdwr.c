@@ -58,6 +58,31 @@ static void bs_sync_sync_range(struct scsi_cmd *cmd, uint32_t length,
 		set_medium_error(result, key, asc);
 }
 
+/*
+ * Read in BS_STREAM_CHUNK pieces and let the transport start sending
+ * each one while the next is read.
+ */
+static ssize_t bs_rdwr_read_stream(struct scsi_cmd *cmd, int fd,
+				   uint32_t length, uint64_t offset)
+{
+	char *buf = scsi_get_in_buffer(cmd);
+	uint32_t done = 0, len;
+	ssize_t ret;
+
+	while (done < length) {
+		len = min_t(uint32_t, length - done, BS_STREAM_CHUNK);
+		ret = pread64(fd, buf + done, len, offset + done);
+		if (ret != len)
+			return ret < 0 ? ret : done + ret;
+
+		done += len;
+		if (done < length)
+			bs_thread_cmd_data_ready(cmd, done);
+	}
+
+	return done;
+}
+
 static void bs_rdwr_request(struct scsi_cmd *cmd)
 {
 	int ret, fd = cmd->dev->fd;
@@ -257,8 +282,15 @@ write:
 	case READ_12:
 	case READ_16:
 		length = scsi_get_in_length(cmd);
-		ret = pread64(fd, scsi_get_in_buffer(cmd), length,
-			      offset);
+		if (cmd_zerocopy(cmd) && !(cmd->dev->bsoflags & O_DIRECT)) {
+			/* sent from the page cache, read errors show there */
+			set_cmd_in_file(cmd);
+			ret = length;
+		} else if (cmd_stream(cmd) && length > BS_STREAM_CHUNK)
+			ret = bs_rdwr_read_stream(cmd, fd, length, offset);
+		else
+			ret = pread64(fd, scsi_get_in_buffer(cmd), length,
+				      offset);
 
 		if (ret != length)
 			set_medium_error(&result, &key, &asc);
@@ -400,7 +432,7 @@ static tgtadm_err bs_rdwr_init(struct scsi_lu *lu, char *bsopts)
 {
 	struct bs_thread_info *info = BS_THREAD_I(lu);
 
-	return bs_thread_open(info, bs_rdwr_request, nr_iothreads);
+	return bs_thread_open_opts(info, bs_rdwr_request, bsopts);
 }
 
 static void bs_rdwr_exit(struct scsi_lu *lu)
@@ -418,6 +450,7 @@ static struct backingstore_template rdwr_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
@@ -429,6 +462,7 @@ static struct backingstore_template mmc_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
@@ -440,6 +474,7 @@ static struct backingstore_template smc_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
@@ -145,6 +145,8 @@ static int bs_bsg_cmd_submit(struct scsi_cmd *cmd)
 	io_hdr.din_xfer_len = scsi_get_in_length(cmd);
 	io_hdr.din_xferp = (unsigned long)scsi_get_in_buffer(cmd);
 
+	/* all of it goes back to the initiator, see bs_bsg_cmd_complete() */
+	memset(cmd->sense_buffer, 0, sizeof(cmd->sense_buffer));
 	io_hdr.max_response_len = sizeof(cmd->sense_buffer);
 	/* SCSI: (auto)sense data */
 	io_hdr.response = (unsigned long)cmd->sense_buffer;
@@ -274,7 +274,7 @@ struct sheepdog_access_info {
 	char uds_path[UNIX_PATH_MAX];
 
 	/*
-	 * maximum length of fd_list_head: nr_iothreads + 1
+	 * maximum length of fd_list_head: number of pool workers + 1
 	 * (+ 1 is for main thread)
 	 *
 	 * TODO: more effective data structure for handling massive parallel
@@ -1443,7 +1443,7 @@ static tgtadm_err bs_sheepdog_init(struct scsi_lu *lu, char *bsopts)
 	pthread_rwlock_init(&ai->inode_lock, NULL);
 	pthread_mutex_init(&ai->inode_version_mutex, NULL);
 
-	return bs_thread_open(info, bs_sheepdog_request, nr_iothreads);
+	return bs_thread_open_opts(info, bs_sheepdog_request, bsopts);
 }
 
 static void bs_sheepdog_exit(struct scsi_lu *lu)
@@ -1477,6 +1477,7 @@ static struct backingstore_template sheepdog_bst = {
 	.bs_init		= bs_sheepdog_init,
 	.bs_exit		= bs_sheepdog_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 };
 
 __attribute__((constructor)) static void __constructor(void)
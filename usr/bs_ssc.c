@@ -696,6 +696,7 @@ static struct backingstore_template ssc_bst = {
 	.bs_open		= bs_ssc_open,
 	.bs_close		= bs_ssc_close,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 };
 
 __attribute__((constructor)) static void bs_ssc_constructor(void)
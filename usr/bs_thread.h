@@ -1,17 +1,62 @@
+#include <sched.h>
+
 typedef void (request_func_t) (struct scsi_cmd *);
 
-struct bs_thread_info {
-	pthread_t *worker_thread;
-	int nr_worker_threads;
+/*
+ * Worker pool. Each worker owns a queue; tgtd pushes to the tail of
+ * one of them, the owner takes from the head and idle workers steal
+ * from the tail of the others.
+ */
+struct bs_pool_worker {
+	struct bs_thread_pool *pool;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	/* protected by lock */
+	struct list_head queue;
+};
 
-	/* wokers sleep on this and signaled by tgtd */
-	pthread_cond_t pending_cond;
-	/* locked by tgtd and workers */
-	pthread_mutex_t pending_lock;
-	/* protected by pending_lock */
-	struct list_head pending_list;
+struct bs_thread_pool {
+	struct bs_pool_worker *workers;
+	int nr_workers;
+	int refcnt;
+	int stop;
+
+	/* workers are pinned to cpus if nr_cpus, -1 for no NUMA node */
+	int nr_cpus;
+	cpu_set_t cpus;
+	int numa_node;
+
+	/* atomic, commands queued but not yet taken by a worker */
+	int nr_pending;
+	/* atomic, workers polling nr_pending before going to sleep */
+	int nr_spinning;
+	/* atomic, workers sleeping on cond */
+	int nr_sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* only touched by tgtd */
+	int next;
+	struct list_head batch;
+	int nr_batch;
+	struct list_head batch_siblings;
+};
+
+struct bs_thread_info {
+	struct bs_thread_pool *pool;
 
 	request_func_t *request_fn;
+
+	/*
+	 * Completed commands, pushed by workers without a lock and
+	 * taken all at once by tgtd. done_fd is kicked when the stack
+	 * goes from empty to non-empty. Commands reporting in-data
+	 * progress go on ready_head the same way.
+	 */
+	struct list_head *done_head;
+	struct list_head *ready_head;
+	int done_fd;
 };
 
 static inline struct bs_thread_info *BS_THREAD_I(struct scsi_lu *lu)
@@ -21,6 +66,16 @@ static inline struct bs_thread_info *BS_THREAD_I(struct scsi_lu *lu)
 
 extern tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
 				 int nr_threads);
+extern tgtadm_err bs_thread_open_opts(struct bs_thread_info *info,
+				      request_func_t *rfn, char *bsopts);
 extern void bs_thread_close(struct bs_thread_info *info);
+extern void bs_thread_show(struct scsi_lu *lu, struct concat_buf *b);
 extern int bs_thread_cmd_submit(struct scsi_cmd *cmd);
+extern void bs_thread_cmd_data_ready(struct scsi_cmd *cmd, uint32_t len);
 extern int nr_iothreads;
+
+/* in-data a streamed READ is read and reported in */
+#define BS_STREAM_CHUNK	(256 * 1024)
+
+/* pass as nr_threads to bs_thread_open to use the pool shared by all LUs */
+#define BS_SHARED_POOL 0
@@ -6,6 +6,7 @@
 
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *address, size_t length);
 extern uint32_t crc32c_be(uint32_t crc, unsigned char const *address, size_t length);
+extern const char *crc32c_name(void);
 
 #define crc32c(seed, data, length)  crc32c_le(seed, (unsigned char const *)data, length)
 
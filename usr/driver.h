@@ -22,6 +22,7 @@ struct tgt_driver {
 
 	int (*portal_create)(char *);
 	int (*portal_destroy)(char *);
+	int (*portal_update)(char *);
 
 	int (*lu_create)(struct scsi_lu *);
 
@@ -32,6 +33,8 @@ struct tgt_driver {
 	uint64_t (*scsi_get_lun)(uint8_t *);
 
 	int (*cmd_end_notify)(uint64_t nid, int result, struct scsi_cmd *);
+	/* more in-data of a running TGT_CMD_STREAM command is ready */
+	int (*cmd_data_ready)(uint64_t nid, struct scsi_cmd *);
 	int (*mgmt_end_notify)(struct mgmt_req *);
 
 	int (*transportid)(int, uint64_t, char *, int);
@@ -46,15 +46,17 @@ void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *se
 
 int conn_init(struct iscsi_connection *conn)
 {
+	conn->session_param = malloc(sizeof(struct param) * ISCSI_PARAM_MAX);
+	if (!conn->session_param)
+		return -ENOMEM;
+
 	conn->req_buffer = malloc(INCOMING_BUFSIZE);
 	if (!conn->req_buffer)
-		return -ENOMEM;
+		goto free_param;
 
 	conn->rsp_buffer = malloc(INCOMING_BUFSIZE);
-	if (!conn->rsp_buffer) {
-		free(conn->req_buffer);
-		return -ENOMEM;
-	}
+	if (!conn->rsp_buffer)
+		goto free_req;
 	conn->rsp_buffer_size = INCOMING_BUFSIZE;
 
 	conn->refcount = 1;
@@ -64,8 +66,16 @@ int conn_init(struct iscsi_connection *conn)
 	INIT_LIST_HEAD(&conn->clist);
 	INIT_LIST_HEAD(&conn->tx_clist);
 	INIT_LIST_HEAD(&conn->task_list);
+	INIT_LIST_HEAD(&conn->tx_done_list);
+	INIT_LIST_HEAD(&conn->redirect_wait);
+	pthread_mutex_init(&conn->io_lock, NULL);
 
 	return 0;
+free_req:
+	free(conn->req_buffer);
+free_param:
+	free(conn->session_param);
+	return -ENOMEM;
 }
 
 void conn_exit(struct iscsi_connection *conn)
@@ -73,20 +83,27 @@ void conn_exit(struct iscsi_connection *conn)
 	struct iscsi_session *session = conn->session;
 
 	list_del(&conn->clist);
+	if (!session || conn->session_param != session->session_param)
+		free(conn->session_param);
 	free(conn->req_buffer);
 	free(conn->rsp_buffer);
+	if (conn->rx_ring)
+		iscsi_pool_free_buf(conn->rx_ring);
 	free(conn->initiator);
 	if (conn->initiator_alias)
 		free(conn->initiator_alias);
 
+	pthread_mutex_destroy(&conn->io_lock);
+
 	if (session)
 		session_put(session);
 }
 
 void conn_close(struct iscsi_connection *conn)
 {
+	struct iscsi_session *session;
 	struct iscsi_task *task, *tmp;
-	int ret;
+	int i, ret;
 
 	if (conn->closed) {
 		eprintf("already closed %p %u\n", conn, conn->refcount);
@@ -94,6 +111,9 @@ void conn_close(struct iscsi_connection *conn)
 	}
 
 	conn->closed = 1;
+	/* wait for the reactor owning it to stop moving data */
+	pthread_mutex_lock(&conn->io_lock);
+	target_redirect_unwait(conn);
 
 	ret = conn->tp->ep_close(conn);
 	if (ret)
@@ -112,17 +132,23 @@ void conn_close(struct iscsi_connection *conn)
 	 * We just closed the ep so we are not going to send/recv anything.
 	 * Just free these up since they are not going to complete.
 	 */
-	list_for_each_entry_safe(task, tmp, &conn->session->pending_cmd_list,
-				 c_list) {
-		if (task->conn != conn)
+	session = conn->session;
+	for (i = 0; session->cmd_ring && i <= session->cmd_ring_mask; i++) {
+		task = session->cmd_ring[i];
+		if (!task || task->conn != conn)
 			continue;
 
 		eprintf("Forcing release of pending task %p %" PRIx64 "\n",
 			task, task->tag);
-		list_del(&task->c_list);
+		session->cmd_ring[i] = NULL;
 		iscsi_free_task(task);
 	}
 
+	/* gathered PDUs that never made it out */
+	list_splice_init(&conn->tx_done_list, &conn->tx_clist);
+	conn->tx_iovcnt = conn->tx_iovidx = conn->tx_nr_pdus = 0;
+	conn->tx_file_len = 0;
+
 	if (conn->tx_task) {
 		dprintf("Add current tx task to the tx list for removal "
 			"%p %" PRIx64 "\n",
@@ -140,6 +166,12 @@ void conn_close(struct iscsi_connection *conn)
 			task, task->tag, op);
 		switch (op) {
 		case ISCSI_OP_SCSI_CMD:
+			/* streamed Data-In, freed when SCSI completes it */
+			if (task_in_scsi(task)) {
+				list_del(&task->c_list);
+				clear_task_streaming(task);
+				break;
+			}
 			/*
 			 * We can't call iscsi_free_cmd_task for a
 			 * command waiting for SCSI_DATA_OUT. There
@@ -196,6 +228,7 @@ void conn_close(struct iscsi_connection *conn)
 		iscsi_free_task(task);
 	}
 done:
+	pthread_mutex_unlock(&conn->io_lock);
 	conn_put(conn);
 }
 
@@ -213,6 +246,28 @@ int conn_get(struct iscsi_connection *conn)
 	return 0;
 }
 
+/*
+ * The reactor owning conn sends and receives its data without
+ * tgt_event_lock, so the other reactors go on meanwhile.  Nothing but
+ * the socket, the buffers the data moves through and the per
+ * connection counters may be touched until conn_io_end(), which tells
+ * if the connection got closed meanwhile.  Then only the memory of
+ * conn itself is left, see iscsi_tcp_event_handler().
+ */
+void conn_io_begin(struct iscsi_connection *conn)
+{
+	pthread_mutex_lock(&conn->io_lock);
+	tgt_event_unlock();
+}
+
+int conn_io_end(struct iscsi_connection *conn)
+{
+	pthread_mutex_unlock(&conn->io_lock);
+	tgt_event_lock();
+
+	return conn->closed;
+}
+
 struct iscsi_connection *conn_find(struct iscsi_session *session, uint32_t cid)
 {
 	struct iscsi_connection *conn;
@@ -227,9 +282,26 @@ struct iscsi_connection *conn_find(struct iscsi_session *session, uint32_t cid)
 
 int conn_take_fd(struct iscsi_connection *conn)
 {
+	struct iscsi_session *session = conn->session;
+
 	dprintf("%u %u %u %" PRIx64 "\n", conn->cid, conn->stat_sn,
 		conn->exp_stat_sn, sid64(conn->isid, conn->tsih));
-	conn->session->conn_cnt++;
+	session->conn_cnt++;
+
+	/* all PDUs come and go with tasks in full feature phase */
+	free(conn->req_buffer);
+	conn->req_buffer = NULL;
+	free(conn->rsp_buffer);
+	conn->rsp_buffer = NULL;
+	conn->rsp_buffer_size = 0;
+	conn->text_rsp_buffer = NULL;
+
+	if (!memcmp(conn->session_param, session->session_param,
+		    sizeof(session->session_param))) {
+		free(conn->session_param);
+		conn->session_param = session->session_param;
+	}
+
 	return 0;
 }
 
@@ -299,6 +299,17 @@ struct iscsi_stats {
 	uint32_t digest_err;
 	uint32_t timeout_err;
 
+	/* read and write system calls */
+	uint64_t rx_syscalls;
+	uint64_t tx_syscalls;
+	/* part of txdata_octets sent with sendfile() */
+	uint64_t txfile_octets;
+	/* write bursts that had to wait a round trip for their R2T */
+	uint64_t r2t_stalls;
+	/* times the socket was full, and usecs spent waiting for room */
+	uint64_t tx_blocked;
+	uint64_t tx_blocked_usecs;
+
 	/*
 	 * iSCSI Custom Statistics support, i.e. Transport could
 	 * extend existing MIB statistics with its own specific statistics
@@ -21,7 +21,9 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netdb.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,7 +32,9 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
 
 #include "iscsid.h"
 #include "tgtd.h"
@@ -38,25 +42,48 @@
 #include "work.h"
 
 static void iscsi_tcp_event_handler(int fd, int events, void *data);
+static void iscsi_tcp_tx_kick(struct iscsi_connection *conn);
+static void iscsi_tcp_tx_sched_handler(struct event_data *tev);
 static void iscsi_tcp_release(struct iscsi_connection *conn);
 static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 						size_t ext_len);
 static void iscsi_tcp_free_task(struct iscsi_task *task);
+static void iscsi_tcp_idle_work_handler(void *data);
 
 static long nop_ttt;
 
-static int listen_fds[8];
 static struct iscsi_transport iscsi_tcp;
 
 struct iscsi_tcp_connection {
 	int fd;
+	/* what epoll waits for on fd */
+	int events;
+	/* sends queued PDUs on the reactor owning fd, see tx_kick */
+	struct event_data tx_sched;
+	/*
+	 * in iscsi_tcp_event_handler(), which frees the connection if it
+	 * got released meanwhile
+	 */
+	int in_handler;
+	int released;
 
 	struct list_head tcp_conn_siblings;
 	int nop_inflight_count;
 	int nop_interval;
-	int nop_tick;
 	int nop_count;
 	long ttt;
+	struct tgt_work nop_work;
+
+	struct iscsi_task_cache task_cache;
+	/* commands and Data-Out PDUs seen by the last idle_work */
+	uint32_t idle_pdus;
+
+	/*
+	 * where it was accepted, counted in portal->nr_conns[reactor_idx],
+	 * and the reactor owning it
+	 */
+	struct iscsi_portal *portal;
+	int reactor_idx;
 
 	struct iscsi_connection iscsi_conn;
 };
@@ -66,11 +93,102 @@ static inline struct iscsi_tcp_connection *TCP_CONN(struct iscsi_connection *con
 	return container_of(conn, struct iscsi_tcp_connection, iscsi_conn);
 }
 
-static struct tgt_work nop_work;
-
 /* all iscsi connections */
 static struct list_head iscsi_tcp_conn_list;
 
+/*
+ * A connection that got no command for ISCSI_IDLE_SECS and has none in
+ * flight gives its receive ring back to the pool and frees its cached
+ * tasks, the next command brings them back.
+ */
+#define ISCSI_IDLE_SECS		10
+
+static struct tgt_work idle_work = {
+	.entry = LIST_HEAD_INIT(idle_work.entry),
+	.func = iscsi_tcp_idle_work_handler,
+};
+
+static int iscsi_tcp_conn_idle(struct iscsi_tcp_connection *tcp_conn)
+{
+	struct iscsi_connection *conn = &tcp_conn->iscsi_conn;
+
+	return conn->state == STATE_SCSI && list_empty(&conn->task_list) &&
+		list_empty(&conn->tx_clist);
+}
+
+static void iscsi_tcp_idle_work_handler(void *data)
+{
+	struct iscsi_tcp_connection *tcp_conn;
+	struct iscsi_connection *conn;
+	uint32_t pdus;
+
+	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings) {
+		conn = &tcp_conn->iscsi_conn;
+		pdus = conn->stats.scsicmd_pdus + conn->stats.dataout_pdus;
+		if (pdus != tcp_conn->idle_pdus) {
+			tcp_conn->idle_pdus = pdus;
+			continue;
+		}
+		if (!iscsi_tcp_conn_idle(tcp_conn))
+			continue;
+
+		/* the reactor owning it may be reading into the ring */
+		pthread_mutex_lock(&conn->io_lock);
+		iscsi_rx_ring_release(conn);
+		pthread_mutex_unlock(&conn->io_lock);
+		iscsi_task_cache_exit(&tcp_conn->task_cache);
+	}
+
+	if (!list_empty(&iscsi_tcp_conn_list))
+		add_work(&idle_work, ISCSI_IDLE_SECS);
+}
+
+/* what a connection holds on to, its session left out */
+static size_t iscsi_tcp_conn_bytes(struct iscsi_tcp_connection *tcp_conn)
+{
+	struct iscsi_connection *conn = &tcp_conn->iscsi_conn;
+	size_t bytes = sizeof(*tcp_conn);
+
+	if (conn->req_buffer)
+		bytes += INCOMING_BUFSIZE;
+	bytes += conn->rsp_buffer_size;
+	if (conn->rx_ring)
+		bytes += ISCSI_RX_RING_SIZE;
+	if (!conn->session ||
+	    conn->session_param != conn->session->session_param)
+		bytes += sizeof(struct param) * ISCSI_PARAM_MAX;
+	bytes += iscsi_task_cache_bytes(&tcp_conn->task_cache);
+	if (conn->initiator)
+		bytes += strlen(conn->initiator) + 1;
+	if (conn->initiator_alias)
+		bytes += strlen(conn->initiator_alias) + 1;
+
+	return bytes;
+}
+
+tgtadm_err iscsi_tcp_conn_show(struct concat_buf *b)
+{
+	struct iscsi_tcp_connection *tcp_conn;
+	size_t bytes = 0;
+	int nr = 0, nr_idle = 0;
+
+	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings) {
+		nr++;
+		if (!iscsi_tcp_conn_idle(tcp_conn))
+			continue;
+		nr_idle++;
+		bytes += iscsi_tcp_conn_bytes(tcp_conn);
+	}
+
+	concat_printf(b, "Connections:\n");
+	concat_printf(b, _TAB1 "Total=%d\n", nr);
+	concat_printf(b, _TAB1 "Idle=%d\n", nr_idle);
+	concat_printf(b, _TAB1 "BytesPerIdle=%zu\n",
+		      nr_idle ? bytes / nr_idle : 0);
+
+	return TGTADM_SUCCESS;
+}
+
 static int iscsi_send_ping_nop_in(struct iscsi_tcp_connection *tcp_conn)
 {
 	struct iscsi_connection *conn = &tcp_conn->iscsi_conn;
@@ -85,53 +203,41 @@ static int iscsi_send_ping_nop_in(struct iscsi_tcp_connection *tcp_conn)
 	task->req.ttt = cpu_to_be32(tcp_conn->ttt);
 
 	list_add_tail(&task->c_list, &task->conn->tx_clist);
-	task->conn->tp->ep_event_modify(task->conn, EPOLLIN | EPOLLOUT);
+	iscsi_tcp_tx_kick(task->conn);
 
 	return 0;
 }
 
 static void iscsi_tcp_nop_work_handler(void *data)
 {
-	struct iscsi_tcp_connection *tcp_conn;
+	struct iscsi_tcp_connection *tcp_conn = data;
 
-	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings) {
-		if (tcp_conn->nop_interval == 0)
-			continue;
-
-		tcp_conn->nop_tick--;
-		if (tcp_conn->nop_tick > 0)
-			continue;
-
-		tcp_conn->nop_tick = tcp_conn->nop_interval;
-
-		tcp_conn->nop_inflight_count++;
-		if (tcp_conn->nop_inflight_count > tcp_conn->nop_count) {
-			eprintf("tcp connection timed out after %d failed " \
-				"NOP-OUT\n", tcp_conn->nop_count);
-			conn_close(&tcp_conn->iscsi_conn);
-			/* cant/shouldnt delete tcp_conn from within the loop */
-			break;
-		}
-		nop_ttt++;
-		if (nop_ttt == ISCSI_RESERVED_TAG)
-			nop_ttt = 1;
+	if (tcp_conn->nop_interval == 0)
+		return;
 
-		tcp_conn->ttt = nop_ttt;
-		iscsi_send_ping_nop_in(tcp_conn);
+	tcp_conn->nop_inflight_count++;
+	if (tcp_conn->nop_inflight_count > tcp_conn->nop_count) {
+		eprintf("tcp connection timed out after %d failed " \
+			"NOP-OUT\n", tcp_conn->nop_count);
+		conn_close(&tcp_conn->iscsi_conn);
+		return;
 	}
+	nop_ttt++;
+	if (nop_ttt == ISCSI_RESERVED_TAG)
+		nop_ttt = 1;
 
-	add_work(&nop_work, 1);
+	tcp_conn->ttt = nop_ttt;
+	iscsi_send_ping_nop_in(tcp_conn);
+
+	add_work(&tcp_conn->nop_work, tcp_conn->nop_interval);
 }
 
-static void iscsi_tcp_nop_reply(long ttt)
+static void iscsi_tcp_nop_reply(struct iscsi_connection *conn, long ttt)
 {
-	struct iscsi_tcp_connection *tcp_conn;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 
-	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings) {
-		if (tcp_conn->ttt != ttt)
-			continue;
+	if (tcp_conn->ttt == ttt)
 		tcp_conn->nop_inflight_count = 0;
-	}
 }
 
 int iscsi_update_target_nop_count(int tid, int count)
@@ -206,13 +312,89 @@ static int set_nodelay(int fd)
 	return ret;
 }
 
+/*
+ * The buffer sizes go on the listening sockets: an accepted socket
+ * inherits them, and its window scale is chosen from the receive
+ * buffer when the SYN comes in, before tgtd gets to see the socket.
+ */
+static int set_bufsize(int fd, struct iscsi_sockopts *opts)
+{
+	int ret;
+
+	if (opts->sndbuf) {
+		ret = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf,
+				 sizeof(opts->sndbuf));
+		if (ret)
+			return ret;
+	}
+
+	if (opts->rcvbuf) {
+		ret = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf,
+				 sizeof(opts->rcvbuf));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* the options set on every accepted connection */
+static int set_sockopts(int fd, struct iscsi_sockopts *opts)
+{
+	int ret;
+
+	if (opts->notsent_lowat) {
+		ret = setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				 &opts->notsent_lowat,
+				 sizeof(opts->notsent_lowat));
+		if (ret)
+			return ret;
+	}
+
+	if (opts->busy_poll) {
+		ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+				 &opts->busy_poll, sizeof(opts->busy_poll));
+		if (ret)
+			return ret;
+	}
+
+	if (opts->congestion[0]) {
+		ret = setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+				 opts->congestion, strlen(opts->congestion));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* tries the options on a spare socket, to fail the portal request */
+static int iscsi_tcp_check_sockopts(int af, struct iscsi_sockopts *opts)
+{
+	int fd, ret;
+
+	fd = socket(af, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	ret = set_bufsize(fd, opts);
+	if (!ret)
+		ret = set_sockopts(fd, opts);
+	if (ret)
+		eprintf("unable to set socket options, %m\n");
+
+	close(fd);
+	return ret;
+}
+
 static void accept_connection(int afd, int events, void *data)
 {
+	struct iscsi_portal *portal = data;
 	struct sockaddr_storage from;
 	socklen_t namesize;
 	struct iscsi_connection *conn;
 	struct iscsi_tcp_connection *tcp_conn;
-	int fd, ret;
+	int fd, ret, idx;
 
 	dprintf("%d\n", afd);
 
@@ -237,6 +419,9 @@ static void accept_connection(int afd, int events, void *data)
 	if (ret)
 		goto out;
 
+	if (set_sockopts(fd, &portal->sockopts))
+		eprintf("unable to set socket options, %m\n");
+
 	tcp_conn = zalloc(sizeof(*tcp_conn));
 	if (!tcp_conn)
 		goto out;
@@ -250,29 +435,61 @@ static void accept_connection(int afd, int events, void *data)
 	}
 
 	tcp_conn->fd = fd;
+	tcp_conn->events = EPOLLIN;
+	tgt_init_sched_event(&tcp_conn->tx_sched, iscsi_tcp_tx_sched_handler,
+			     tcp_conn);
 	conn->tp = &iscsi_tcp;
+	iscsi_task_cache_init(&tcp_conn->task_cache);
+
+	INIT_LIST_HEAD(&tcp_conn->nop_work.entry);
+	tcp_conn->nop_work.func = iscsi_tcp_nop_work_handler;
+	tcp_conn->nop_work.data = tcp_conn;
 
 	conn_read_pdu(conn);
 	set_non_blocking(fd);
 
-	ret = tgt_event_add(fd, EPOLLIN, iscsi_tcp_event_handler, conn);
+	/* a reuseport listener keeps its connections on its own reactor */
+	if (portal->nr_fds > 1)
+		idx = tgt_event_reactor_idx();
+	else
+		idx = tgt_reactor_least_loaded();
+
+	/* set up before the reactor owning it gets an event */
+	tcp_conn->portal = portal;
+	tcp_conn->reactor_idx = idx;
+	portal->nr_conns[idx]++;
+	list_add(&tcp_conn->tcp_conn_siblings, &iscsi_tcp_conn_list);
+
+	ret = tgt_event_add_on(idx, fd, EPOLLIN, iscsi_tcp_event_handler,
+			       conn, 1);
 	if (ret) {
+		list_del(&tcp_conn->tcp_conn_siblings);
+		portal->nr_conns[idx]--;
 		conn_exit(conn);
 		free(tcp_conn);
 		goto out;
 	}
 
-	list_add(&tcp_conn->tcp_conn_siblings, &iscsi_tcp_conn_list);
-
 	return;
 out:
 	close(fd);
 	return;
 }
 
+/*
+ * The handlers may drop the lock and another reactor may close and
+ * release conn then, its memory stays until they are back.
+ */
 static void iscsi_tcp_event_handler(int fd, int events, void *data)
 {
 	struct iscsi_connection *conn = (struct iscsi_connection *) data;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+
+	tcp_conn->in_handler = 1;
+
+	/* a parked login waits for no events, only an error gets here */
+	if (!(events & (EPOLLIN | EPOLLOUT)))
+		conn->state = STATE_CLOSE;
 
 	if (events & EPOLLIN)
 		iscsi_rx_handler(conn);
@@ -283,23 +500,193 @@ static void iscsi_tcp_event_handler(int fd, int events, void *data)
 	if (conn->state != STATE_CLOSE && events & EPOLLOUT)
 		iscsi_tx_handler(conn);
 
-	if (conn->state == STATE_CLOSE) {
+	if (conn->state == STATE_CLOSE && !conn->closed) {
 		dprintf("connection closed %p\n", conn);
 		conn_close(conn);
 	}
+
+	tcp_conn->in_handler = 0;
+	if (tcp_conn->released)
+		free(tcp_conn);
 }
 
-int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
+static int iscsi_tcp_listen(struct addrinfo *res, struct iscsi_sockopts *opts)
 {
+	int ret, fd, opt;
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0) {
+		if (res->ai_family == AF_INET6)
+			dprintf("IPv6 support is disabled.\n");
+		else
+			eprintf("unable to create fdet %d %d %d, %m\n",
+				res->ai_family,	res->ai_socktype,
+				res->ai_protocol);
+		return -1;
+	}
+
+	opt = 1;
+	ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt,
+			 sizeof(opt));
+	if (ret)
+		dprintf("unable to set SO_REUSEADDR, %m\n");
+
+	if (iscsi_reuseport) {
+		opt = 1;
+		ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+				 sizeof(opt));
+		if (ret) {
+			eprintf("unable to set SO_REUSEPORT, %m\n");
+			close(fd);
+			return -1;
+		}
+	}
+
+	opt = 1;
+	if (res->ai_family == AF_INET6) {
+		ret = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt,
+				 sizeof(opt));
+		if (ret) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	ret = set_bufsize(fd, opts);
+	if (ret) {
+		eprintf("unable to set socket buffer size, %m\n");
+		close(fd);
+		return -1;
+	}
+
+	ret = bind(fd, res->ai_addr, res->ai_addrlen);
+	if (ret) {
+		close(fd);
+		eprintf("unable to bind server socket, %m\n");
+		return -1;
+	}
+
+	ret = listen(fd, SOMAXCONN);
+	if (ret) {
+		eprintf("unable to listen to server socket, %m\n");
+		close(fd);
+		return -1;
+	}
+
+	set_non_blocking(fd);
+
+	return fd;
+}
+
+/*
+ * The kernel hands a new connection to the listener at the index the
+ * program returns in the reuseport group, the listeners join it in
+ * reactor order.  The program looks up the CPU that took the SYN, and
+ * so the RX interrupt of the flow, in the CPUs the reactors are pinned
+ * to, see iscsi_tcp_pin_reactors(), so the connection is served on that
+ * CPU.  Connections coming in on a CPU without a reactor are spread
+ * over all of them by CPU number.
+ */
+static int iscsi_tcp_steer_cpu(int fd)
+{
+	struct sock_filter *code, *p;
+	struct sock_fprog prog;
+	cpu_set_t seen;
+	int i, cpu, ret;
+
+	code = zalloc((2 * nr_reactors + 3) * sizeof(*code));
+	if (!code)
+		return -1;
+
+	p = code;
+	*p++ = (struct sock_filter)
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+
+	CPU_ZERO(&seen);
+	for (i = 0; i < nr_reactors; i++) {
+		cpu = tgt_reactor_cpu(i);
+		if (cpu < 0 || cpu >= CPU_SETSIZE || CPU_ISSET(cpu, &seen))
+			continue;
+		CPU_SET(cpu, &seen);
+
+		*p++ = (struct sock_filter) { BPF_JMP | BPF_JEQ | BPF_K, 0, 1,
+					      cpu };
+		*p++ = (struct sock_filter) { BPF_RET | BPF_K, 0, 0, i };
+	}
+
+	*p++ = (struct sock_filter)
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nr_reactors };
+	*p++ = (struct sock_filter) { BPF_RET | BPF_A, 0, 0, 0 };
+
+	prog.len = p - code;
+	prog.filter = code;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			 sizeof(prog));
+	free(code);
+
+	return ret;
+}
+
+/*
+ * Pin reactor i, but the main one, to CPU i % n of the n CPUs tgtd may
+ * run on.  With one more reactor than CPUs every CPU has a reactor of
+ * its own; the main thread is never pinned, see tgt_reactor_set_cpu().
+ */
+static void iscsi_tcp_pin_reactors(void)
+{
+	cpu_set_t set;
+	int i, cpu, nr_cpus, *cpus;
+
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		eprintf("can't get the cpus to pin reactors to, %m\n");
+		return;
+	}
+
+	nr_cpus = CPU_COUNT(&set);
+	cpus = zalloc(nr_cpus * sizeof(*cpus));
+	if (!cpus)
+		return;
+
+	for (cpu = 0, i = 0; cpu < CPU_SETSIZE && i < nr_cpus; cpu++)
+		if (CPU_ISSET(cpu, &set))
+			cpus[i++] = cpu;
+
+	for (i = 1; i < nr_reactors; i++)
+		tgt_reactor_set_cpu(i, cpus[i % nr_cpus]);
+
+	free(cpus);
+}
+
+static void iscsi_tcp_free_portal(struct iscsi_portal *portal)
+{
+	free(portal->nr_conns);
+	free(portal->fds);
+	free(portal->addr);
+	free(portal);
+}
+
+/*
+ * With reuseport each address gets one listener per reactor, and every
+ * reactor accepts its share of the connections and serves them itself
+ * instead of the main loop accepting all of them.
+ */
+int iscsi_tcp_init_portal(char *addr, int port, int tpgt, char *params)
+{
+	struct iscsi_sockopts opts;
 	struct addrinfo hints, *res, *res0;
 	char servname[64];
-	int ret, fd, opt, nr_sock = 0;
+	int ret, fd, i, nr_fds, nr_sock = 0;
 	struct iscsi_portal *portal = NULL;
 	char addrstr[64];
 	void *addrptr = NULL;
 
 	port = port ? port : ISCSI_LISTEN_PORT;
 
+	memset(&opts, 0, sizeof(opts));
+	if (params && iscsi_param_parse_sockopts(params, &opts))
+		return -EINVAL;
+
 	memset(servname, 0, sizeof(servname));
 	snprintf(servname, sizeof(servname), "%d", port);
 
@@ -313,58 +700,45 @@ int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
 		return -errno;
 	}
 
+	nr_fds = iscsi_reuseport ? nr_reactors : 1;
+
 	for (res = res0; res; res = res->ai_next) {
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (fd < 0) {
-			if (res->ai_family == AF_INET6)
-				dprintf("IPv6 support is disabled.\n");
-			else
-				eprintf("unable to create fdet %d %d %d, %m\n",
-					res->ai_family,	res->ai_socktype,
-					res->ai_protocol);
+		if (iscsi_tcp_check_sockopts(res->ai_family, &opts))
 			continue;
+
+		portal = zalloc(sizeof(struct iscsi_portal));
+		if (!portal)
+			break;
+		portal->fds = zalloc(nr_fds * sizeof(int));
+		portal->nr_conns = zalloc(nr_reactors * sizeof(int));
+		if (!portal->fds || !portal->nr_conns) {
+			iscsi_tcp_free_portal(portal);
+			break;
 		}
 
-		opt = 1;
-		ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt,
-				 sizeof(opt));
-		if (ret)
-			dprintf("unable to set SO_REUSEADDR, %m\n");
+		for (i = 0; i < nr_fds; i++) {
+			fd = iscsi_tcp_listen(res, &opts);
+			if (fd < 0)
+				break;
 
-		opt = 1;
-		if (res->ai_family == AF_INET6) {
-			ret = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt,
-					 sizeof(opt));
+			ret = tgt_event_add_on(i, fd, EPOLLIN,
+					       accept_connection, portal, 0);
 			if (ret) {
 				close(fd);
-				continue;
+				break;
 			}
+			portal->fds[portal->nr_fds++] = fd;
 		}
 
-		ret = bind(fd, res->ai_addr, res->ai_addrlen);
-		if (ret) {
-			close(fd);
-			eprintf("unable to bind server socket, %m\n");
-			continue;
-		}
-
-		ret = listen(fd, SOMAXCONN);
-		if (ret) {
-			eprintf("unable to listen to server socket, %m\n");
-			close(fd);
+		if (!portal->nr_fds) {
+			iscsi_tcp_free_portal(portal);
 			continue;
 		}
 
-		set_non_blocking(fd);
-		ret = tgt_event_add(fd, EPOLLIN, accept_connection, NULL);
-		if (ret)
-			close(fd);
-		else {
-			listen_fds[nr_sock] = fd;
-			nr_sock++;
-		}
+		if (iscsi_reuseport == ISCSI_REUSEPORT_CPU &&
+		    iscsi_tcp_steer_cpu(portal->fds[0]))
+			eprintf("unable to steer connections by cpu, %m\n");
 
-		portal = zalloc(sizeof(struct iscsi_portal));
 		switch (res->ai_family) {
 		case AF_INET:
 			addrptr = &((struct sockaddr_in *)
@@ -379,10 +753,12 @@ int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
 			     addrstr, sizeof(addrstr)));
 		portal->port = port;
 		portal->tpgt = tpgt;
-		portal->fd   = fd;
+		portal->fd   = portal->fds[0];
 		portal->af   = res->ai_family;
+		portal->sockopts = opts;
 
 		list_add(&portal->iscsi_portal_siblings, &iscsi_portals_list);
+		nr_sock++;
 	}
 
 	freeaddrinfo(res0);
@@ -390,9 +766,9 @@ int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
 	return !nr_sock;
 }
 
-int iscsi_add_portal(char *addr, int port, int tpgt)
+int iscsi_add_portal(char *addr, int port, int tpgt, char *params)
 {
-	if (iscsi_tcp_init_portal(addr, port, tpgt)) {
+	if (iscsi_tcp_init_portal(addr, port, tpgt, params)) {
 		eprintf("failed to create/bind to portal %s:%d\n", addr, port);
 		return -1;
 	}
@@ -403,16 +779,23 @@ int iscsi_add_portal(char *addr, int port, int tpgt)
 int iscsi_delete_portal(char *addr, int port)
 {
 	struct iscsi_portal *portal;
+	struct iscsi_tcp_connection *tcp_conn;
+	int i;
 
 	list_for_each_entry(portal, &iscsi_portals_list,
 			    iscsi_portal_siblings) {
 		if (!strcmp(addr, portal->addr) && port == portal->port) {
-			if (portal->fd != -1)
-				tgt_event_del(portal->fd);
-			close(portal->fd);
+			for (i = 0; i < portal->nr_fds; i++) {
+				tgt_event_del(portal->fds[i]);
+				close(portal->fds[i]);
+			}
+			list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list,
+					    tcp_conn_siblings) {
+				if (tcp_conn->portal == portal)
+					tcp_conn->portal = NULL;
+			}
 			list_del(&portal->iscsi_portal_siblings);
-			free(portal->addr);
-			free(portal);
+			iscsi_tcp_free_portal(portal);
 			return 0;
 		}
 	}
@@ -421,25 +804,68 @@ int iscsi_delete_portal(char *addr, int port)
 	return -1;
 }
 
+/*
+ * The new socket options apply to the connections accepted from now on,
+ * the buffer sizes are set on the listeners for them to inherit.
+ */
+int iscsi_update_portal(char *addr, int port, char *params)
+{
+	struct iscsi_portal *portal;
+	struct iscsi_sockopts opts;
+	int i, found = 0;
+
+	list_for_each_entry(portal, &iscsi_portals_list,
+			    iscsi_portal_siblings) {
+		if (strcmp(addr, portal->addr) || port != portal->port)
+			continue;
+
+		opts = portal->sockopts;
+		if (iscsi_param_parse_sockopts(params, &opts) ||
+		    iscsi_tcp_check_sockopts(portal->af, &opts))
+			return -1;
+
+		for (i = 0; i < portal->nr_fds; i++) {
+			if (set_bufsize(portal->fds[i], &opts)) {
+				eprintf("unable to set socket buffer size, %m\n");
+				return -1;
+			}
+		}
+
+		portal->sockopts = opts;
+		found = 1;
+	}
+
+	if (!found) {
+		eprintf("update_portal failed. No such portal found %s:%d\n",
+			addr, port);
+		return -1;
+	}
+	return 0;
+}
+
 static int iscsi_tcp_init(void)
 {
+	INIT_LIST_HEAD(&iscsi_tcp_conn_list);
+
 	/* If we were passed any portals on the command line */
 	if (portal_arguments)
-		iscsi_param_parse_portals(portal_arguments, 1, 0);
+		/* the listener options apply to all portals, so take them first */
+		iscsi_param_parse_portals(portal_arguments, 0, 0, 0);
+
+	/* the steering program is built from where the reactors run */
+	if (iscsi_reuseport == ISCSI_REUSEPORT_CPU)
+		iscsi_tcp_pin_reactors();
+
+	if (portal_arguments)
+		iscsi_param_parse_portals(portal_arguments, 1, 0, 0);
 
 	/* if the user did not set a portal we default to wildcard
 	   for ipv4 and ipv6
 	*/
 	if (list_empty(&iscsi_portals_list)) {
-		iscsi_add_portal(NULL, 3260, 1);
+		iscsi_add_portal(NULL, 3260, 1, NULL);
 	}
 
-	INIT_LIST_HEAD(&iscsi_tcp_conn_list);
-
-	nop_work.func = iscsi_tcp_nop_work_handler;
-	nop_work.data = &nop_work;
-	add_work(&nop_work, 1);
-
 	return 0;
 }
 
@@ -455,26 +881,24 @@ static void iscsi_tcp_exit(void)
 
 static int iscsi_tcp_conn_login_complete(struct iscsi_connection *conn)
 {
-	struct iscsi_tcp_connection *tcp_conn;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 	struct iscsi_target *target;
 
-	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings)
-		if (&tcp_conn->iscsi_conn == conn)
-			break;
-
-	if (tcp_conn == NULL)
-		return 0;
-
 	list_for_each_entry(target, &iscsi_targets_list, tlist) {
 		if (target->tid != conn->tid)
 			continue;
 
 		tcp_conn->nop_count = target->nop_count;
 		tcp_conn->nop_interval = target->nop_interval;
-		tcp_conn->nop_tick = target->nop_interval;
 		break;
 	}
 
+	if (tcp_conn->nop_interval)
+		add_work(&tcp_conn->nop_work, tcp_conn->nop_interval);
+
+	if (list_empty(&idle_work.entry))
+		add_work(&idle_work, ISCSI_IDLE_SECS);
+
 	return 0;
 }
 
@@ -485,22 +909,37 @@ static size_t iscsi_tcp_read(struct iscsi_connection *conn, void *buf,
 	return read(tcp_conn->fd, buf, nbytes);
 }
 
-static size_t iscsi_tcp_write_begin(struct iscsi_connection *conn, void *buf,
-				    size_t nbytes)
+static ssize_t iscsi_tcp_readv(struct iscsi_connection *conn,
+			       struct iovec *iov, int iovcnt)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	int opt = 1;
-
-	setsockopt(tcp_conn->fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-	return write(tcp_conn->fd, buf, nbytes);
+	return readv(tcp_conn->fd, iov, iovcnt);
 }
 
-static void iscsi_tcp_write_end(struct iscsi_connection *conn)
+/*
+ * Whole PDUs go out in one call and the socket has TCP_NODELAY, so
+ * there is nothing left for TCP_CORK to merge.  The exception is a
+ * header followed by data from sendfile(), @more keeps it queued until
+ * the data joins it.
+ */
+static ssize_t iscsi_tcp_writev(struct iscsi_connection *conn,
+				struct iovec *iov, int iovcnt, int more)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	int opt = 0;
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt,
+	};
+
+	return sendmsg(tcp_conn->fd, &msg,
+		       MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
 
-	setsockopt(tcp_conn->fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+static ssize_t iscsi_tcp_sendfile(struct iscsi_connection *conn, int fd,
+				  off_t *offset, size_t count)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	return sendfile(tcp_conn->fd, fd, offset, count);
 }
 
 static size_t iscsi_tcp_close(struct iscsi_connection *conn)
@@ -508,8 +947,10 @@ static size_t iscsi_tcp_close(struct iscsi_connection *conn)
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 
 	tgt_event_del(tcp_conn->fd);
+	tgt_remove_sched_event(&tcp_conn->tx_sched);
 	conn->state = STATE_CLOSE;
 	tcp_conn->nop_interval = 0;
+	del_work(&tcp_conn->nop_work);
 	return 0;
 }
 
@@ -519,8 +960,14 @@ static void iscsi_tcp_release(struct iscsi_connection *conn)
 
 	conn_exit(conn);
 	close(tcp_conn->fd);
+	if (tcp_conn->portal)
+		tcp_conn->portal->nr_conns[tcp_conn->reactor_idx]--;
 	list_del(&tcp_conn->tcp_conn_siblings);
-	free(tcp_conn);
+	iscsi_task_cache_exit(&tcp_conn->task_cache);
+	if (tcp_conn->in_handler)
+		tcp_conn->released = 1;
+	else
+		free(tcp_conn);
 }
 
 static int iscsi_tcp_show(struct iscsi_connection *conn, char *buf, int rest)
@@ -555,36 +1002,60 @@ static void iscsi_event_modify(struct iscsi_connection *conn, int events)
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 	int ret;
 
+	if (events == tcp_conn->events)
+		return;
+
 	ret = tgt_event_modify(tcp_conn->fd, events);
 	if (ret)
 		eprintf("tgt_event_modify failed\n");
+	else
+		tcp_conn->events = events;
+}
+
+static void iscsi_tcp_tx_sched_handler(struct event_data *tev)
+{
+	struct iscsi_tcp_connection *tcp_conn = tev->data;
+
+	iscsi_tcp_event_handler(tcp_conn->fd, EPOLLOUT, &tcp_conn->iscsi_conn);
+}
+
+/*
+ * Arming EPOLLOUT for every response and dropping it again once
+ * tx_clist is empty costs two epoll_ctl() calls per command. Instead
+ * the reactor sends right after the events it is handling, which also
+ * gathers the responses completed meanwhile, and EPOLLOUT is only set
+ * once the socket is full. A completion on another reactor hands the
+ * send over to the one owning the connection and wakes it up.
+ */
+static void iscsi_tcp_tx_kick(struct iscsi_connection *conn)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+
+	if (tcp_conn->events & EPOLLOUT)
+		return;
+
+	tgt_add_sched_event_on(tcp_conn->reactor_idx, &tcp_conn->tx_sched);
 }
 
 static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 					size_t ext_len)
 {
-	struct iscsi_task *task;
-
-	task = malloc(sizeof(*task) + ext_len);
-	if (task)
-		memset(task, 0, sizeof(*task) + ext_len);
-	return task;
+	return iscsi_task_cache_alloc(&TCP_CONN(conn)->task_cache, ext_len);
 }
 
 static void iscsi_tcp_free_task(struct iscsi_task *task)
 {
-	free(task);
+	iscsi_task_cache_free(&TCP_CONN(task->conn)->task_cache, task);
 }
 
 static void *iscsi_tcp_alloc_data_buf(struct iscsi_connection *conn, size_t sz)
 {
-	return valloc(sz);
+	return iscsi_pool_alloc_buf(sz);
 }
 
 static void iscsi_tcp_free_data_buf(struct iscsi_connection *conn, void *buf)
 {
-	if (buf)
-		free(buf);
+	iscsi_pool_free_buf(buf);
 }
 
 static int iscsi_tcp_getsockname(struct iscsi_connection *conn,
@@ -609,21 +1080,33 @@ static void iscsi_tcp_conn_force_close(struct iscsi_connection *conn)
 	conn->tp->ep_event_modify(conn, EPOLLIN|EPOLLOUT|EPOLLERR);
 }
 
-void iscsi_print_nop_settings(struct concat_buf *b, int tid)
+void iscsi_print_target_settings(struct concat_buf *b, int tid)
 {
 	struct iscsi_target *target;
 
 	list_for_each_entry(target, &iscsi_targets_list, tlist) {
 		if (target->tid != tid)
 			continue;
-		if (target->nop_interval == 0)
-			continue;
 
-		concat_printf(b,
-		      _TAB2 "Nop interval: %d\n"
-		      _TAB2 "Nop count: %d\n",
-		      target->nop_interval,
-		      target->nop_count);
+		if (target->nop_interval)
+			concat_printf(b,
+			      _TAB2 "Nop interval: %d\n"
+			      _TAB2 "Nop count: %d\n",
+			      target->nop_interval,
+			      target->nop_count);
+		if (target->zerocopy_read)
+			concat_printf(b, _TAB2 "Zero-copy read: on\n");
+		if (target->cmd_window_min || target->cmd_window_max ||
+		    target->cmd_window_latency || target->cmd_window_bytes)
+			concat_printf(b,
+			      _TAB2 "Command window: %u-%u\n"
+			      _TAB2 "Command window latency: %u us\n"
+			      _TAB2 "Command window bytes: %" PRIu64 "\n",
+			      target->cmd_window_min,
+			      target->cmd_window_max ? target->cmd_window_max :
+			      target->session_param[ISCSI_PARAM_MAX_QUEUE_CMD].val,
+			      target->cmd_window_latency,
+			      target->cmd_window_bytes);
 		break;
 	}
 }
@@ -638,13 +1121,15 @@ static struct iscsi_transport iscsi_tcp = {
 	.alloc_task		= iscsi_tcp_alloc_task,
 	.free_task		= iscsi_tcp_free_task,
 	.ep_read		= iscsi_tcp_read,
-	.ep_write_begin		= iscsi_tcp_write_begin,
-	.ep_write_end		= iscsi_tcp_write_end,
+	.ep_readv		= iscsi_tcp_readv,
+	.ep_writev		= iscsi_tcp_writev,
+	.ep_sendfile		= iscsi_tcp_sendfile,
 	.ep_close		= iscsi_tcp_close,
 	.ep_force_close		= iscsi_tcp_conn_force_close,
 	.ep_release		= iscsi_tcp_release,
 	.ep_show		= iscsi_tcp_show,
 	.ep_event_modify	= iscsi_event_modify,
+	.ep_tx_kick		= iscsi_tcp_tx_kick,
 	.alloc_data_buf		= iscsi_tcp_alloc_data_buf,
 	.free_data_buf		= iscsi_tcp_free_data_buf,
 	.ep_getsockname		= iscsi_tcp_getsockname,
@@ -26,10 +26,12 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
@@ -39,10 +41,13 @@
 #include "driver.h"
 #include "scsi.h"
 #include "tgtadm.h"
+#include "target.h"
 #include "crc32c.h"
 
 int default_nop_interval;
 int default_nop_count;
+int default_zerocopy_read;
+int iscsi_reuseport;
 
 LIST_HEAD(iscsi_portals_list);
 
@@ -76,6 +81,25 @@ enum {
 	IOSTATE_TX_END,
 };
 
+/*
+ * Commands decoded by iscsi_rx_handler() go to the backing stores marked
+ * not_last.  The first one schedules rx_flush_sched, which runs once the
+ * reactor has handled every ready connection, so the commands of one
+ * pass reach each backing store as a single batch.  rx_batch is per
+ * reactor, the others go on while a handler receives out of the lock.
+ */
+static __thread int rx_batch;
+
+static void iscsi_rx_flush(struct event_data *tev)
+{
+	bs_cmd_flush();
+}
+
+static struct event_data rx_flush_sched = {
+	.sched_handler = iscsi_rx_flush,
+	.e_list = LIST_HEAD_INIT(rx_flush_sched.e_list),
+};
+
 void conn_read_pdu(struct iscsi_connection *conn)
 {
 	conn->rx_iostate = IOSTATE_RX_BHS;
@@ -267,10 +291,13 @@ static void login_security_done(struct iscsi_connection *conn)
 
 			/* do session reinstatement */
 
+			/* the last conn_put() would free it under the loop */
+			session_get(session);
 			list_for_each_entry_safe(ent, next, &session->conn_list,
 						 clist) {
 				conn_close(ent);
 			}
+			session_put(session);
 
 			session = NULL;
 		} else if (req->tsih != session->tsih) {
@@ -509,7 +536,12 @@ static void login_start(struct iscsi_connection *conn)
 		conn->tid = target->tid;
 
 		redir = target_redirected(target, conn, buf, &reason);
-		if (redir < 0) {
+		if (redir == -EAGAIN) {
+			rsp->status_class = ISCSI_STATUS_CLS_TARGET_ERR;
+			rsp->status_detail = ISCSI_LOGIN_STATUS_SVC_UNAVAILABLE;
+			conn->state = STATE_EXIT;
+			return;
+		} else if (redir < 0) {
 			rsp->status_class = ISCSI_STATUS_CLS_TARGET_ERR;
 			rsp->status_detail = ISCSI_LOGIN_STATUS_TARGET_ERROR;
 			conn->state = STATE_EXIT;
@@ -561,7 +593,7 @@ static void login_start(struct iscsi_connection *conn)
 /* 		} */
 
 		memcpy(conn->session_param, target->session_param,
-		       sizeof(conn->session_param));
+		       sizeof(target->session_param));
 	}
 
 	conn->exp_cmd_sn = be32_to_cpu(req->cmdsn);
@@ -993,6 +1025,49 @@ static int cmnd_execute(struct iscsi_connection *conn)
 	return res;
 }
 
+/*
+ * The first login PDU waits for the redirect callback of its target,
+ * so that the answer is at hand when login_start() looks for it.
+ */
+static int login_redirect_wait(struct iscsi_connection *conn)
+{
+	struct iscsi_target *target;
+	char *session_type, *target_name;
+
+	if ((conn->req.bhs.opcode & ISCSI_OPCODE_MASK) != ISCSI_OP_LOGIN ||
+	    conn->state != STATE_FREE)
+		return 0;
+
+	session_type = text_key_find(conn, "SessionType");
+	if (session_type && strcmp(session_type, "Normal"))
+		return 0;
+
+	target_name = text_key_find(conn, "TargetName");
+	if (!target_name)
+		return 0;
+
+	target = target_find_by_name(target_name);
+	if (!target || target->rdma)
+		return 0;
+
+	return target_redirect_wait(target, conn);
+}
+
+/* the response goes out on EPOLLOUT */
+static void cmnd_execute_rx(struct iscsi_connection *conn)
+{
+	conn_write_pdu(conn);
+	conn->tp->ep_event_modify(conn, EPOLLOUT);
+	if (cmnd_execute(conn))
+		conn->state = STATE_CLOSE;
+}
+
+/* the redirect callback answered for the parked login PDU */
+void iscsi_login_resume(struct iscsi_connection *conn)
+{
+	cmnd_execute_rx(conn);
+}
+
 static void cmnd_finish(struct iscsi_connection *conn)
 {
 	switch (conn->state) {
@@ -1070,6 +1145,86 @@ void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *scmd)
 		rsp->residual_count = 0;
 }
 
+static uint64_t iscsi_usecs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+/*
+ * MaxCmdSN for the responses.  The initiator ignores a MaxCmdSN below
+ * the one it has, so a smaller window takes effect as ExpCmdSN moves on
+ * and the commands up to the highest MaxCmdSN sent stay acceptable.
+ */
+static uint32_t iscsi_max_cmd_sn(struct iscsi_session *session)
+{
+	uint32_t max_cmd_sn = session->exp_cmd_sn + session->cmd_window;
+
+	if (after(max_cmd_sn, session->max_cmd_sn))
+		session->max_cmd_sn = max_cmd_sn;
+
+	return session->max_cmd_sn;
+}
+
+/* keeps the window within the limits of the target */
+void iscsi_cmd_window_clamp(struct iscsi_session *session)
+{
+	struct iscsi_target *target = session->target;
+	uint32_t floor, ceiling;
+
+	ceiling = session->max_queue_cmd;
+	if (target->cmd_window_max && target->cmd_window_max < ceiling)
+		ceiling = target->cmd_window_max;
+	floor = min_t(uint32_t, max_t(uint32_t, target->cmd_window_min, 1),
+		      ceiling);
+
+	if (session->cmd_window > ceiling)
+		session->cmd_window = ceiling;
+	if (session->cmd_window < floor)
+		session->cmd_window = floor;
+}
+
+/*
+ * AIMD on the command window of a session, driven by the backing store.
+ * A command is slow when it took longer than cmd_window_latency usecs
+ * there, or left more than cmd_window_bytes of data in flight.  After
+ * a window's worth of completions the window halves if one of them was
+ * slow and grows by one otherwise, so it shrinks within about one
+ * backing store latency of the trouble and creeps back when it is over.
+ */
+static void iscsi_cmd_window_update(struct iscsi_task *task)
+{
+	struct iscsi_session *session = task->conn->session;
+	struct iscsi_target *target = session->target;
+	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
+
+	session->cmd_bytes -= ntohl(req->data_length);
+
+	if (!target->cmd_window_latency && !target->cmd_window_bytes)
+		return;
+
+	if (target->cmd_window_latency && task->queue_usecs &&
+	    iscsi_usecs() - task->queue_usecs > target->cmd_window_latency)
+		session->cmd_window_slow = 1;
+	if (target->cmd_window_bytes &&
+	    session->cmd_bytes > target->cmd_window_bytes)
+		session->cmd_window_slow = 1;
+
+	if (++session->cmd_window_count < session->cmd_window)
+		return;
+
+	if (session->cmd_window_slow)
+		session->cmd_window /= 2;
+	else
+		session->cmd_window++;
+	iscsi_cmd_window_clamp(session);
+
+	session->cmd_window_count = 0;
+	session->cmd_window_slow = 0;
+}
+
 struct iscsi_sense_data {
 	uint16_t length;
 	uint8_t  data[0];
@@ -1090,8 +1245,7 @@ static int iscsi_cmd_rsp_build(struct iscsi_task *task)
 	rsp->cmd_status = scsi_get_result(&task->scmd);
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	iscsi_rsp_set_residual(rsp, &task->scmd);
 
@@ -1125,7 +1279,11 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 	rsp->offset = cpu_to_be32(task->offset);
 	rsp->datasn = cpu_to_be32(task->exp_r2tsn++);
 
-	datalen = scsi_get_in_transfer_len(&task->scmd) - task->offset;
+	/* still in SCSI, only the prefix the backing store has filled */
+	if (task_in_scsi(task))
+		datalen = scsi_get_in_ready(&task->scmd) - task->offset;
+	else
+		datalen = scsi_get_in_transfer_len(&task->scmd) - task->offset;
 
 	maxdatalen = conn->tp->rdma ?
 		conn->session_param[ISCSI_PARAM_MAX_BURST].val :
@@ -1135,7 +1293,10 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 		scsi_get_in_transfer_len(&task->scmd), task->offset, maxdatalen,
 		rsp->itt);
 
-	if (datalen <= maxdatalen) {
+	if (task_in_scsi(task)) {
+		if (datalen > maxdatalen)
+			datalen = maxdatalen;
+	} else if (datalen <= maxdatalen) {
 		rsp->flags = ISCSI_FLAG_CMD_FINAL;
 
 		/* collapse status into final packet if successful */
@@ -1151,8 +1312,7 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 		datalen = maxdatalen;
 
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	conn->rsp.datasize = datalen;
 	hton24(rsp->dlength, datalen);
@@ -1168,8 +1328,10 @@ static int iscsi_r2t_build(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
 	struct iscsi_r2t_rsp *rsp = (struct iscsi_r2t_rsp *) &conn->rsp.bhs;
+	struct iscsi_r2t *r2t;
 	uint32_t length;
 
+	clear_task_r2t_queued(task);
 	memset(rsp, 0, sizeof(*rsp));
 
 	rsp->opcode = ISCSI_OP_R2T;
@@ -1182,13 +1344,138 @@ static int iscsi_r2t_build(struct iscsi_task *task)
 	/* return next statsn for this conn w/o advancing it */
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
-	rsp->ttt = (unsigned long) task;
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 	length = min_t(uint32_t, task->r2t_count,
 		       conn->session_param[ISCSI_PARAM_MAX_BURST].val);
 	rsp->data_length = cpu_to_be32(length);
 
+	r2t = &task->r2t[task->nr_r2t++];
+	/* the ITT finds the task, the TTT tells its R2Ts apart */
+	r2t->ttt = ++conn->session->ttt;
+	if (r2t->ttt == ISCSI_RESERVED_TAG)
+		r2t->ttt = ++conn->session->ttt;
+	rsp->ttt = cpu_to_be32(r2t->ttt);
+	r2t->offset = task->offset;
+	r2t->length = length;
+	r2t->received = 0;
+	r2t->nr_ext = 0;
+	r2t->ext = NULL;
+
+	task->offset += length;
+	task->r2t_count -= length;
+
+	return 0;
+}
+
+/* queue the task for one more R2T if it has data and a slot left */
+static int iscsi_r2t_queue(struct iscsi_task *task)
+{
+	struct iscsi_connection *conn = task->conn;
+	int max_r2t = min_t(int, conn->session_param[ISCSI_PARAM_MAX_R2T].val,
+			    ISCSI_R2T_MAX);
+
+	if (!task->r2t_count || task->nr_r2t >= max_r2t ||
+	    task_r2t_queued(task))
+		return 0;
+
+	set_task_r2t_queued(task);
+	list_add_tail(&task->c_list, &conn->tx_clist);
+	return 1;
+}
+
+/* the outstanding R2T ttt that solicited [offset, offset + len) */
+static struct iscsi_r2t *iscsi_r2t_find(struct iscsi_task *task, uint32_t ttt,
+					uint32_t offset, uint32_t len)
+{
+	struct iscsi_r2t *r2t;
+	int i;
+
+	for (i = 0; i < task->nr_r2t; i++) {
+		r2t = &task->r2t[i];
+		if (r2t->ttt == ttt && offset >= r2t->offset &&
+		    len <= r2t->offset + r2t->length - offset)
+			return r2t;
+	}
+
+	return NULL;
+}
+
+static struct iscsi_r2t_ext *iscsi_r2t_ext(struct iscsi_r2t *r2t)
+{
+	return r2t->ext ? r2t->ext : r2t->ext_inline;
+}
+
+/* the first received range of the burst that ends after offset */
+static int iscsi_r2t_ext_find(struct iscsi_r2t *r2t, uint32_t offset)
+{
+	struct iscsi_r2t_ext *ext = iscsi_r2t_ext(r2t);
+	int lo = 0, hi = r2t->nr_ext, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ext[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* whether any of [offset, offset + len) has come in already */
+static int iscsi_r2t_overlaps(struct iscsi_r2t *r2t, uint32_t offset,
+			      uint32_t len)
+{
+	int i = iscsi_r2t_ext_find(r2t, offset);
+
+	return i < r2t->nr_ext && iscsi_r2t_ext(r2t)[i].offset < offset + len;
+}
+
+/* record [offset, offset + len), which must not overlap anything received */
+static int iscsi_r2t_add(struct iscsi_r2t *r2t, uint32_t offset, uint32_t len)
+{
+	struct iscsi_r2t_ext *ext = iscsi_r2t_ext(r2t), *p;
+	uint32_t end = offset + len;
+	int i, max;
+
+	if (!len)
+		return 0;
+
+	i = iscsi_r2t_ext_find(r2t, offset);
+
+	if (i && ext[i - 1].end == offset) {
+		ext[i - 1].end = end;
+		if (i < r2t->nr_ext && ext[i].offset == end) {
+			ext[i - 1].end = ext[i].end;
+			memmove(&ext[i], &ext[i + 1],
+				(r2t->nr_ext - i - 1) * sizeof(*ext));
+			r2t->nr_ext--;
+		}
+		goto out;
+	}
+
+	if (i < r2t->nr_ext && ext[i].offset == end) {
+		ext[i].offset = offset;
+		goto out;
+	}
+
+	max = r2t->ext ? r2t->max_ext : ISCSI_R2T_EXT_INLINE;
+	if (r2t->nr_ext == max) {
+		p = malloc(2 * max * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		memcpy(p, ext, r2t->nr_ext * sizeof(*p));
+		free(r2t->ext);
+		r2t->ext = ext = p;
+		r2t->max_ext = 2 * max;
+	}
+
+	memmove(&ext[i + 1], &ext[i], (r2t->nr_ext - i) * sizeof(*ext));
+	ext[i].offset = offset;
+	ext[i].end = end;
+	r2t->nr_ext++;
+out:
+	r2t->received += len;
 	return 0;
 }
 
@@ -1202,6 +1489,7 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 	task = conn->tp->alloc_task(conn, ext_len);
 	if (!task)
 		return NULL;
+	task->conn = conn;
 
 	if (data_len) {
 		buf = conn->tp->alloc_data_buf(conn, data_len);
@@ -1213,7 +1501,6 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 	}
 
 	memcpy(&task->req, req, sizeof(*req));
-	task->conn = conn;
 	INIT_LIST_HEAD(&task->c_hlist);
 	INIT_LIST_HEAD(&task->c_list);
 	list_add(&task->c_siblings, &conn->task_list);
@@ -1221,6 +1508,15 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 	return task;
 }
 
+/* tasks were queued on tx_clist */
+static void iscsi_tx_kick(struct iscsi_connection *conn)
+{
+	if (conn->tp->ep_tx_kick)
+		conn->tp->ep_tx_kick(conn);
+	else
+		conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+}
+
 void iscsi_free_task(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
@@ -1230,6 +1526,9 @@ void iscsi_free_task(struct iscsi_task *task)
 	if (task_opcode(task) == ISCSI_OP_SCSI_CMD)
 		list_del(&task->c_hlist);
 
+	while (task->nr_r2t)
+		free(task->r2t[--task->nr_r2t].ext);
+
 	conn->tp->free_data_buf(conn, scsi_get_in_buffer(&task->scmd));
 	conn->tp->free_data_buf(conn, scsi_get_out_buffer(&task->scmd));
 
@@ -1267,13 +1566,41 @@ static int iscsi_scsi_cmd_done(uint64_t nid, int result, struct scsi_cmd *scmd)
 	 * the response with a little extra code or we can check if this
 	 * task got reassinged to another connection.
 	 */
+	clear_task_in_scsi(task);
+	iscsi_cmd_window_update(task);
 	if (task->conn->state == STATE_CLOSE) {
 		iscsi_free_cmd_task(task);
 		return 0;
 	}
 
+	/* already queued for streamed data, it sends the rest now */
+	if (task_streaming(task)) {
+		clear_task_streaming(task);
+		return 0;
+	}
+
 	list_add_tail(&task->c_list, &task->conn->tx_clist);
-	task->conn->tp->ep_event_modify(task->conn, EPOLLIN | EPOLLOUT);
+	iscsi_tx_kick(task->conn);
+
+	return 0;
+}
+
+/*
+ * The backing store filled more of the in buffer of a running READ,
+ * queue the task to send it unless it is queued already.
+ */
+static int iscsi_scsi_cmd_data_ready(uint64_t nid, struct scsi_cmd *scmd)
+{
+	struct iscsi_task *task = ITASK(scmd);
+	struct iscsi_connection *conn = task->conn;
+
+	if (conn->state == STATE_CLOSE || task_streaming(task) ||
+	    task->offset >= scsi_get_in_ready(scmd))
+		return 0;
+
+	set_task_streaming(task);
+	list_add_tail(&task->c_list, &conn->tx_clist);
+	iscsi_tx_kick(conn);
 
 	return 0;
 }
@@ -1353,6 +1680,17 @@ static int iscsi_target_cmd_queue(struct iscsi_task *task)
 	} else if (dir == DATA_READ) {
 		scsi_set_in_length(scmd, data_len);
 		scsi_set_in_buffer(scmd, task->data);
+
+		/* the data digest needs the data in memory */
+		if (conn->session->target->zerocopy_read &&
+		    conn->tp->ep_sendfile &&
+		    !(conn->session_param[ISCSI_PARAM_DATADGST_EN].val &
+		      DIGEST_CRC32C))
+			set_cmd_zerocopy(scmd);
+
+		/* Data-In can go out as the backing store reads */
+		if (conn->tp->ep_writev)
+			set_cmd_stream(scmd);
 	}
 
 	if (dir == DATA_BIDIRECTIONAL && ahslen >= 8) {
@@ -1383,9 +1721,20 @@ static int iscsi_target_cmd_queue(struct iscsi_task *task)
 	scmd->tag = req->itt;
 	set_task_in_scsi(task);
 
+	if (rx_batch) {
+		set_cmd_not_last(scmd);
+		tgt_add_sched_event(&rx_flush_sched);
+	}
+
+	if (conn->session->target->cmd_window_latency)
+		task->queue_usecs = iscsi_usecs();
+	conn->session->cmd_bytes += data_len;
+
 	err = target_cmd_queue(conn->session->target->tid, scmd);
-	if (err)
+	if (err) {
 		clear_task_in_scsi(task);
+		conn->session->cmd_bytes -= data_len;
+	}
 
 	return err;
 }
@@ -1394,19 +1743,16 @@ int iscsi_scsi_cmd_execute(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
 	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
-	int ret = 0;
 
-	if ((req->flags & ISCSI_FLAG_CMD_WRITE) && task->r2t_count) {
-		if (!task->unsol_count)
-			list_add_tail(&task->c_list, &task->conn->tx_clist);
-		goto no_queuing;
+	if ((req->flags & ISCSI_FLAG_CMD_WRITE) &&
+	    (task->r2t_count || task->nr_r2t || task->unsol_count)) {
+		if (!task->unsol_count && iscsi_r2t_queue(task))
+			iscsi_tx_kick(conn);
+		return 0;
 	}
 
 	task->offset = 0;  /* for use as transmit pointer for data-ins */
-	ret = iscsi_target_cmd_queue(task);
-no_queuing:
-	conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
-	return ret;
+	return iscsi_target_cmd_queue(task);
 }
 
 static int iscsi_tm_done(struct mgmt_req *mreq)
@@ -1439,7 +1785,7 @@ static int iscsi_tm_done(struct mgmt_req *mreq)
 		return 0;
 	}
 	list_add_tail(&task->c_list, &task->conn->tx_clist);
-	task->conn->tp->ep_event_modify(task->conn, EPOLLIN | EPOLLOUT);
+	iscsi_tx_kick(task->conn);
 	return 0;
 }
 
@@ -1509,7 +1855,7 @@ static int iscsi_task_execute(struct iscsi_task *task)
 	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_LOGOUT:
 		list_add_tail(&task->c_list, &task->conn->tx_clist);
-		task->conn->tp->ep_event_modify(task->conn, EPOLLIN | EPOLLOUT);
+		iscsi_tx_kick(task->conn);
 		break;
 	case ISCSI_OP_SCSI_CMD:
 		/* convenient directionality for our internal use */
@@ -1529,8 +1875,7 @@ static int iscsi_task_execute(struct iscsi_task *task)
 		err = iscsi_tm_execute(task);
 		if (err) {
 			list_add_tail(&task->c_list, &task->conn->tx_clist);
-			task->conn->tp->ep_event_modify(task->conn,
-							EPOLLIN | EPOLLOUT);
+			iscsi_tx_kick(task->conn);
 		}
 		break;
 	case ISCSI_OP_TEXT:
@@ -1543,9 +1888,20 @@ static int iscsi_task_execute(struct iscsi_task *task)
 	return 0;
 }
 
+/*
+ * Solicited Data-Out is accounted to its R2T by the byte ranges it
+ * covers, so the PDUs of a burst may come in any order
+ * (DataPDUInOrder=No), and so may the bursts.  A burst is done once its
+ * ranges cover all of it.  Each burst done frees a slot for the next
+ * R2T; when none is left outstanding while data is still to come, the
+ * initiator sits idle for a round trip.
+ */
 static int iscsi_data_out_rx_done(struct iscsi_task *task)
 {
-	struct iscsi_hdr *hdr = &task->conn->req.bhs;
+	struct iscsi_connection *conn = task->conn;
+	struct iscsi_data *hdr = (struct iscsi_data *) &conn->req.bhs;
+	struct iscsi_r2t *r2t;
+	uint32_t len = ntoh24(hdr->dlength);
 	int err = 0;
 
 	if (hdr->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
@@ -1554,38 +1910,97 @@ static int iscsi_data_out_rx_done(struct iscsi_task *task)
 			if (!task_pending(task))
 				err = iscsi_scsi_cmd_execute(task);
 		}
-	} else {
+		return err;
+	}
+
+	r2t = iscsi_r2t_find(task, be32_to_cpu(hdr->ttt),
+			     be32_to_cpu(hdr->offset), len);
+	if (!r2t)
+		return -EINVAL;
+
+	err = iscsi_r2t_add(r2t, be32_to_cpu(hdr->offset), len);
+	if (err)
+		return err;
+
+	/* nothing overlaps, so the whole burst is there */
+	if (r2t->received < r2t->length) {
 		if (!(hdr->flags & ISCSI_FLAG_CMD_FINAL))
-			return err;
+			return 0;
 
-		err = iscsi_scsi_cmd_execute(task);
+		eprintf("burst at %u of %" PRIx64 " ended after %u of %u "
+			"bytes\n", r2t->offset, task->tag, r2t->received,
+			r2t->length);
+		return -EINVAL;
 	}
 
-	return err;
+	free(r2t->ext);
+	*r2t = task->r2t[--task->nr_r2t];
+	if (task->r2t_count && !task->nr_r2t)
+		conn->stats.r2t_stalls++;
+
+	return iscsi_scsi_cmd_execute(task);
+}
+
+static struct iscsi_task *iscsi_task_lookup(struct iscsi_session *session,
+					    uint64_t itt)
+{
+	struct iscsi_task *task;
+
+	list_for_each_entry(task,
+		&session->cmd_hash[tgt_hash(itt, ISCSI_CMD_HASH_BITS)],
+		c_hlist) {
+		if (task->tag == itt)
+			return task;
+	}
+	return NULL;
 }
 
 static int iscsi_data_out_rx_start(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task;
 	struct iscsi_data *req = (struct iscsi_data *) &conn->req.bhs;
+	struct iscsi_r2t *r2t;
+	uint32_t offset, len, data_len;
+
+	task = iscsi_task_lookup(conn->session, req->itt);
+	if (!task)
+		return -EINVAL;
 
-	list_for_each_entry(task, &conn->session->cmd_list, c_hlist) {
-		if (task->tag == req->itt)
-			goto found;
-	}
-	return -EINVAL;
-found:
 	dprintf("found a task %" PRIx64 " %u %u %u %u %u\n", task->tag,
 		ntohl(((struct iscsi_cmd *) (&task->req))->data_length),
 		task->offset,
 		task->r2t_count,
 		ntoh24(req->dlength), be32_to_cpu(req->offset));
 
-	conn->req.data = task->data + be32_to_cpu(req->offset);
+	offset = be32_to_cpu(req->offset);
+	len = ntoh24(req->dlength);
+	data_len = ntohl(((struct iscsi_cmd *) (&task->req))->data_length);
 
-	task->offset += ntoh24(req->dlength);
-	task->r2t_count -= ntoh24(req->dlength);
+	if (req->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
+		if (!task->unsol_count || offset > data_len ||
+		    len > data_len - offset) {
+			eprintf("unexpected Data-Out %" PRIx64 " %u %u\n",
+				task->tag, offset, len);
+			return -EINVAL;
+		}
+		task->offset += len;
+		task->r2t_count -= len;
+	} else {
+		r2t = iscsi_r2t_find(task, be32_to_cpu(req->ttt), offset, len);
+		if (!r2t) {
+			eprintf("Data-Out %" PRIx64 " %u %u is not solicited\n",
+				task->tag, offset, len);
+			return -EINVAL;
+		}
+		/* a resent or overlapping PDU would leave a hole elsewhere */
+		if (iscsi_r2t_overlaps(r2t, offset, len)) {
+			eprintf("Data-Out %" PRIx64 " %u %u overlaps data "
+				"received\n", task->tag, offset, len);
+			return -EINVAL;
+		}
+	}
 
+	conn->req.data = task->data + offset;
 	conn->rx_task = task;
 
 	return 0;
@@ -1595,8 +2010,8 @@ static int iscsi_task_queue(struct iscsi_task *task)
 {
 	struct iscsi_session *session = task->conn->session;
 	struct iscsi_hdr *req = (struct iscsi_hdr *) &task->req;
-	uint32_t cmd_sn;
-	struct iscsi_task *ent;
+	struct iscsi_task **slot;
+	uint32_t cmd_sn, max_cmd_sn;
 
 	dprintf("%x %x %x\n", be32_to_cpu(req->statsn), session->exp_cmd_sn,
 		req->opcode);
@@ -1612,33 +2027,39 @@ static int iscsi_task_queue(struct iscsi_task *task)
 		/* Should we close the connection... */
 		iscsi_task_execute(task);
 
-		if (list_empty(&session->pending_cmd_list))
-			return 0;
-		task = list_first_entry(&session->pending_cmd_list,
-					struct iscsi_task, c_list);
-		if (be32_to_cpu(task->req.statsn) != cmd_sn)
+		slot = &session->cmd_ring[cmd_sn & session->cmd_ring_mask];
+		task = *slot;
+		if (!task)
 			return 0;
 
-		list_del(&task->c_list);
+		*slot = NULL;
 		clear_task_pending(task);
 		goto retry;
-	} else {
-		if (before(cmd_sn, session->exp_cmd_sn)) {
-			eprintf("unexpected cmd_sn (%u,%u)\n",
-				cmd_sn, session->exp_cmd_sn);
-			return -EINVAL;
-		}
+	}
 
-		/* TODO: check max cmd_sn */
+	if (before(cmd_sn, session->exp_cmd_sn)) {
+		eprintf("unexpected cmd_sn (%u,%u)\n",
+			cmd_sn, session->exp_cmd_sn);
+		return -EINVAL;
+	}
 
-		list_for_each_entry(ent, &session->pending_cmd_list, c_list) {
-			if (before(cmd_sn, be32_to_cpu(ent->req.statsn)))
-				break;
-		}
+	/* RFC 3720 3.2.2.1: commands beyond MaxCmdSN are ignored */
+	max_cmd_sn = iscsi_max_cmd_sn(session);
+	if (after(cmd_sn, max_cmd_sn)) {
+		eprintf("cmd_sn %u beyond max_cmd_sn %u, dropped\n", cmd_sn,
+			max_cmd_sn);
+		iscsi_free_task(task);
+		return 0;
+	}
 
-		list_add_tail(&task->c_list, &ent->c_list);
-		set_task_pending(task);
+	slot = &session->cmd_ring[cmd_sn & session->cmd_ring_mask];
+	if (*slot) {
+		eprintf("duplicate cmd_sn %u\n", cmd_sn);
+		return -EINVAL;
 	}
+
+	*slot = task;
+	set_task_pending(task);
 	return 0;
 }
 
@@ -1647,6 +2068,7 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 	struct iscsi_cmd *req = (struct iscsi_cmd *) &conn->req.bhs;
 	struct iscsi_task *task;
 	int ahs_len, imm_len, data_len, ext_len;
+	unsigned int hash;
 
 	ahs_len = req->hlength * 4;
 	imm_len = roundup(ntoh24(req->dlength), conn->tp->data_padding);
@@ -1682,7 +2104,8 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 			task->unsol_count, task->offset);
 	}
 
-	list_add(&task->c_hlist, &conn->session->cmd_list);
+	hash = tgt_hash(task->tag, ISCSI_CMD_HASH_BITS);
+	list_add(&task->c_hlist, &conn->session->cmd_hash[hash]);
 	return 0;
 }
 
@@ -1848,8 +2271,7 @@ static int iscsi_logout_tx_start(struct iscsi_task *task)
 	rsp->itt = task->req.itt;
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	return 0;
 }
@@ -1866,8 +2288,7 @@ static int iscsi_noop_in_tx_start(struct iscsi_task *task)
 	rsp->ttt = task->req.ttt;
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	/* TODO: honor max_burst */
 	conn->rsp.datasize = task->len;
@@ -1886,7 +2307,8 @@ static int iscsi_noop_out_tx_start(struct iscsi_task *task, int *is_rsp)
 		*is_rsp = 0;
 
 		if (conn->tp->ep_nop_reply)
-			conn->tp->ep_nop_reply(be32_to_cpu(task->req.ttt));
+			conn->tp->ep_nop_reply(conn,
+					       be32_to_cpu(task->req.ttt));
 
 		iscsi_free_task(task);
 	} else {
@@ -1899,8 +2321,7 @@ static int iscsi_noop_out_tx_start(struct iscsi_task *task, int *is_rsp)
 		rsp->ttt = cpu_to_be32(ISCSI_RESERVED_TAG);
 		rsp->statsn = cpu_to_be32(conn->stat_sn++);
 		rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-		rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-					     conn->session->max_queue_cmd);
+		rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 		/* TODO: honor max_burst */
 		conn->rsp.datasize = task->len;
@@ -1924,12 +2345,50 @@ static int iscsi_tm_tx_start(struct iscsi_task *task)
 
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	return 0;
 }
 
+static void iscsi_tx_task_free(struct iscsi_task *task)
+{
+	switch (task->req.opcode & ISCSI_OPCODE_MASK) {
+	case ISCSI_OP_SCSI_CMD:
+		iscsi_free_cmd_task(task);
+		break;
+	case ISCSI_OP_NOOP_IN:
+		/* NOOP_IN req is allocated within iscsi_tcp
+		 * by a direct call to the transport
+		 * allocation routine, unaccounted in the
+		 * connection refcount and not added to
+		 * task_list, hence it should be freed when
+		 * it's done by a similar direct call.
+		 *
+		 * We're overprotective here by checking tp's
+		 * free_task pointer, avoiding interference
+		 * with iser (I'm unsure if it's relevant
+		 * though).
+		 */
+		if (task->conn->tp->free_task)
+			task->conn->tp->free_task(task);
+		break;
+	default:
+		iscsi_free_task(task);
+		break;
+	}
+}
+
+/* gathered PDUs that are not sent yet may point into the task */
+static void iscsi_tx_task_release(struct iscsi_task *task)
+{
+	struct iscsi_connection *conn = task->conn;
+
+	if (conn->tx_iovcnt)
+		list_add_tail(&task->c_list, &conn->tx_done_list);
+	else
+		iscsi_tx_task_free(task);
+}
+
 static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 {
 	struct iscsi_hdr *hdr = &conn->rsp.bhs;
@@ -1937,8 +2396,17 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 
 	switch (hdr->opcode & ISCSI_OPCODE_MASK) {
 	case ISCSI_OP_R2T:
+		iscsi_r2t_queue(task);
 		break;
 	case ISCSI_OP_SCSI_DATA_IN:
+		if (task_in_scsi(task)) {
+			/* streamed, wait for more data or the completion */
+			if (task->offset < scsi_get_in_ready(&task->scmd))
+				list_add(&task->c_list, &task->conn->tx_clist);
+			else
+				clear_task_streaming(task);
+			return 0;
+		}
 		if (task->offset < scsi_get_in_transfer_len(&task->scmd) ||
 		    scsi_get_result(&task->scmd) != SAM_STAT_GOOD ||
 		    scsi_get_data_dir(&task->scmd) == DATA_BIDIRECTIONAL) {
@@ -1947,7 +2415,7 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 			return 0;
 		}
 	case ISCSI_OP_SCSI_CMD_RSP:
-		iscsi_free_cmd_task(task);
+		iscsi_tx_task_release(task);
 		break;
 	default:
 		eprintf("target bug %x\n", hdr->opcode & ISCSI_OPCODE_MASK);
@@ -1967,25 +2435,10 @@ static int iscsi_task_tx_done(struct iscsi_connection *conn)
 		iscsi_scsi_cmd_tx_done(conn);
 		break;
 	case ISCSI_OP_NOOP_IN:
-		/* NOOP_IN req is allocated within iscsi_tcp
-		 * by a direct call to the transport
-		 * allocation routine, unaccounted in the
-		 * connection refcount and not added to
-		 * task_list, hence it should be freed when
-		 * it's done by a similar direct call.
-		 *
-		 * We're overprotective here by checking tp's
-		 * free_task pointer, avoiding interference
-		 * with iser (I'm unsure if it's relevant
-		 * though).
-		 */
-		if (task->conn->tp->free_task)
-			task->conn->tp->free_task(task);
-		break;
 	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_LOGOUT:
 	case ISCSI_OP_SCSI_TMFUNC:
-		iscsi_free_task(task);
+		iscsi_tx_task_release(task);
 
 		if (op == ISCSI_OP_LOGOUT)
 			conn->state = STATE_CLOSE;
@@ -2042,23 +2495,123 @@ nodata:
 	return -EAGAIN;
 }
 
-static int do_recv(struct iscsi_connection *conn, int next_state)
+/* the len bytes just received in front of rx_buffer */
+static void rx_data_digest(struct iscsi_connection *conn, int len)
 {
-	int ret, opcode;
+	if (conn->rx_ddigest && conn->rx_iostate == IOSTATE_RX_DATA)
+		conn->rx_crc = crc32c(conn->rx_crc, conn->rx_buffer - len, len);
+}
 
-	ret = conn->tp->ep_read(conn, conn->rx_buffer, conn->rx_size);
-	if (!ret) {
-		conn->state = STATE_CLOSE;
-		return 0;
-	} else if (ret < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return 0;
-		else
-			return -EIO;
-	}
+/*
+ * Fill rx_buffer from rx_ring and, once that runs dry, from the socket.
+ * Every read also pulls in whatever the initiator sent after the piece
+ * being parsed.  A large payload goes straight into rx_buffer with the
+ * ring behind it in the same call, so Data-Out and immediate data are
+ * not copied twice.  Runs out of the lock, see conn_io_begin().
+ */
+static int do_recv_ring(struct iscsi_connection *conn, int *eof)
+{
+	struct iovec iov[2];
+	int ret, len, iovcnt, done = 0;
+
+	while (conn->rx_size) {
+		len = conn->rx_ring_tail - conn->rx_ring_head;
+		if (len) {
+			len = min(len, conn->rx_size);
+			memcpy(conn->rx_buffer,
+			       conn->rx_ring + conn->rx_ring_head, len);
+			conn->rx_ring_head += len;
+			conn->rx_buffer += len;
+			conn->rx_size -= len;
+			done += len;
+			rx_data_digest(conn, len);
+			continue;
+		}
 
-	conn->rx_size -= ret;
-	conn->rx_buffer += ret;
+		conn->rx_ring_head = conn->rx_ring_tail = 0;
+
+		iovcnt = 0;
+		if (conn->rx_size >= ISCSI_RX_DIRECT) {
+			iov[iovcnt].iov_base = conn->rx_buffer;
+			iov[iovcnt++].iov_len = conn->rx_size;
+		}
+		iov[iovcnt].iov_base = conn->rx_ring;
+		iov[iovcnt++].iov_len = ISCSI_RX_RING_SIZE;
+
+		ret = conn->tp->ep_readv(conn, iov, iovcnt);
+		conn->stats.rx_syscalls++;
+		if (!ret) {
+			*eof = 1;
+			break;
+		} else if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -EIO;
+		}
+
+		if (iovcnt > 1) {
+			len = min(ret, conn->rx_size);
+			conn->rx_buffer += len;
+			conn->rx_size -= len;
+			done += len;
+			rx_data_digest(conn, len);
+			ret -= len;
+		}
+		conn->rx_ring_tail = ret;
+	}
+
+	return done;
+}
+
+/* an idle connection hands its ring back, do_recv_ring() gets a new one */
+void iscsi_rx_ring_release(struct iscsi_connection *conn)
+{
+	if (!conn->rx_ring || conn->rx_ring_head != conn->rx_ring_tail)
+		return;
+
+	iscsi_pool_free_buf(conn->rx_ring);
+	conn->rx_ring = NULL;
+	conn->rx_ring_head = conn->rx_ring_tail = 0;
+}
+
+static int do_recv(struct iscsi_connection *conn, int next_state)
+{
+	int ret, opcode, eof = 0;
+
+	if (conn->tp->ep_readv && conn->state == STATE_SCSI) {
+		if (!conn->rx_ring) {
+			conn->rx_ring = iscsi_pool_alloc_buf(ISCSI_RX_RING_SIZE);
+			if (!conn->rx_ring)
+				return -ENOMEM;
+		}
+
+		conn_io_begin(conn);
+		ret = do_recv_ring(conn, &eof);
+		if (conn_io_end(conn))
+			return -EIO;
+		if (eof)
+			conn->state = STATE_CLOSE;
+		if (ret <= 0)
+			return ret;
+	} else {
+		ret = conn->tp->ep_read(conn, conn->rx_buffer, conn->rx_size);
+		conn->stats.rx_syscalls++;
+		if (!ret) {
+			conn->state = STATE_CLOSE;
+			return 0;
+		} else if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				return 0;
+			else
+				return -EIO;
+		}
+
+		conn->rx_size -= ret;
+		conn->rx_buffer += ret;
+		rx_data_digest(conn, ret);
+	}
 
 	opcode = (conn->rx_iostate == IOSTATE_RX_BHS) ?
 		(conn->req.bhs.opcode & ISCSI_OPCODE_MASK) : -1;
@@ -2070,7 +2623,7 @@ static int do_recv(struct iscsi_connection *conn, int next_state)
 	return ret;
 }
 
-void iscsi_rx_handler(struct iscsi_connection *conn)
+static void iscsi_rx_pdus(struct iscsi_connection *conn)
 {
 	int ret = 0, hdigest, ddigest;
 	uint32_t crc;
@@ -2163,6 +2716,8 @@ again:
 		if (conn->rx_size) {
 			conn->rx_iostate = IOSTATE_RX_DATA;
 			conn->rx_buffer = conn->req.data;
+			conn->rx_ddigest = ddigest;
+			conn->rx_crc = ~0;
 
 			if (conn->state != STATE_SCSI) {
 				if (conn->req.ahssize + conn->rx_size >
@@ -2189,11 +2744,7 @@ again:
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_CHECK_DDIGEST)
 			break;
 	case IOSTATE_RX_CHECK_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->req.data,
-			     roundup(conn->req.datasize,
-				     conn->tp->data_padding));
-		crc = ~crc;
+		crc = ~conn->rx_crc;
 		conn->rx_iostate = IOSTATE_RX_END;
 		if (*((uint32_t *)conn->rx_digest) != crc) {
 			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
@@ -2206,11 +2757,16 @@ again:
 		exit(1);
 	}
 
-	if (ret < 0 ||
-	    conn->rx_iostate != IOSTATE_RX_END ||
-	    conn->state == STATE_CLOSE)
+	if (ret < 0 || conn->state == STATE_CLOSE)
 		return;
 
+	if (conn->rx_iostate != IOSTATE_RX_END) {
+		/* no event comes for bytes already read ahead */
+		if (conn->rx_ring_head != conn->rx_ring_tail)
+			goto again;
+		return;
+	}
+
 	if (conn->rx_size) {
 		eprintf("error %d %d %d\n", conn->state, conn->rx_iostate,
 			conn->rx_size);
@@ -2221,30 +2777,86 @@ again:
 		ret = iscsi_task_rx_done(conn);
 		if (ret)
 			conn->state = STATE_CLOSE;
-		else
+		else {
 			conn_read_pdu(conn);
-	} else {
-		conn_write_pdu(conn);
-		conn->tp->ep_event_modify(conn, EPOLLOUT);
-		ret = cmnd_execute(conn);
-		if (ret)
-			conn->state = STATE_CLOSE;
+			/* the next PDU came in with this one */
+			if (conn->rx_ring_head != conn->rx_ring_tail)
+				goto again;
+		}
+	} else if (login_redirect_wait(conn)) {
+		/* iscsi_login_resume() picks it up again */
+		conn->tp->ep_event_modify(conn, 0);
+	} else
+		cmnd_execute_rx(conn);
+}
+
+void iscsi_rx_handler(struct iscsi_connection *conn)
+{
+	rx_batch = 1;
+	iscsi_rx_pdus(conn);
+	rx_batch = 0;
+}
+
+/* the socket is full, the rest goes out on EPOLLOUT */
+static void iscsi_tx_blocked(struct iscsi_connection *conn)
+{
+	if (!conn->tx_blocked_since)
+		conn->tx_blocked_since = iscsi_usecs();
+	conn->tx_yielded = 0;
+}
+
+/* used up ISCSI_TX_BUDGET, the rest goes out on EPOLLOUT */
+static void iscsi_tx_yield(struct iscsi_connection *conn)
+{
+	if (!conn->tx_blocked_since) {
+		conn->tx_blocked_since = iscsi_usecs();
+		conn->tx_yielded = 1;
+		conn->tx_yield_pass = tgt_event_pass();
 	}
 }
 
+/*
+ * The socket takes data again. After a yield EPOLLOUT comes with the
+ * next pass unless the socket filled up in the meantime.
+ */
+static void iscsi_tx_unblocked(struct iscsi_connection *conn)
+{
+	if (!conn->tx_blocked_since)
+		return;
+
+	if (!conn->tx_yielded ||
+	    tgt_event_pass() - conn->tx_yield_pass > 1) {
+		conn->stats.tx_blocked++;
+		conn->stats.tx_blocked_usecs +=
+			iscsi_usecs() - conn->tx_blocked_since;
+	}
+	conn->tx_blocked_since = 0;
+}
+
+/*
+ * Returns -EAGAIN when the socket is full; tx_iostate, tx_buffer and
+ * tx_size are where to go on from on the next EPOLLOUT.
+ */
 static int do_send(struct iscsi_connection *conn, int next_state)
 {
 	int ret, opcode;
 again:
 	ret = conn->tp->ep_write_begin(conn, conn->tx_buffer, conn->tx_size);
 	if (ret < 0) {
-		if (errno != EINTR && errno != EAGAIN)
-			conn->state = STATE_CLOSE;
-		else if (errno == EINTR || errno == EAGAIN)
+		if (errno == EINTR)
 			goto again;
+		if (errno == EAGAIN) {
+			iscsi_tx_blocked(conn);
+			return -EAGAIN;
+		}
 
+		conn->state = STATE_CLOSE;
 		return -EIO;
 	}
+	iscsi_tx_unblocked(conn);
+
+	if (conn->tx_ddigest && conn->tx_iostate == IOSTATE_TX_DATA)
+		conn->tx_crc = crc32c(conn->tx_crc, conn->tx_buffer, ret);
 
 	conn->tx_size -= ret;
 	conn->tx_buffer += ret;
@@ -2260,11 +2872,337 @@ again:
 	return 0;
 }
 
+/* a PDU is out, move the connection on */
+static int iscsi_tx_finish(struct iscsi_connection *conn)
+{
+	int ret = 0;
+
+	cmnd_finish(conn);
+
+	switch (conn->state) {
+	case STATE_KERNEL:
+		ret = conn_take_fd(conn);
+		if (ret)
+			conn->state = STATE_CLOSE;
+		else {
+			conn->state = STATE_SCSI;
+			conn_read_pdu(conn);
+			conn->tp->ep_event_modify(conn, EPOLLIN);
+		}
+		break;
+	case STATE_EXIT:
+	case STATE_CLOSE:
+		break;
+	case STATE_SCSI:
+		iscsi_task_tx_done(conn);
+		break;
+	default:
+		conn_read_pdu(conn);
+		conn->tp->ep_event_modify(conn, EPOLLIN);
+		break;
+	}
+
+	return ret;
+}
+
+static void tx_iov_add(struct iscsi_connection *conn, void *buf, size_t len)
+{
+	struct iovec *iov = &conn->tx_iov[conn->tx_iovcnt++];
+
+	iov->iov_base = buf;
+	iov->iov_len = len;
+}
+
+/* add conn->rsp to the gathered PDUs */
+static void iscsi_tx_gather_pdu(struct iscsi_connection *conn, int hdigest,
+				int ddigest)
+{
+	struct iscsi_tx_hdr *h = &conn->tx_hdrs[conn->tx_nr_pdus++];
+	struct iscsi_data_rsp *rsp;
+	struct iscsi_task *task;
+	uint32_t crc;
+	int pad;
+
+	h->bhs = conn->rsp.bhs;
+	h->data = NULL;
+
+	if (hdigest) {
+		crc = crc32c(~0, &h->bhs, BHS_SIZE);
+		if (conn->rsp.ahssize)
+			crc = crc32c(crc, conn->rsp.ahs, conn->rsp.ahssize);
+		h->hdigest = ~crc;
+	}
+
+	if (conn->rsp.ahssize) {
+		tx_iov_add(conn, &h->bhs, BHS_SIZE);
+		tx_iov_add(conn, conn->rsp.ahs, conn->rsp.ahssize);
+		if (hdigest)
+			tx_iov_add(conn, &h->hdigest, sizeof(h->hdigest));
+	} else
+		tx_iov_add(conn, &h->bhs,
+			   BHS_SIZE + (hdigest ? sizeof(h->hdigest) : 0));
+
+	if (conn->rsp.datasize) {
+		task = conn->tx_task;
+		if (conn->rsp.bhs.opcode == ISCSI_OP_SCSI_DATA_IN &&
+		    cmd_in_file(&task->scmd)) {
+			rsp = (struct iscsi_data_rsp *)&conn->rsp.bhs;
+			conn->tx_file_iov = conn->tx_iovcnt;
+			conn->tx_file_fd = task->scmd.dev->fd;
+			conn->tx_file_off = task->scmd.offset +
+				be32_to_cpu(rsp->offset);
+			conn->tx_file_len = conn->rsp.datasize;
+		} else
+			tx_iov_add(conn, conn->rsp.data, conn->rsp.datasize);
+
+		pad = -conn->rsp.datasize & (conn->tp->data_padding - 1);
+		memset(h->tail, 0, pad);
+		if (ddigest) {
+			h->data = conn->rsp.data;
+			h->datasize = conn->rsp.datasize;
+			h->pad = pad;
+			pad += sizeof(crc);
+		}
+		if (pad)
+			tx_iov_add(conn, h->tail, pad);
+	}
+
+	iscsi_update_conn_stats_tx(conn, 0,
+				   conn->rsp.bhs.opcode & ISCSI_OPCODE_MASK);
+}
+
+/* the data digests iscsi_tx_gather_pdu() left to be summed up */
+static void iscsi_tx_ddigests(struct iscsi_connection *conn)
+{
+	struct iscsi_tx_hdr *h;
+	uint32_t crc;
+	int i;
+
+	for (i = 0; i < conn->tx_nr_pdus; i++) {
+		h = &conn->tx_hdrs[i];
+		if (!h->data)
+			continue;
+
+		crc = crc32c(~0, h->data, h->datasize);
+		crc = ~crc32c(crc, h->tail, h->pad);
+		memcpy(h->tail + h->pad, &crc, sizeof(crc));
+		h->data = NULL;
+	}
+}
+
+/* the Data-In segment of a gathered PDU that is left in a file */
+static int iscsi_tx_flush_file(struct iscsi_connection *conn, size_t *sent)
+{
+	ssize_t ret;
+
+	while (conn->tx_file_len) {
+		if (*sent >= ISCSI_TX_BUDGET) {
+			iscsi_tx_yield(conn);
+			return 0;
+		}
+
+		ret = conn->tp->ep_sendfile(conn, conn->tx_file_fd,
+					    &conn->tx_file_off,
+					    conn->tx_file_len);
+		conn->stats.tx_syscalls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				iscsi_tx_blocked(conn);
+				return 0;
+			}
+		}
+		if (ret <= 0) {
+			/* the status went out with the header already */
+			eprintf("sendfile failed at %" PRIu64 ", %m\n",
+				(uint64_t)conn->tx_file_off);
+			return -EIO;
+		}
+
+		iscsi_tx_unblocked(conn);
+		iscsi_update_conn_stats_tx(conn, ret, -1);
+		conn->stats.txfile_octets += ret;
+		conn->tx_file_len -= ret;
+		*sent += ret;
+		if (conn->tx_file_len) {
+			iscsi_tx_blocked(conn);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Returns 1 when all the gathered PDUs are out, 0 when the socket is
+ * full or the connection used up its ISCSI_TX_BUDGET. Either way the
+ * rest goes out on the next EPOLLOUT, so other connections get their
+ * turn in between.  Runs out of the lock, see conn_io_begin().
+ */
+static int iscsi_tx_flush(struct iscsi_connection *conn)
+{
+	struct iovec *iov;
+	size_t len, sent = 0;
+	ssize_t ret;
+	int i, end, full;
+
+	while (conn->tx_iovidx < conn->tx_iovcnt || conn->tx_file_len) {
+		if (conn->tx_file_len &&
+		    conn->tx_iovidx == conn->tx_file_iov) {
+			ret = iscsi_tx_flush_file(conn, &sent);
+			if (ret <= 0)
+				return ret;
+			continue;
+		}
+
+		if (sent >= ISCSI_TX_BUDGET) {
+			iscsi_tx_yield(conn);
+			return 0;
+		}
+
+		end = conn->tx_file_len ? conn->tx_file_iov : conn->tx_iovcnt;
+		iov = &conn->tx_iov[conn->tx_iovidx];
+		for (i = conn->tx_iovidx, len = 0; i < end; i++)
+			len += conn->tx_iov[i].iov_len;
+
+		ret = conn->tp->ep_writev(conn, iov, end - conn->tx_iovidx,
+					  !!conn->tx_file_len);
+		conn->stats.tx_syscalls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				iscsi_tx_blocked(conn);
+				return 0;
+			}
+			return -EIO;
+		}
+
+		iscsi_tx_unblocked(conn);
+		iscsi_update_conn_stats_tx(conn, ret, -1);
+		sent += ret;
+		full = ret < len;
+
+		while (ret) {
+			if (ret < iov->iov_len) {
+				iov->iov_base += ret;
+				iov->iov_len -= ret;
+				break;
+			}
+			ret -= iov->iov_len;
+			iov++;
+			conn->tx_iovidx++;
+		}
+
+		/* a short write means the socket is full, no need to retry */
+		if (full) {
+			iscsi_tx_blocked(conn);
+			return 0;
+		}
+	}
+
+	conn->tx_iovcnt = conn->tx_iovidx = conn->tx_nr_pdus = 0;
+	return 1;
+}
+
+/*
+ * Transports with ep_writev() send a PDU, or in full feature phase as
+ * many queued PDUs as fit in a batch, with one call.  The tasks of
+ * the batch are completed as their PDUs are built but freed only
+ * after the send.
+ */
+static int iscsi_tx_gather(struct iscsi_connection *conn)
+{
+	struct iscsi_task *task, *tmp;
+	int ret, hdigest, ddigest;
+	size_t gathered = 0;
+
+	if (conn->tx_iovcnt)
+		goto flush;
+
+	if (conn->state == STATE_SCSI) {
+		struct param *p = conn->session_param;
+		hdigest = p[ISCSI_PARAM_HDRDGST_EN].val & DIGEST_CRC32C;
+		ddigest = p[ISCSI_PARAM_DATADGST_EN].val & DIGEST_CRC32C;
+	} else
+		hdigest = ddigest = 0;
+
+	while (conn->tx_nr_pdus < ISCSI_TX_BATCH &&
+	       conn->tx_iovcnt + ISCSI_TX_PDU_IOV <= ISCSI_TX_IOV_MAX) {
+		if (conn->state == STATE_SCSI) {
+			if (!conn->tx_task && iscsi_task_tx_start(conn))
+				break;
+		} else if (conn->tx_nr_pdus)
+			break;
+
+		iscsi_tx_gather_pdu(conn, hdigest, ddigest);
+		gathered += conn->rsp.datasize;
+
+		/* the state changes must wait until the PDU is out */
+		if (conn->state != STATE_SCSI ||
+		    (conn->tx_task->req.opcode & ISCSI_OPCODE_MASK) ==
+		    ISCSI_OP_LOGOUT) {
+			conn->tx_finish = 1;
+			break;
+		}
+
+		iscsi_task_tx_done(conn);
+
+		/* one file segment per batch */
+		if (conn->tx_file_len || gathered >= ISCSI_TX_BUDGET)
+			break;
+	}
+
+	if (!conn->tx_iovcnt)
+		return 0;
+flush:
+	conn_io_begin(conn);
+	iscsi_tx_ddigests(conn);
+	ret = iscsi_tx_flush(conn);
+	if (conn_io_end(conn))
+		return -EIO;
+	if (ret < 0)
+		conn->state = STATE_CLOSE;
+	if (ret <= 0) {
+		/* out of budget goes on in the next pass, full waits */
+		if (!ret && conn->state == STATE_SCSI) {
+			if (conn->tx_yielded)
+				iscsi_tx_kick(conn);
+			else
+				conn->tp->ep_event_modify(conn,
+							  EPOLLIN | EPOLLOUT);
+		}
+		return ret;
+	}
+
+	list_for_each_entry_safe(task, tmp, &conn->tx_done_list, c_list) {
+		list_del(&task->c_list);
+		iscsi_tx_task_free(task);
+	}
+
+	/* the rest waits for the next pass */
+	if (!list_empty(&conn->tx_clist)) {
+		iscsi_tx_yield(conn);
+		iscsi_tx_kick(conn);
+	}
+
+	if (conn->tx_finish) {
+		conn->tx_finish = 0;
+		return iscsi_tx_finish(conn);
+	}
+
+	return 0;
+}
+
 int iscsi_tx_handler(struct iscsi_connection *conn)
 {
 	int ret = 0, hdigest, ddigest;
 	uint32_t crc;
 
+	if (conn->tp->ep_writev)
+		return iscsi_tx_gather(conn);
+
 	if (conn->state == STATE_SCSI) {
 		struct param *p = conn->session_param;
 		hdigest = p[ISCSI_PARAM_HDRDGST_EN].val & DIGEST_CRC32C;
@@ -2343,6 +3281,8 @@ again:
 			conn->tx_iostate = IOSTATE_TX_DATA;
 			conn->tx_buffer = conn->rsp.data;
 			conn->tx_size = conn->rsp.datasize;
+			conn->tx_ddigest = ddigest;
+			conn->tx_crc = ~0;
 			pad = conn->tx_size & (conn->tp->data_padding - 1);
 			if (pad) {
 				pad = PAD_WORD_LEN - pad;
@@ -2361,11 +3301,7 @@ again:
 		if (conn->tx_iostate != IOSTATE_TX_INIT_DDIGEST)
 			break;
 	case IOSTATE_TX_INIT_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->rsp.data,
-			     roundup(conn->rsp.datasize,
-				     conn->tp->data_padding));
-		*(uint32_t *)conn->tx_digest = ~crc;
+		*(uint32_t *)conn->tx_digest = ~conn->tx_crc;
 		conn->tx_iostate = IOSTATE_TX_DDIGEST;
 		conn->tx_buffer = conn->tx_digest;
 		conn->tx_size = sizeof(conn->tx_digest);
@@ -2395,31 +3331,7 @@ again:
 	conn->tp->ep_write_end(conn);
 
 finish:
-	cmnd_finish(conn);
-
-	switch (conn->state) {
-	case STATE_KERNEL:
-		ret = conn_take_fd(conn);
-		if (ret)
-			conn->state = STATE_CLOSE;
-		else {
-			conn->state = STATE_SCSI;
-			conn_read_pdu(conn);
-			conn->tp->ep_event_modify(conn, EPOLLIN);
-		}
-		break;
-	case STATE_EXIT:
-	case STATE_CLOSE:
-		break;
-	case STATE_SCSI:
-		iscsi_task_tx_done(conn);
-		break;
-	default:
-		conn_read_pdu(conn);
-		conn->tp->ep_event_modify(conn, EPOLLIN);
-		break;
-	}
-
+	ret = iscsi_tx_finish(conn);
 out:
 	return ret;
 }
@@ -2462,9 +3374,64 @@ int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size)
 	return len;
 }
 
+static int iscsi_sockopt_int(char *p, int *val)
+{
+	char *end;
+	long v;
+
+	v = strtol(p, &end, 0);
+	if (end == p || (*end && *end != ',') || v < 0 || v > INT_MAX)
+		return -EINVAL;
+
+	*val = v;
+	return 0;
+}
+
+/* sets the socket options found in the list on opts, others are kept */
+int iscsi_param_parse_sockopts(char *p, struct iscsi_sockopts *opts)
+{
+	int len, err = 0;
+
+	while (*p && !err) {
+		if (!strncmp(p, "sndbuf=", 7))
+			err = iscsi_sockopt_int(p + 7, &opts->sndbuf);
+		else if (!strncmp(p, "rcvbuf=", 7))
+			err = iscsi_sockopt_int(p + 7, &opts->rcvbuf);
+		else if (!strncmp(p, "notsent_lowat=", 14))
+			err = iscsi_sockopt_int(p + 14, &opts->notsent_lowat);
+		else if (!strncmp(p, "busy_poll=", 10))
+			err = iscsi_sockopt_int(p + 10, &opts->busy_poll);
+		else if (!strncmp(p, "congestion=", 11)) {
+			len = strcspn(p + 11, ",");
+			if (len >= sizeof(opts->congestion))
+				err = -EINVAL;
+			else {
+				memcpy(opts->congestion, p + 11, len);
+				opts->congestion[len] = '\0';
+			}
+		}
+
+		if (err)
+			eprintf("invalid socket option %.*s\n",
+				(int)strcspn(p, ","), p);
+
+		p += strcspn(p, ",");
+		if (*p == ',')
+			++p;
+	}
+
+	return err;
+}
+
+/*
+ * The socket options in the list apply to all the portals it adds or
+ * updates.
+ */
 int iscsi_param_parse_portals(char *p, int do_add,
-			int do_delete)
+			int do_delete, int do_update)
 {
+	char *params = p;
+
 	while (*p) {
 		if (!strncmp(p, "portal", 6)) {
 			char *addr, *q;
@@ -2505,7 +3472,7 @@ int iscsi_param_parse_portals(char *p, int do_add,
 				tmp = zalloc(len + 1);
 				memcpy(tmp, addr, len);
 				if (do_add && iscsi_add_portal(tmp,
-							port, 1)) {
+							port, 1, params)) {
 					free(tmp);
 					return -1;
 				}
@@ -2514,11 +3481,28 @@ int iscsi_param_parse_portals(char *p, int do_add,
 					free(tmp);
 					return -1;
 				}
+				if (do_update && iscsi_update_portal(tmp,
+							port, params)) {
+					free(tmp);
+					return -1;
+				}
+				free(tmp);
 			}
 		} else if (!strncmp(p, "nop_interval", 12)) {
 			iscsi_set_nop_interval(atoi(p+13));
 		} else if (!strncmp(p, "nop_count", 9)) {
 			iscsi_set_nop_count(atoi(p+10));
+		} else if (!strncmp(p, "zerocopy_read=", 14)) {
+			default_zerocopy_read = !strncmp(p + 14, "on", 2);
+		} else if (!strncmp(p, "reuseport=", 10)) {
+			if (!strncmp(p + 10, "cpu", 3))
+				iscsi_reuseport = ISCSI_REUSEPORT_CPU;
+			else if (!strncmp(p + 10, "on", 2))
+				iscsi_reuseport = ISCSI_REUSEPORT_ON;
+			else
+				iscsi_reuseport = ISCSI_REUSEPORT_OFF;
+		} else if (!strncmp(p, "pool_", 5)) {
+			iscsi_pool_param(p);
 		}
 
 		p += strcspn(p, ",");
@@ -2537,12 +3521,17 @@ static int iscsi_param_parser(char *p)
 
 static int iscsi_portal_create(char *p)
 {
-	return iscsi_param_parse_portals(p, 1, 0);
+	return iscsi_param_parse_portals(p, 1, 0, 0);
 }
 
 static int iscsi_portal_destroy(char *p)
 {
-	return iscsi_param_parse_portals(p, 0, 1);
+	return iscsi_param_parse_portals(p, 0, 1, 0);
+}
+
+static int iscsi_portal_update(char *p)
+{
+	return iscsi_param_parse_portals(p, 0, 0, 1);
 }
 
 static struct tgt_driver iscsi = {
@@ -2554,11 +3543,13 @@ static struct tgt_driver iscsi = {
 
 	.portal_create		= iscsi_portal_create,
 	.portal_destroy		= iscsi_portal_destroy,
+	.portal_update		= iscsi_portal_update,
 
 	.update			= iscsi_target_update,
 	.show			= iscsi_target_show,
 	.stat			= iscsi_stat,
 	.cmd_end_notify		= iscsi_scsi_cmd_done,
+	.cmd_data_ready		= iscsi_scsi_cmd_data_ready,
 	.mgmt_end_notify	= iscsi_tm_done,
 	.transportid		= iscsi_transportid,
 	.default_bst		= "rdwr",
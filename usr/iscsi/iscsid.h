@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "transport.h"
 #include "list.h"
@@ -70,6 +71,9 @@ struct iscsi_pdu {
 	unsigned int datasize;
 };
 
+#define ISCSI_CMD_HASH_BITS	6
+#define ISCSI_CMD_HASH_SIZE	(1 << ISCSI_CMD_HASH_BITS)
+
 struct iscsi_session {
 	int refcount;
 
@@ -89,14 +93,41 @@ struct iscsi_session {
 	struct list_head conn_list;
 	int conn_cnt;
 
-	/* links all tasks (task->c_hlist) */
+	/* links iSER tasks (iser_task->session_list) */
 	struct list_head cmd_list;
+	/* TCP tasks hashed by ITT (task->c_hlist) */
+	struct list_head cmd_hash[ISCSI_CMD_HASH_SIZE];
+	/* the last Target Transfer Tag given out in an R2T */
+	uint32_t ttt;
 
-	/* links pending tasks (task->c_list) */
+	/*
+	 * links pending iSER tasks (iser_task->exec_list), only iSER uses
+	 * it now, TCP tasks wait in cmd_ring
+	 */
 	struct list_head pending_cmd_list;
+	/*
+	 * TCP tasks waiting for the CmdSNs before theirs, in the slot
+	 * cmd_sn & cmd_ring_mask.  The ring holds more than max_queue_cmd
+	 * slots and only CmdSNs up to MaxCmdSN are accepted, so no two of
+	 * them share a slot.
+	 */
+	struct iscsi_task **cmd_ring;
+	uint32_t cmd_ring_mask;
 
 	uint32_t exp_cmd_sn;
 	uint32_t max_queue_cmd;
+	/* the highest MaxCmdSN sent */
+	uint32_t max_cmd_sn;
+	/*
+	 * MaxCmdSN is ExpCmdSN + cmd_window, see iscsi_cmd_window_update().
+	 * cmd_window_count completions of this round so far, one of them
+	 * slow if cmd_window_slow is set.
+	 */
+	uint32_t cmd_window;
+	uint32_t cmd_window_count;
+	int cmd_window_slow;
+	/* data bytes of the commands in the backing store */
+	uint64_t cmd_bytes;
 
 	struct param session_param[ISCSI_PARAM_MAX];
 
@@ -106,6 +137,30 @@ struct iscsi_session {
 	int rdma;
 };
 
+/* R2Ts a task keeps outstanding at most, whatever was negotiated */
+#define ISCSI_R2T_MAX		16
+
+/* Data-Out ranges of a burst kept without allocating */
+#define ISCSI_R2T_EXT_INLINE	2
+
+/* bytes [offset, end) of a burst have come in */
+struct iscsi_r2t_ext {
+	uint32_t offset;
+	uint32_t end;
+};
+
+struct iscsi_r2t {
+	uint32_t ttt;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t received;
+	/* sorted and merged, in ext once more than fit in ext_inline */
+	int nr_ext;
+	int max_ext;
+	struct iscsi_r2t_ext *ext;
+	struct iscsi_r2t_ext ext_inline[ISCSI_R2T_EXT_INLINE];
+};
+
 struct iscsi_task {
 	struct iscsi_hdr req;
 	struct iscsi_hdr rsp;
@@ -113,10 +168,10 @@ struct iscsi_task {
 	uint64_t tag;
 	struct iscsi_connection *conn;
 
-	/* linked to session->cmd_list */
+	/* linked to session->cmd_hash */
 	struct list_head c_hlist;
 
-	/* linked to conn->tx_clist or session->cmd_pending_list */
+	/* linked to conn->tx_clist */
 	struct list_head c_list;
 
 	/* linked to conn->tx_clist or conn->task_list */
@@ -129,18 +184,54 @@ struct iscsi_task {
 
 	int offset;
 
+	/* write data not solicited yet */
 	int r2t_count;
 	int unsol_count;
 	int exp_r2tsn;
+	/* solicited but not received in full, in no particular order */
+	int nr_r2t;
+	struct iscsi_r2t r2t[ISCSI_R2T_MAX];
 
 	void *ahs;
 	void *data;
 
 	struct scsi_cmd scmd;
+	/* when it went to the backing store, with cmd_window_latency */
+	uint64_t queue_usecs;
 
 	unsigned long extdata[0];
 };
 
+/* PDUs gathered into one ep_writev() call */
+#define ISCSI_TX_BATCH		16
+#define ISCSI_TX_IOV_MAX	(ISCSI_TX_BATCH * 4)
+/* iovecs of a PDU with AHS, the worst case */
+#define ISCSI_TX_PDU_IOV	5
+/* bytes a connection sends per EPOLLOUT before the others get a turn */
+#define ISCSI_TX_BUDGET		(512 * 1024)
+
+/* bytes read ahead of the PDU being parsed */
+#define ISCSI_RX_RING_SIZE	(64 * 1024)
+/* payloads from this size up are read straight into their buffer */
+#define ISCSI_RX_DIRECT		1024
+
+/* the parts of a gathered PDU that are not in the task */
+struct iscsi_tx_hdr {
+	struct iscsi_hdr bhs;
+	uint32_t hdigest;
+	/* data padding followed by the data digest */
+	uint8_t tail[PAD_WORD_LEN + 4];
+	/* the data to sum up into the digest out of the lock, or NULL */
+	void *data;
+	uint32_t datasize;
+	int pad;
+};
+
+struct iscsi_task_cache {
+	struct list_head list;
+	int nr;
+};
+
 struct iscsi_connection {
 	int state;
 
@@ -155,7 +246,12 @@ struct iscsi_connection {
 	struct iscsi_session *session;
 
 	int tid;
-	struct param session_param[ISCSI_PARAM_MAX];
+	/*
+	 * Negotiated in a copy of its own, which gives way to the one of
+	 * the session in full feature phase if they agree.  Read only
+	 * from then on.
+	 */
+	struct param *session_param;
 
 	char *initiator;
 	char *initiator_alias;
@@ -189,12 +285,54 @@ struct iscsi_connection {
 	struct iscsi_task *rx_task;
 	struct iscsi_task *tx_task;
 
+	/*
+	 * Held instead of tgt_event_lock by the reactor owning the
+	 * connection while it moves data, see conn_io_begin().  Others
+	 * take it under tgt_event_lock to free what the moves use.
+	 */
+	pthread_mutex_t io_lock;
+
+	/* received but not parsed yet, rx_ring[rx_ring_head..rx_ring_tail) */
+	unsigned char *rx_ring;
+	int rx_ring_head;
+	int rx_ring_tail;
+
 	struct list_head tx_clist;
 
 	struct list_head task_list;
 
+	/* the gathered PDUs, sent up to tx_iov[tx_iovidx] */
+	struct iovec tx_iov[ISCSI_TX_IOV_MAX];
+	int tx_iovcnt;
+	int tx_iovidx;
+	struct iscsi_tx_hdr tx_hdrs[ISCSI_TX_BATCH];
+	int tx_nr_pdus;
+	/* the last PDU changes the connection state once it is sent */
+	int tx_finish;
+	/* tasks whose PDUs are gathered, freed after the send */
+	struct list_head tx_done_list;
+	/* Data-In left in a file, sent in between tx_iov[tx_file_iov - 1]
+	 * and tx_iov[tx_file_iov] */
+	int tx_file_iov;
+	int tx_file_fd;
+	off_t tx_file_off;
+	size_t tx_file_len;
+	/*
+	 * Monotonic usecs since the connection waits for EPOLLOUT with
+	 * data to send, 0 if it does not. If it only gave up its turn,
+	 * tx_yield_pass is the reactor pass it did so in.
+	 */
+	uint64_t tx_blocked_since;
+	int tx_yielded;
+	unsigned int tx_yield_pass;
+
 	unsigned char rx_digest[4];
 	unsigned char tx_digest[4];
+	/* data digests, summed up as the segment moves */
+	int rx_ddigest;
+	int tx_ddigest;
+	uint32_t rx_crc;
+	uint32_t tx_crc;
 
 	int auth_state;
 	union {
@@ -208,6 +346,9 @@ struct iscsi_connection {
 
 	struct iscsi_transport *tp;
 
+	/* on the waiters of a redirect callback, the login PDU is parked */
+	struct list_head redirect_wait;
+
 	struct iscsi_stats stats;
 };
 
@@ -248,6 +389,16 @@ struct iscsi_connection {
 
 extern int default_nop_interval;
 extern int default_nop_count;
+extern int default_zerocopy_read;
+
+/* how the TCP portals listen, see iscsi_tcp_init_portal() */
+enum {
+	ISCSI_REUSEPORT_OFF,
+	ISCSI_REUSEPORT_ON,
+	ISCSI_REUSEPORT_CPU,
+};
+
+extern int iscsi_reuseport;
 
 struct iscsi_target {
 	struct list_head tlist;
@@ -268,17 +419,41 @@ struct iscsi_target {
 		uint8_t reason;
 		char	*callback;
 	} redirect_info;
+	/* recent answers of the redirect callback, by initiator address */
+	struct list_head redirect_cache;
 
 	struct list_head isns_list;
 
 	int rdma;
 	int nop_interval;
 	int nop_count;
+	/* send READ data from the backing file with sendfile() */
+	int zerocopy_read;
+
+	/* limits of the session command windows, 0 for none */
+	uint32_t cmd_window_min;
+	uint32_t cmd_window_max;
+	/* usecs in the backing store and data bytes in flight, 0 for no limit */
+	uint32_t cmd_window_latency;
+	uint64_t cmd_window_bytes;
 };
 
 enum task_flags {
 	TASK_pending,
 	TASK_in_scsi,
+	TASK_r2t_queued,
+	/* on tx_clist for Data-In ahead of the SCSI completion */
+	TASK_streaming,
+};
+
+/* set on the accepted connections, 0 or "" keeps the system default */
+struct iscsi_sockopts {
+	int sndbuf;
+	int rcvbuf;
+	int notsent_lowat;
+	/* usecs */
+	int busy_poll;
+	char congestion[16];
 };
 
 struct iscsi_portal {
@@ -288,6 +463,12 @@ struct iscsi_portal {
 	int tpgt;
 	int fd;
 	int af;
+	/* with reuseport one listener per reactor, fds[i] on reactor i */
+	int nr_fds;
+	int *fds;
+	/* connections accepted here, per reactor */
+	int *nr_conns;
+	struct iscsi_sockopts sockopts;
 };
 
 extern struct list_head iscsi_portals_list;
@@ -302,6 +483,14 @@ extern char *portal_arguments;
 #define clear_task_in_scsi(t)	((t)->flags &= ~(1 << TASK_in_scsi))
 #define task_in_scsi(t)		((t)->flags & (1 << TASK_in_scsi))
 
+#define set_task_r2t_queued(t)	((t)->flags |= (1 << TASK_r2t_queued))
+#define clear_task_r2t_queued(t) ((t)->flags &= ~(1 << TASK_r2t_queued))
+#define task_r2t_queued(t)	((t)->flags & (1 << TASK_r2t_queued))
+
+#define set_task_streaming(t)	((t)->flags |= (1 << TASK_streaming))
+#define clear_task_streaming(t)	((t)->flags &= ~(1 << TASK_streaming))
+#define task_streaming(t)	((t)->flags & (1 << TASK_streaming))
+
 extern int lld_index;
 extern struct list_head iscsi_targets_list;
 
@@ -314,6 +503,8 @@ extern void conn_exit(struct iscsi_connection *conn);
 extern void conn_close(struct iscsi_connection *conn);
 extern void conn_put(struct iscsi_connection *conn);
 extern int conn_get(struct iscsi_connection *conn);
+extern void conn_io_begin(struct iscsi_connection *conn);
+extern int conn_io_end(struct iscsi_connection *conn);
 extern struct iscsi_connection * conn_find(struct iscsi_session *session, uint32_t cid);
 extern int conn_take_fd(struct iscsi_connection *conn);
 extern void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *session);
@@ -325,16 +516,23 @@ extern void text_key_add(struct iscsi_connection *conn, char *key, char *value);
 extern void conn_read_pdu(struct iscsi_connection *conn);
 extern int iscsi_tx_handler(struct iscsi_connection *conn);
 extern void iscsi_rx_handler(struct iscsi_connection *conn);
+extern void iscsi_login_resume(struct iscsi_connection *conn);
+extern void iscsi_rx_ring_release(struct iscsi_connection *conn);
+extern void iscsi_cmd_window_clamp(struct iscsi_session *session);
 extern int iscsi_scsi_cmd_execute(struct iscsi_task *task);
 extern int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size);
-extern int iscsi_add_portal(char *addr, int port, int tpgt);
-extern void iscsi_print_nop_settings(struct concat_buf *b, int tid);
+extern int iscsi_add_portal(char *addr, int port, int tpgt, char *params);
+extern void iscsi_print_target_settings(struct concat_buf *b, int tid);
 extern int iscsi_update_target_nop_count(int tid, int count);
 extern int iscsi_update_target_nop_interval(int tid, int interval);
 extern void iscsi_set_nop_interval(int interval);
 extern void iscsi_set_nop_count(int count);
+extern tgtadm_err iscsi_tcp_conn_show(struct concat_buf *b);
 extern int iscsi_delete_portal(char *addr, int port);
-extern int iscsi_param_parse_portals(char *p, int do_add, int do_delete);
+extern int iscsi_update_portal(char *addr, int port, char *params);
+extern int iscsi_param_parse_portals(char *p, int do_add, int do_delete,
+				     int do_update);
+extern int iscsi_param_parse_sockopts(char *p, struct iscsi_sockopts *opts);
 extern void iscsi_update_conn_stats_rx(struct iscsi_connection *conn, int size, int opcode);
 extern void iscsi_update_conn_stats_tx(struct iscsi_connection *conn, int size, int opcode);
 extern void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *scmd);
@@ -366,6 +564,9 @@ extern tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, u
 				      uint32_t cid, char *name);
 extern int target_redirected(struct iscsi_target *target,
 			     struct iscsi_connection *conn, char *buf, int *reason);
+extern int target_redirect_wait(struct iscsi_target *target,
+				struct iscsi_connection *conn);
+extern void target_redirect_unwait(struct iscsi_connection *conn);
 
 /* param.c */
 extern int param_index_by_name(char *name, struct iscsi_key *keys);
@@ -374,6 +575,19 @@ extern int param_index_by_name(char *name, struct iscsi_key *keys);
 extern int iscsi_init(int, char *);
 extern void iscsi_exit(void);
 
+/* pool.c */
+extern void *iscsi_pool_alloc_buf(size_t sz);
+extern void iscsi_pool_free_buf(void *buf);
+extern struct iscsi_task *iscsi_task_cache_alloc(struct iscsi_task_cache *tc,
+						 size_t ext_len);
+extern void iscsi_task_cache_free(struct iscsi_task_cache *tc,
+				  struct iscsi_task *task);
+extern void iscsi_task_cache_init(struct iscsi_task_cache *tc);
+extern void iscsi_task_cache_exit(struct iscsi_task_cache *tc);
+extern size_t iscsi_task_cache_bytes(struct iscsi_task_cache *tc);
+extern int iscsi_pool_param(char *p);
+extern tgtadm_err iscsi_pool_show(struct concat_buf *b);
+
 /* isns.c */
 extern int isns_init(void);
 extern void isns_exit(void);
@@ -1242,11 +1242,18 @@ static int iser_ib_clear_post_recv_list(struct iser_conn *conn)
 
 int iser_conn_init(struct iser_conn *conn)
 {
+	conn->h.session_param = malloc(sizeof(struct param) *
+				       ISCSI_PARAM_MAX);
+	if (!conn->h.session_param)
+		return -ENOMEM;
+
 	conn->h.refcount = 0;
 	conn->h.state = STATE_INIT;
 	param_set_defaults(conn->h.session_param, session_keys);
 
 	INIT_LIST_HEAD(&conn->h.clist);
+	INIT_LIST_HEAD(&conn->h.redirect_wait);
+	pthread_mutex_init(&conn->h.io_lock, NULL);
 
 	INIT_LIST_HEAD(&conn->buf_alloc_list);
 	INIT_LIST_HEAD(&conn->rdma_rd_list);
@@ -1343,6 +1350,7 @@ void iser_conn_free(struct iser_conn *conn)
 
 	if (conn->h.initiator)
 		free(conn->h.initiator);
+	free(conn->h.session_param);
 
 	if (conn->h.session)
 		session_put(conn->h.session);
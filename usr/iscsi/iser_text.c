@@ -416,7 +416,7 @@ static void iser_login_start(struct iscsi_connection *iscsi_conn,
 	char *name, *alias, *session_type, *target_name;
 	struct iscsi_target *target;
 	char buf[NI_MAXHOST + NI_MAXSERV + 4];
-	int reason;
+	int reason, redir;
 
 	iscsi_conn->cid = be16_to_cpu(req_bhs->cid);
 	memcpy(iscsi_conn->isid, req_bhs->isid, sizeof(req_bhs->isid));
@@ -484,7 +484,16 @@ static void iser_login_start(struct iscsi_connection *iscsi_conn,
 		}
 		iscsi_conn->tid = target->tid;
 
-		if (target_redirected(target, iscsi_conn, buf, &reason)) {
+		redir = target_redirected(target, iscsi_conn, buf, &reason);
+		if (redir < 0) {
+			/* the initiator retries once the callback answered */
+			rsp_bhs->status_class = ISCSI_STATUS_CLS_TARGET_ERR;
+			rsp_bhs->status_detail = redir == -EAGAIN ?
+				ISCSI_LOGIN_STATUS_SVC_UNAVAILABLE :
+				ISCSI_LOGIN_STATUS_TARGET_ERROR;
+			iscsi_conn->state = STATE_EXIT;
+			return;
+		} else if (redir) {
 			iser_text_key_add(iscsi_conn, tx_pdu, "TargetAddress", buf);
 			rsp_bhs->status_class = ISCSI_STATUS_CLS_REDIRECT;
 			rsp_bhs->status_detail = reason;
@@ -530,7 +539,7 @@ static void iser_login_start(struct iscsi_connection *iscsi_conn,
 /*      	} */
 
 		memcpy(iscsi_conn->session_param, target->session_param,
-		       sizeof(iscsi_conn->session_param));
+		       sizeof(target->session_param));
 		iscsi_conn->exp_cmd_sn = be32_to_cpu(req_bhs->cmdsn);
 		iscsi_conn->max_cmd_sn = iscsi_conn->exp_cmd_sn;
 		dprintf("set exp_cmdsn:0x%0x\n", iscsi_conn->exp_cmd_sn);
@@ -0,0 +1,429 @@
+/*
+ * Task caches and data buffer pools for the iSCSI TCP transport
+ *
+ * Data buffers come in power of two size classes from 4KB up to 16MB.
+ * They are carved out of 2MB aligned chunks, so the chunk (and the class)
+ * of a buffer is found by masking its address.  Chunks are optionally
+ * backed by hugepages.  Freed buffers stay in their chunk until the pools
+ * hold more free memory than the high watermark; then empty chunks are
+ * returned to the system until the free memory drops under the low
+ * watermark.
+ *
+ * Tasks are cached per connection, a connection never has more of them
+ * than its peak number of outstanding commands.
+ *
+ * Everything here runs under tgt_event_lock.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "iscsid.h"
+#include "tgtd.h"
+#include "util.h"
+
+#define POOL_CHUNK_SHIFT	21
+#define POOL_CHUNK_SIZE		(1UL << POOL_CHUNK_SHIFT)
+#define POOL_MIN_SHIFT		12
+#define POOL_MAX_SHIFT		24
+#define POOL_NR_CLASSES		(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+#define POOL_HASH_BITS		8
+#define POOL_HASH_SIZE		(1 << POOL_HASH_BITS)
+
+struct pool_class;
+
+struct pool_chunk {
+	/* linked to pool_class->partial or pool_class->full */
+	struct list_head list;
+	/* linked to pool_hash */
+	struct list_head hlist;
+
+	struct pool_class *cls;
+	char *addr;
+	size_t len;
+	int huge;
+
+	/* buffers handed out at least once end here */
+	size_t carved;
+	/* freed buffers, linked through their first word */
+	void *free;
+	int nr_used;
+	int nr_bufs;
+};
+
+struct pool_class {
+	size_t size;
+	size_t chunk_len;
+
+	/* chunks with a buffer left */
+	struct list_head partial;
+	struct list_head full;
+
+	int nr_chunks;
+	int nr_used;
+
+	uint64_t nr_allocs;
+	uint64_t nr_grows;
+	uint64_t nr_trims;
+};
+
+struct pool_task {
+	struct list_head list;
+	size_t ext_len;
+	/* struct iscsi_task follows */
+};
+
+static struct pool_class pool_classes[POOL_NR_CLASSES];
+static struct list_head pool_hash[POOL_HASH_SIZE];
+
+static int pool_hugepages;
+static size_t pool_high = 128UL << 20;
+static size_t pool_low = 32UL << 20;
+
+static size_t pool_free_bytes;
+static uint64_t pool_large_allocs;
+static uint64_t task_allocs, task_mallocs;
+
+static inline struct iscsi_task *POOL_TASK(struct pool_task *pt)
+{
+	return (struct iscsi_task *)(pt + 1);
+}
+
+static inline struct pool_task *TASK_POOL(struct iscsi_task *task)
+{
+	return (struct pool_task *)task - 1;
+}
+
+__attribute__((constructor)) static void pool_constructor(void)
+{
+	struct pool_class *cls;
+	int i;
+
+	for (i = 0; i < POOL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&pool_hash[i]);
+
+	for (i = 0; i < POOL_NR_CLASSES; i++) {
+		cls = &pool_classes[i];
+		cls->size = 1UL << (POOL_MIN_SHIFT + i);
+		cls->chunk_len = max_t(size_t, cls->size, POOL_CHUNK_SIZE);
+		INIT_LIST_HEAD(&cls->partial);
+		INIT_LIST_HEAD(&cls->full);
+	}
+}
+
+static inline struct list_head *pool_hash_head(unsigned long addr)
+{
+	return &pool_hash[(addr >> POOL_CHUNK_SHIFT) & (POOL_HASH_SIZE - 1)];
+}
+
+static struct pool_chunk *pool_chunk_lookup(void *buf)
+{
+	unsigned long addr = (unsigned long)buf & ~(POOL_CHUNK_SIZE - 1);
+	struct pool_chunk *chunk;
+
+	list_for_each_entry(chunk, pool_hash_head(addr), hlist) {
+		if ((unsigned long)chunk->addr == addr)
+			return chunk;
+	}
+	return NULL;
+}
+
+static void *pool_mmap(size_t len, int *huge)
+{
+	static int warned;
+	char *p, *aligned;
+	size_t head;
+
+	if (pool_hugepages) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*huge = 1;
+			return p;
+		}
+		if (!warned++)
+			eprintf("can't get hugepages, %m\n");
+	}
+
+	/* over-allocate and trim to get a chunk aligned mapping */
+	p = mmap(NULL, len + POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((unsigned long)p + POOL_CHUNK_SIZE - 1) &
+			   ~(POOL_CHUNK_SIZE - 1));
+	head = aligned - p;
+	if (head)
+		munmap(p, head);
+	munmap(aligned + len, POOL_CHUNK_SIZE - head);
+
+	*huge = 0;
+	return aligned;
+}
+
+static struct pool_chunk *pool_chunk_create(struct pool_class *cls)
+{
+	struct pool_chunk *chunk;
+
+	chunk = zalloc(sizeof(*chunk));
+	if (!chunk)
+		return NULL;
+
+	chunk->addr = pool_mmap(cls->chunk_len, &chunk->huge);
+	if (!chunk->addr) {
+		free(chunk);
+		return NULL;
+	}
+
+	chunk->cls = cls;
+	chunk->len = cls->chunk_len;
+	chunk->nr_bufs = chunk->len / cls->size;
+
+	list_add(&chunk->list, &cls->partial);
+	list_add(&chunk->hlist, pool_hash_head((unsigned long)chunk->addr));
+
+	cls->nr_chunks++;
+	cls->nr_grows++;
+	pool_free_bytes += chunk->len;
+
+	return chunk;
+}
+
+static void pool_chunk_destroy(struct pool_chunk *chunk)
+{
+	struct pool_class *cls = chunk->cls;
+
+	list_del(&chunk->list);
+	list_del(&chunk->hlist);
+
+	cls->nr_chunks--;
+	cls->nr_trims++;
+	pool_free_bytes -= chunk->len;
+
+	munmap(chunk->addr, chunk->len);
+	free(chunk);
+}
+
+/* release empty chunks, largest classes first, down to the low watermark */
+static void pool_trim(void)
+{
+	struct pool_chunk *chunk, *tmp;
+	struct pool_class *cls;
+	int i;
+
+	for (i = POOL_NR_CLASSES - 1; i >= 0; i--) {
+		cls = &pool_classes[i];
+		list_for_each_entry_safe(chunk, tmp, &cls->partial, list) {
+			if (pool_free_bytes <= pool_low)
+				return;
+			if (!chunk->nr_used)
+				pool_chunk_destroy(chunk);
+		}
+	}
+}
+
+void *iscsi_pool_alloc_buf(size_t sz)
+{
+	struct pool_class *cls;
+	struct pool_chunk *chunk;
+	void *buf;
+	int shift;
+
+	shift = sz > 1 ? sizeof(long) * 8 - __builtin_clzl(sz - 1) : 0;
+	if (shift > POOL_MAX_SHIFT)
+		goto large;
+	if (shift < POOL_MIN_SHIFT)
+		shift = POOL_MIN_SHIFT;
+
+	cls = &pool_classes[shift - POOL_MIN_SHIFT];
+	if (list_empty(&cls->partial)) {
+		if (!pool_chunk_create(cls))
+			goto large;
+	}
+
+	chunk = list_first_entry(&cls->partial, struct pool_chunk, list);
+	if (chunk->free) {
+		buf = chunk->free;
+		chunk->free = *(void **)buf;
+	} else {
+		buf = chunk->addr + chunk->carved;
+		chunk->carved += cls->size;
+	}
+
+	if (++chunk->nr_used == chunk->nr_bufs)
+		list_move(&chunk->list, &cls->full);
+
+	cls->nr_used++;
+	cls->nr_allocs++;
+	pool_free_bytes -= cls->size;
+
+	return buf;
+large:
+	pool_large_allocs++;
+	return valloc(sz);
+}
+
+void iscsi_pool_free_buf(void *buf)
+{
+	struct pool_class *cls;
+	struct pool_chunk *chunk;
+
+	if (!buf)
+		return;
+
+	chunk = pool_chunk_lookup(buf);
+	if (!chunk) {
+		free(buf);
+		return;
+	}
+
+	cls = chunk->cls;
+	if (chunk->nr_used-- == chunk->nr_bufs)
+		list_move(&chunk->list, &cls->partial);
+
+	*(void **)buf = chunk->free;
+	chunk->free = buf;
+
+	cls->nr_used--;
+	pool_free_bytes += cls->size;
+
+	if (!chunk->nr_used && pool_free_bytes > pool_high)
+		pool_trim();
+}
+
+/*
+ * Only tasks without AHS are cached, they all have the same size.  The
+ * sense buffer is left alone on reuse, sense_data_build() clears what
+ * it sends out.
+ */
+struct iscsi_task *iscsi_task_cache_alloc(struct iscsi_task_cache *tc,
+					  size_t ext_len)
+{
+	struct iscsi_task *task;
+	struct pool_task *pt;
+
+	task_allocs++;
+
+	if (!ext_len && !list_empty(&tc->list)) {
+		pt = list_first_entry(&tc->list, struct pool_task, list);
+		list_del(&pt->list);
+		tc->nr--;
+
+		task = POOL_TASK(pt);
+		memset(task, 0, offsetof(struct iscsi_task, scmd.sense_buffer));
+		memset(&task->scmd.sense_len, 0, sizeof(*task) -
+		       offsetof(struct iscsi_task, scmd.sense_len));
+		return task;
+	}
+
+	task_mallocs++;
+	pt = malloc(sizeof(*pt) + sizeof(*task) + ext_len);
+	if (!pt)
+		return NULL;
+
+	pt->ext_len = ext_len;
+	task = POOL_TASK(pt);
+	memset(task, 0, sizeof(*task) + ext_len);
+	return task;
+}
+
+void iscsi_task_cache_free(struct iscsi_task_cache *tc,
+			   struct iscsi_task *task)
+{
+	struct pool_task *pt = TASK_POOL(task);
+
+	if (pt->ext_len || tc->nr >= MAX_QUEUE_CMD_MAX) {
+		free(pt);
+		return;
+	}
+
+	list_add(&pt->list, &tc->list);
+	tc->nr++;
+}
+
+void iscsi_task_cache_init(struct iscsi_task_cache *tc)
+{
+	INIT_LIST_HEAD(&tc->list);
+	tc->nr = 0;
+}
+
+void iscsi_task_cache_exit(struct iscsi_task_cache *tc)
+{
+	struct pool_task *pt, *tmp;
+
+	list_for_each_entry_safe(pt, tmp, &tc->list, list) {
+		list_del(&pt->list);
+		free(pt);
+	}
+	tc->nr = 0;
+}
+
+size_t iscsi_task_cache_bytes(struct iscsi_task_cache *tc)
+{
+	return tc->nr * (sizeof(struct pool_task) + sizeof(struct iscsi_task));
+}
+
+int iscsi_pool_param(char *p)
+{
+	if (!strncmp(p, "pool_hugepages=", 15))
+		pool_hugepages = !strncmp(p + 15, "on", 2);
+	else if (!strncmp(p, "pool_high=", 10))
+		pool_high = strtoul(p + 10, NULL, 0) << 20;
+	else if (!strncmp(p, "pool_low=", 9))
+		pool_low = strtoul(p + 9, NULL, 0) << 20;
+	else
+		return -EINVAL;
+
+	if (pool_low > pool_high)
+		pool_low = pool_high;
+
+	return 0;
+}
+
+tgtadm_err iscsi_pool_show(struct concat_buf *b)
+{
+	struct pool_class *cls;
+	int i;
+
+	concat_printf(b, "Buffer pools:\n");
+	concat_printf(b, _TAB1 "Hugepages=%s\n", pool_hugepages ? "On" : "Off");
+	concat_printf(b, _TAB1 "LowWatermark=%zuMB\n", pool_low >> 20);
+	concat_printf(b, _TAB1 "HighWatermark=%zuMB\n", pool_high >> 20);
+	concat_printf(b, _TAB1 "FreeBytes=%zu\n", pool_free_bytes);
+	concat_printf(b, _TAB1 "Tasks: allocs %" PRIu64 " mallocs %" PRIu64
+		      "\n", task_allocs, task_mallocs);
+	concat_printf(b, _TAB1 "Unpooled buffers: allocs %" PRIu64 "\n",
+		      pool_large_allocs);
+
+	for (i = 0; i < POOL_NR_CLASSES; i++) {
+		cls = &pool_classes[i];
+		if (!cls->nr_allocs)
+			continue;
+		concat_printf(b, _TAB1 "Size %zu: chunks %d used %d free %zu"
+			      " allocs %" PRIu64 " grows %" PRIu64
+			      " trims %" PRIu64 "\n",
+			      cls->size, cls->nr_chunks, cls->nr_used,
+			      cls->nr_chunks * (cls->chunk_len / cls->size) -
+			      cls->nr_used,
+			      cls->nr_allocs, cls->nr_grows, cls->nr_trims);
+	}
+
+	return TGTADM_SUCCESS;
+}
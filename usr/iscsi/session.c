@@ -64,7 +64,7 @@ struct iscsi_session *session_lookup_by_tsih(uint16_t tsih)
 
 int session_create(struct iscsi_connection *conn)
 {
-	int err;
+	int err, i, max_cmd;
 	struct iscsi_session *session = NULL;
 	static uint16_t tsih, last_tsih = 0;
 	struct iscsi_target *target;
@@ -112,6 +112,23 @@ int session_create(struct iscsi_connection *conn)
 		return -ENOMEM;
 	}
 
+	if (!conn->tp->rdma) {
+		/* CmdSNs from ExpCmdSN up to MaxCmdSN, both included */
+		max_cmd = conn->session_param[ISCSI_PARAM_MAX_QUEUE_CMD].val;
+		i = 1;
+		while (i <= max_cmd)
+			i <<= 1;
+		session->cmd_ring = zalloc(i * sizeof(*session->cmd_ring));
+		if (!session->cmd_ring) {
+			free(session->initiator);
+			free(session->initiator_alias);
+			free(session->info);
+			free(session);
+			return -ENOMEM;
+		}
+		session->cmd_ring_mask = i - 1;
+	}
+
 	memset(addr, 0, sizeof(addr));
 	conn->tp->ep_show(conn, addr, sizeof(addr));
 
@@ -126,6 +143,7 @@ int session_create(struct iscsi_connection *conn)
 		free(session->initiator);
 		free(session->initiator_alias);
 		free(session->info);
+		free(session->cmd_ring);
 		free(session);
 		return err;
 	}
@@ -136,6 +154,8 @@ int session_create(struct iscsi_connection *conn)
 
 	INIT_LIST_HEAD(&session->conn_list);
 	INIT_LIST_HEAD(&session->cmd_list);
+	for (i = 0; i < ISCSI_CMD_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&session->cmd_hash[i]);
 	INIT_LIST_HEAD(&session->pending_cmd_list);
 
 	memcpy(session->isid, conn->isid, sizeof(session->isid));
@@ -155,6 +175,9 @@ int session_create(struct iscsi_connection *conn)
 
 	session->max_queue_cmd =
 		session->session_param[ISCSI_PARAM_MAX_QUEUE_CMD].val;
+	session->max_cmd_sn = session->exp_cmd_sn;
+	session->cmd_window = session->max_queue_cmd;
+	iscsi_cmd_window_clamp(session);
 
 	return 0;
 }
@@ -177,6 +200,7 @@ static void session_destroy(struct iscsi_session *session)
 	free(session->initiator);
 	free(session->initiator_alias);
 	free(session->info);
+	free(session->cmd_ring);
 	free(session);
 }
 
@@ -19,9 +19,11 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/stat.h>
@@ -32,6 +34,7 @@
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
+#include "crc32c.h"
 #include "iscsid.h"
 #include "tgtadm.h"
 #include "tgtd.h"
@@ -218,16 +221,177 @@ int iqn_acl(int tid, struct iscsi_connection *conn)
 		return -EPERM;
 }
 
+/*
+ * The redirect callback runs asynchronously, its answers are kept for
+ * a while per initiator address so that a storm of logins from one
+ * host runs it once.  Logins that come in while it runs are parked on
+ * the waiters of its entry and resumed once it answered.
+ */
+#define REDIRECT_CACHE_MSECS	5000
+#define REDIRECT_RETRY_MSECS	1000
+
+struct redirect_entry {
+	struct list_head list;
+	/* NULL once dropped from the cache while the callback runs */
+	struct iscsi_target *target;
+	char addr[INET6_ADDRSTRLEN];
+	int running;
+	/* length of output, -1 if the callback failed */
+	int result;
+	char output[NI_MAXHOST + NI_MAXSERV + 4];
+	unsigned int expires;
+	struct list_head waiters;
+};
+
+static unsigned int redirect_msecs(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void redirect_callback_done(void *data, int result)
+{
+	struct redirect_entry *ent = data;
+	struct iscsi_connection *conn;
+
+	ent->running = 0;
+	ent->result = result;
+	ent->expires = redirect_msecs() +
+		(result < 0 ? REDIRECT_RETRY_MSECS : REDIRECT_CACHE_MSECS);
+
+	while (!list_empty(&ent->waiters)) {
+		conn = list_first_entry(&ent->waiters, struct iscsi_connection,
+					redirect_wait);
+		list_del_init(&conn->redirect_wait);
+		iscsi_login_resume(conn);
+	}
+
+	if (!ent->target)
+		free(ent);
+}
+
+static struct redirect_entry *redirect_lookup(struct iscsi_target *target,
+					      char *addr)
+{
+	struct redirect_entry *ent, *next;
+	unsigned int now = redirect_msecs();
+
+	list_for_each_entry_safe(ent, next, &target->redirect_cache, list) {
+		if (!ent->running && !before(now, ent->expires)) {
+			list_del(&ent->list);
+			free(ent);
+			continue;
+		}
+		if (!strcmp(ent->addr, addr))
+			return ent;
+	}
+
+	return NULL;
+}
+
+static struct redirect_entry *redirect_start(struct iscsi_target *target,
+					     char *addr)
+{
+	struct redirect_entry *ent;
+	char cmd[1024];
+
+	ent = zalloc(sizeof(*ent));
+	if (!ent)
+		return NULL;
+
+	ent->target = target;
+	snprintf(ent->addr, sizeof(ent->addr), "%s", addr);
+	ent->running = 1;
+	INIT_LIST_HEAD(&ent->waiters);
+	list_add(&ent->list, &target->redirect_cache);
+
+	snprintf(cmd, sizeof(cmd), "%s %s %s", target->redirect_info.callback,
+		 tgt_targetname(target->tid), addr);
+	if (call_program(cmd, redirect_callback_done, ent, ent->output,
+			 sizeof(ent->output) - 1, 0)) {
+		list_del(&ent->list);
+		free(ent);
+		return NULL;
+	}
+
+	return ent;
+}
+
+static void redirect_cache_flush(struct iscsi_target *target)
+{
+	struct redirect_entry *ent, *next;
+
+	list_for_each_entry_safe(ent, next, &target->redirect_cache, list) {
+		list_del(&ent->list);
+		if (ent->running)
+			ent->target = NULL;
+		else
+			free(ent);
+	}
+}
+
+static int redirect_peer_addr(struct iscsi_connection *conn,
+			      struct sockaddr_storage *from, char *addr)
+{
+	socklen_t len;
+	int ret;
+
+	len = sizeof(*from);
+	ret = conn->tp->ep_getpeername(conn, (struct sockaddr *)from, &len);
+	if (ret < 0)
+		return ret;
+
+	/* without it, only the predefined redirect applies */
+	if (getnameinfo((struct sockaddr *)from, sizeof(*from), addr,
+			INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST))
+		*addr = '\0';
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the redirect callback of target has yet to answer for
+ * the initiator of conn.  The login PDU of conn is then parked until
+ * iscsi_login_resume() executes it.
+ */
+int target_redirect_wait(struct iscsi_target *target,
+			 struct iscsi_connection *conn)
+{
+	struct sockaddr_storage from;
+	struct redirect_entry *ent;
+	char addr[INET6_ADDRSTRLEN];
+
+	if (!target->redirect_info.callback)
+		return 0;
+
+	if (redirect_peer_addr(conn, &from, addr) || !*addr)
+		return 0;
+
+	ent = redirect_lookup(target, addr);
+	if (!ent) {
+		ent = redirect_start(target, addr);
+		if (!ent)
+			return 0;
+	}
+	if (!ent->running)
+		return 0;
+
+	list_add_tail(&conn->redirect_wait, &ent->waiters);
+	return 1;
+}
+
+void target_redirect_unwait(struct iscsi_connection *conn)
+{
+	list_del_init(&conn->redirect_wait);
+}
+
 static int
-get_redirect_address(char *callback, char *buffer, int buflen,
-			char **address, char **ip_port, int *rsn)
+get_redirect_address(char *buffer, char **address, char **ip_port, int *rsn)
 {
 	char *p, *addr, *port;
 
-	bzero(buffer, buflen);
-	if (call_program(callback, NULL, NULL, buffer, buflen, 0))
-		return -1;
-
 	/* syntax is string_addr:string_port:string_reason */
 	addr = p = buffer;
 	if (*p == '[') {
@@ -268,34 +432,34 @@ int target_redirected(struct iscsi_target *target,
 {
 	struct sockaddr_storage from;
 	struct addrinfo hints, *res;
-	socklen_t len;
+	struct redirect_entry *ent;
 	int ret, rsn = 0;
 	char *p, *q, *str, *port = NULL, *addr;
 	char buffer[NI_MAXHOST + NI_MAXSERV + 4];
-	char dst[INET6_ADDRSTRLEN], in_buf[1024];
+	char dst[INET6_ADDRSTRLEN];
 
-	len = sizeof(from);
-	ret = conn->tp->ep_getpeername(conn, (struct sockaddr *)&from, &len);
+	ret = redirect_peer_addr(conn, &from, dst);
 	if (ret < 0)
 		return 0;
 
 	ret = 1;
-	if (target->redirect_info.callback) {
-		p = in_buf;
-		p += sprintf(p, "%s ", target->redirect_info.callback);
-		p += sprintf(p, "%s ", tgt_targetname(target->tid));
-		ret = getnameinfo((struct sockaddr *)&from, sizeof(from), dst,
-				sizeof(dst), NULL, 0, NI_NUMERICHOST);
-		if (ret)
-			goto predefined;
-		sprintf(p, "%s", dst);
-		ret = get_redirect_address(in_buf, buffer,
-					sizeof(buffer), &addr, &port, &rsn);
+	if (target->redirect_info.callback && *dst) {
+		ent = redirect_lookup(target, dst);
+		if (!ent || ent->running) {
+			/* the initiator is asked to try again later */
+			if (!ent && !redirect_start(target, dst))
+				return -1;
+			return -EAGAIN;
+		}
+		if (ent->result < 0)
+			return -1;
+
+		memcpy(buffer, ent->output, sizeof(buffer));
+		ret = get_redirect_address(buffer, &addr, &port, &rsn);
 		if (ret)
 			return -1;
 	}
 
-predefined:
 	if (ret) {
 		if (!strlen(target->redirect_info.addr))
 			return 0;
@@ -410,9 +574,12 @@ void iscsi_target_destroy(int tid, int force)
 	}
 
 	list_for_each_entry_safe(session, stmp, &target->sessions_list, slist) {
+		/* the last conn_put() would free it under the loop */
+		session_get(session);
 		list_for_each_entry_safe(conn, ctmp, &session->conn_list, clist) {
 			conn_close(conn);
 		}
+		session_put(session);
 	}
 
 	if (!list_empty(&target->sessions_list)) {
@@ -421,6 +588,7 @@ void iscsi_target_destroy(int tid, int force)
 	}
 
 	list_del(&target->tlist);
+	redirect_cache_flush(target);
 	if (target->redirect_info.callback)
 		free(target->redirect_info.callback);
 	free(target);
@@ -438,7 +606,7 @@ int iscsi_target_create(struct target *t)
 		[ISCSI_PARAM_HDRDGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_DATADGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_INITIAL_R2T_EN] = {0, 1},
-		[ISCSI_PARAM_MAX_R2T] = {0, 1},
+		[ISCSI_PARAM_MAX_R2T] = {0, ISCSI_R2T_MAX},
 		[ISCSI_PARAM_IMM_DATA_EN] = {0, 1},
 		[ISCSI_PARAM_FIRST_BURST] = {0, 65536},
 		[ISCSI_PARAM_MAX_BURST] = {0, 262144},
@@ -473,15 +641,47 @@ int iscsi_target_create(struct target *t)
 	INIT_LIST_HEAD(&target->tlist);
 	INIT_LIST_HEAD(&target->sessions_list);
 	INIT_LIST_HEAD(&target->isns_list);
+	INIT_LIST_HEAD(&target->redirect_cache);
 	target->tid = tid;
 	target->nop_interval = default_nop_interval;
 	target->nop_count = default_nop_count;
+	target->zerocopy_read = default_zerocopy_read;
 	list_add_tail(&target->tlist, &iscsi_targets_list);
 
 	isns_target_register(tgt_targetname(tid));
 	return 0;
 }
 
+static tgtadm_err iscsi_cmd_window_param(struct iscsi_target *target,
+					 char *name, char *str)
+{
+	struct iscsi_session *session;
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	if (end == str || *end || *str == '-')
+		return TGTADM_INVALID_REQUEST;
+
+	if (!strcmp(name, "bytes"))
+		target->cmd_window_bytes = val;
+	else if (val > UINT32_MAX)
+		return TGTADM_INVALID_REQUEST;
+	else if (!strcmp(name, "min"))
+		target->cmd_window_min = val;
+	else if (!strcmp(name, "max"))
+		target->cmd_window_max = val;
+	else if (!strcmp(name, "latency"))
+		target->cmd_window_latency = val;
+	else
+		return TGTADM_INVALID_REQUEST;
+
+	list_for_each_entry(session, &target->sessions_list, slist)
+		iscsi_cmd_window_clamp(session);
+
+	return TGTADM_SUCCESS;
+}
+
 static int iscsi_session_param_update(struct iscsi_target* target, int idx, char *str)
 {
 	int err;
@@ -523,6 +723,10 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 
 		dprintf("%s:%s\n", name, str);
 
+		/* answers of the callback may not apply any more */
+		if (!strncmp(name, "Redirect", 8))
+			redirect_cache_flush(target);
+
 		if (!strncmp(name, "RedirectAddress", 15)) {
 			snprintf(target->redirect_info.addr,
 				 sizeof(target->redirect_info.addr), "%s", str);
@@ -545,6 +749,7 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 			} else
 				break;
 		} else if (!strncmp(name, "RedirectCallback", 16)) {
+			free(target->redirect_info.callback);
 			target->redirect_info.callback = strdup(str);
 			if (!target->redirect_info.callback) {
 				adm_err = TGTADM_NOMEM;
@@ -563,6 +768,19 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 			adm_err = !err ? TGTADM_SUCCESS :
 				TGTADM_INVALID_REQUEST;
 			break;
+		} else if (!strcmp(name, "zerocopy_read")) {
+			if (!strcmp(str, "on"))
+				target->zerocopy_read = 1;
+			else if (!strcmp(str, "off"))
+				target->zerocopy_read = 0;
+			else
+				break;
+			adm_err = TGTADM_SUCCESS;
+			break;
+		} else if (!strncmp(name, "cmd_window_", 11)) {
+			adm_err = iscsi_cmd_window_param(target, name + 11,
+							 str);
+			break;
 		}
 
 		idx = param_index_by_name(name, session_keys);
@@ -617,8 +835,11 @@ static tgtadm_err iscsi_target_show_session(struct iscsi_target *target, uint64_
 	struct iscsi_session *session;
 
 	session = iscsi_target_find_session(target, sid);
-	if (session)
+	if (session) {
 		adm_err = show_iscsi_param(session->session_param, b);
+		concat_printf(b, "CmdWindow=%u\n", session->cmd_window);
+		concat_printf(b, "CmdBytes=%" PRIu64 "\n", session->cmd_bytes);
+	}
 
 	return adm_err;
 }
@@ -658,7 +879,7 @@ static tgtadm_err iscsi_target_show_portals(struct iscsi_target *target, uint64_
 
 	list_for_each_entry(portal, &iscsi_portals_list,
 			iscsi_portal_siblings) {
-		int is_ipv6;
+		int is_ipv6, i;
 
 		is_ipv6 = strchr(portal->addr, ':') != NULL;
 		concat_printf(b, "Portal: %s%s%s:%d,%d\n",
@@ -667,6 +888,18 @@ static tgtadm_err iscsi_target_show_portals(struct iscsi_target *target, uint64_
 			       is_ipv6 ? "]" : "",
 			       portal->port ? portal->port : ISCSI_LISTEN_PORT,
 			       portal->tpgt);
+		concat_printf(b, _TAB1 "Listeners=%d\n", portal->nr_fds);
+		concat_printf(b, _TAB1 "SndBuf=%d\n", portal->sockopts.sndbuf);
+		concat_printf(b, _TAB1 "RcvBuf=%d\n", portal->sockopts.rcvbuf);
+		concat_printf(b, _TAB1 "NotSentLowat=%d\n",
+			      portal->sockopts.notsent_lowat);
+		concat_printf(b, _TAB1 "BusyPoll=%d\n",
+			      portal->sockopts.busy_poll);
+		concat_printf(b, _TAB1 "Congestion=%s\n",
+			      portal->sockopts.congestion);
+		for (i = 0; i < nr_reactors; i++)
+			concat_printf(b, _TAB1 "Reactor %d: Connections=%d\n",
+				      i, portal->nr_conns[i]);
 	}
 
 	return adm_err;
@@ -710,6 +943,14 @@ tgtadm_err iscsi_target_show(int mode, int tid, uint64_t sid, uint32_t cid, uint
 	switch (mode) {
 	case MODE_SYSTEM:
 		adm_err = isns_show(b);
+		if (adm_err == TGTADM_SUCCESS)
+			adm_err = iscsi_pool_show(b);
+		if (adm_err == TGTADM_SUCCESS)
+			adm_err = iscsi_tcp_conn_show(b);
+		if (adm_err == TGTADM_SUCCESS) {
+			concat_printf(b, "Digests:\n");
+			concat_printf(b, _TAB1 "CRC32C=%s\n", crc32c_name());
+		}
 		break;
 	case MODE_TARGET:
 		if (target->redirect_info.callback)
@@ -738,7 +979,7 @@ tgtadm_err iscsi_target_show(int mode, int tid, uint64_t sid, uint32_t cid, uint
 static void _stat_iscsi_conn_hdr(struct concat_buf *b)
 {
 	concat_printf(b,
-		"sid cid rxdata_octets txdata_octets dataout_pdus datain_pdus cmd_pdus rsp_pdus\n");
+		"sid cid rxdata_octets txdata_octets dataout_pdus datain_pdus cmd_pdus rsp_pdus rx_syscalls tx_syscalls txfile_octets r2t_stalls tx_blocked tx_blocked_usecs syscalls_per_cmd\n");
 }
 
 static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b)
@@ -749,7 +990,14 @@ static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b
 		      " %12" PRIu32
 		      " %11" PRIu32
 		      " %8" PRIu32
-		      " %8" PRIu32 "\n",
+		      " %8" PRIu32
+		      " %11" PRIu64
+		      " %11" PRIu64
+		      " %13" PRIu64
+		      " %10" PRIu64
+		      " %10" PRIu64
+		      " %16" PRIu64
+		      " %16.2f\n",
 		      (unsigned int)conn->session->tsih,
 		      (unsigned int)conn->cid,
 		      conn->stats.rxdata_octets,
@@ -757,7 +1005,17 @@ static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b
 		      conn->stats.dataout_pdus,
 		      conn->stats.datain_pdus,
 		      conn->stats.scsicmd_pdus,
-		      conn->stats.scsirsp_pdus);
+		      conn->stats.scsirsp_pdus,
+		      conn->stats.rx_syscalls,
+		      conn->stats.tx_syscalls,
+		      conn->stats.txfile_octets,
+		      conn->stats.r2t_stalls,
+		      conn->stats.tx_blocked,
+		      conn->stats.tx_blocked_usecs,
+		      conn->stats.scsicmd_pdus ?
+		      (double)(conn->stats.rx_syscalls +
+			       conn->stats.tx_syscalls) /
+		      conn->stats.scsicmd_pdus : 0.0);
 }
 
 static tgtadm_err _stat_iscsi_session(struct iscsi_session *session,
@@ -2,6 +2,7 @@
 #define __TRANSPORT_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "list.h"
 
 struct iscsi_connection;
@@ -22,9 +23,15 @@ struct iscsi_transport {
 	void (*free_task)(struct iscsi_task *task);
 	size_t (*ep_read)(struct iscsi_connection *conn, void *buf,
 			  size_t nbytes);
+	ssize_t (*ep_readv)(struct iscsi_connection *conn, struct iovec *iov,
+			    int iovcnt);
 	size_t (*ep_write_begin)(struct iscsi_connection *conn, void *buf,
 				 size_t nbytes);
 	void (*ep_write_end)(struct iscsi_connection *conn);
+	ssize_t (*ep_writev)(struct iscsi_connection *conn, struct iovec *iov,
+			     int iovcnt, int more);
+	ssize_t (*ep_sendfile)(struct iscsi_connection *conn, int fd,
+			       off_t *offset, size_t count);
 	int (*ep_rdma_read)(struct iscsi_connection *conn);
 	int (*ep_rdma_write)(struct iscsi_connection *conn);
 	size_t (*ep_close)(struct iscsi_connection *conn);
@@ -33,13 +40,15 @@ struct iscsi_transport {
 
 	int (*ep_show)(struct iscsi_connection *conn, char *buf, int rest);
 	void (*ep_event_modify)(struct iscsi_connection *conn, int events);
+	/* PDUs were queued on tx_clist; EPOLLOUT if not set */
+	void (*ep_tx_kick)(struct iscsi_connection *conn);
 	void *(*alloc_data_buf)(struct iscsi_connection *conn, size_t sz);
 	void (*free_data_buf)(struct iscsi_connection *conn, void *buf);
 	int (*ep_getsockname)(struct iscsi_connection *conn,
 			      struct sockaddr *sa, socklen_t *len);
 	int (*ep_getpeername)(struct iscsi_connection *conn,
 			      struct sockaddr *sa, socklen_t *len);
-	void (*ep_nop_reply) (long ttt);
+	void (*ep_nop_reply) (struct iscsi_connection *conn, long ttt);
 };
 
 extern int iscsi_transport_register(struct iscsi_transport *);
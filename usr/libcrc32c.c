@@ -32,6 +32,13 @@
  */
 #include "crc32c.h"
 #include <asm/byteorder.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+#if defined(__aarch64__) && !defined(__AARCH64EB__)
+#include <sys/auxv.h>
+#endif
 
 /*
  * MODULE_AUTHOR("Clay Haapala <chaapala@cisco.com>");
@@ -63,8 +70,8 @@
  * loop below with crc32 and vary the POLY if we don't find value in terms
  * of space and maintainability in keeping the two modules separate.
  */
-uint32_t __attribute__((pure))
-crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+static uint32_t __attribute__((pure))
+crc32c_sw(uint32_t crc, unsigned char const *p, size_t len)
 {
 	int i;
 	while (len--) {
@@ -74,6 +81,10 @@ crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
 	}
 	return crc;
 }
+
+static void crc32c_sw_init(void)
+{
+}
 #else
 
 /*
@@ -153,24 +164,228 @@ static const uint32_t crc32c_table[256] = {
 };
 
 /*
- * Steps through buffer one byte at at time, calculates reflected
- * crc using table.
+ * crc32c_slice[k][b] is the crc of byte b followed by k zero bytes, so
+ * eight bytes can be looked up at once (slicing-by-8).
  */
+static uint32_t crc32c_slice[8][256];
 
-uint32_t __attribute__((pure))
-crc32c_le(uint32_t seed, unsigned char const *data, size_t length)
+static void crc32c_sw_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32c_slice[0][i] = crc32c_table[i];
+		for (k = 1; k < 8; k++)
+			crc32c_slice[k][i] = (crc32c_slice[k - 1][i] >> 8) ^
+				crc32c_table[crc32c_slice[k - 1][i] & 0xFF];
+	}
+}
+
+/*
+ * Steps through buffer eight bytes at a time, calculates reflected
+ * crc using the tables.
+ */
+static uint32_t __attribute__((pure))
+crc32c_sw(uint32_t crc, unsigned char const *p, size_t len)
 {
-	uint32_t crc = __cpu_to_le32(seed);
+	const uint32_t (*t)[256] = crc32c_slice;
+
+	while (len >= 8) {
+		crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF] ^
+			t[5][(crc >> 16) & 0xFF] ^ t[4][crc >> 24] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
 
-	while (length--)
-		crc =
-		    crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
+	while (len--)
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return __le32_to_cpu(crc);
+	return crc;
 }
 
 #endif	/* CRC_LE_BITS == 8 */
 
+#ifdef __x86_64__
+/*
+ * SSE4.2 crc32 has a latency of three cycles and a throughput of one,
+ * so long buffers are cut into three streams that are summed up in
+ * parallel.  Their crcs are then shifted into place with PCLMULQDQ:
+ * for a 32 bit crc c, crc32(0, clmul(c, x^(8n-33) mod P)) is c shifted
+ * over n zero bytes.
+ */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+/* x^(8n-33) mod P for n = LONG, 2 * LONG, SHORT and 2 * SHORT */
+static uint32_t crc32c_k_long[2];
+static uint32_t crc32c_k_short[2];
+
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc, unsigned char const *p, size_t len)
+{
+	uint64_t crc64;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+	crc64 = crc;
+	while (len >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static inline uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_shift2(uint32_t a, uint32_t ka, uint32_t b, uint32_t kb)
+{
+	__m128i x;
+
+	x = _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi32_si128(a),
+					       _mm_cvtsi32_si128(ka), 0),
+			  _mm_clmulepi64_si128(_mm_cvtsi32_si128(b),
+					       _mm_cvtsi32_si128(kb), 0));
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(x));
+}
+
+static inline uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_3way(uint32_t crc, unsigned char const **pp, size_t *lenp,
+	    size_t blk, const uint32_t *k)
+{
+	unsigned char const *p = *pp, *end;
+	uint64_t c0, c1, c2;
+
+	while (*lenp >= 3 * blk) {
+		c0 = crc;
+		c1 = c2 = 0;
+		for (end = p + blk; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+			c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p + blk));
+			c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p + 2 * blk));
+		}
+		crc = crc32c_shift2(c0, k[1], c1, k[0]) ^ c2;
+		p += 2 * blk;
+		*lenp -= 3 * blk;
+	}
+
+	*pp = p;
+	return crc;
+}
+
+static uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_sse42_pclmul(uint32_t crc, unsigned char const *p, size_t len)
+{
+	if (len < 3 * CRC32C_SHORT)
+		return crc32c_sse42(crc, p, len);
+
+	while ((uintptr_t)p & 7) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+	crc = crc32c_3way(crc, &p, &len, CRC32C_LONG, crc32c_k_long);
+	crc = crc32c_3way(crc, &p, &len, CRC32C_SHORT, crc32c_k_short);
+
+	return crc32c_sse42(crc, p, len);
+}
+#endif	/* __x86_64__ */
+
+#if defined(__aarch64__) && !defined(__AARCH64EB__)
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+static uint32_t crc32c_armv8(uint32_t crc, unsigned char const *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		crc = __crc32cd(crc, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#pragma GCC pop_options
+#endif
+
+/* bit reflected x^n mod P */
+static uint32_t __attribute__((unused)) crc32c_xpow(size_t n)
+{
+	uint32_t r = 0x80000000;
+
+	while (n--)
+		r = (r >> 1) ^ ((r & 1) ? CRC32C_POLY_LE : 0);
+
+	return r;
+}
+
+static uint32_t (*crc32c_impl)(uint32_t crc, unsigned char const *p,
+			       size_t len) = crc32c_sw;
+static const char *crc32c_impl_name = "slicing-by-8";
+
+__attribute__((constructor)) static void crc32c_init(void)
+{
+	crc32c_sw_init();
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse4.2"))
+		return;
+
+	if (__builtin_cpu_supports("pclmul")) {
+		crc32c_k_long[0] = crc32c_xpow(8 * CRC32C_LONG - 33);
+		crc32c_k_long[1] = crc32c_xpow(16 * CRC32C_LONG - 33);
+		crc32c_k_short[0] = crc32c_xpow(8 * CRC32C_SHORT - 33);
+		crc32c_k_short[1] = crc32c_xpow(16 * CRC32C_SHORT - 33);
+		crc32c_impl = crc32c_sse42_pclmul;
+		crc32c_impl_name = "sse4.2+pclmul";
+	} else {
+		crc32c_impl = crc32c_sse42;
+		crc32c_impl_name = "sse4.2";
+	}
+#endif
+#if defined(__aarch64__) && !defined(__AARCH64EB__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c_impl = crc32c_armv8;
+		crc32c_impl_name = "armv8";
+	}
+#endif
+}
+
+const char *crc32c_name(void)
+{
+	return crc32c_impl_name;
+}
+
+uint32_t __attribute__((pure))
+crc32c_le(uint32_t seed, unsigned char const *data, size_t length)
+{
+	return __le32_to_cpu(crc32c_impl(__cpu_to_le32(seed), data, length));
+}
+
 #if CRC_BE_BITS == 1
 uint32_t __attribute__((pure))
 crc32c_be(uint32_t crc, unsigned char const *p, size_t len)
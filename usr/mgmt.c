@@ -228,6 +228,9 @@ static tgtadm_err portal_mgmt(int lld_no, struct mgmt_task *mtask)
 	case OP_DELETE:
 		adm_err = tgt_portal_destroy(lld_no, mtask->req_buf);
 		break;
+	case OP_UPDATE:
+		adm_err = tgt_portal_update(lld_no, mtask->req_buf);
+		break;
 	default:
 		break;
 	}
@@ -319,8 +319,10 @@ const unsigned char *get_scsi_cdb_usage_data(unsigned char op, unsigned char sa)
 void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc)
 {
 
+	/* the sense buffer is not cleared when a task is reused */
 	if (cmd->dev->attrs.sense_format) {
 		/* descriptor format */
+		memset(cmd->sense_buffer, 0, 8);
 		cmd->sense_buffer[0] = 0x72;  /* current, not deferred */
 		cmd->sense_buffer[1] = key;
 		cmd->sense_buffer[2] = (asc >> 8) & 0xff;
@@ -329,6 +331,7 @@ void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc)
 	} else {
 		/* fixed format */
 		int len = 0xa;
+		memset(cmd->sense_buffer, 0, len + 8);
 		cmd->sense_buffer[0] = 0x70;  /* current, not deferred */
 		cmd->sense_buffer[2] = key;
 		cmd->sense_buffer[7] = len;
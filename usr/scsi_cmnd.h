@@ -20,8 +20,10 @@ struct scsi_data_buffer {
 
 struct scsi_cmd {
 	struct target *c_target;
-	/* linked it_nexus->cmd_hash_list */
+	/* linked it_nexus->cmd_list */
 	struct list_head c_hlist;
+	/* linked it_nexus->cmd_hash */
+	struct list_head c_tag_hlist;
 	struct list_head qlist;
 
 	uint64_t dev_id;
@@ -49,6 +51,15 @@ struct scsi_cmd {
 
 	struct list_head bs_list;
 
+	/*
+	 * Streamed in-data: the backing store stores how much of the
+	 * in buffer is filled while the command is still running, and
+	 * queues the command on its progress stack through bs_ready.
+	 */
+	uint32_t in_ready;
+	int bs_ready_queued;
+	struct list_head bs_ready;
+
 	struct it_nexus *it_nexus;
 	struct it_nexus_lu_info *itn_lu_info;
 };
@@ -123,6 +134,12 @@ enum {
 	TGT_CMD_PROCESSED,
 	TGT_CMD_ASYNC,
 	TGT_CMD_NOT_LAST,
+	/* the transport can send in-data from the backing file */
+	TGT_CMD_ZEROCOPY,
+	/* in-data was left in dev->fd at cmd->offset */
+	TGT_CMD_IN_FILE,
+	/* the transport can send in-data before the command completes */
+	TGT_CMD_STREAM,
 };
 
 #define CMD_FNS(bit, name)						\
@@ -143,3 +160,12 @@ CMD_FNS(QUEUED, queued)
 CMD_FNS(PROCESSED, processed)
 CMD_FNS(ASYNC, async)
 CMD_FNS(NOT_LAST, not_last)
+CMD_FNS(ZEROCOPY, zerocopy)
+CMD_FNS(IN_FILE, in_file)
+CMD_FNS(STREAM, stream)
+
+/* bytes at the start of the in buffer the backing store has filled */
+static inline uint32_t scsi_get_in_ready(struct scsi_cmd *scmd)
+{
+	return __atomic_load_n(&scmd->in_ready, __ATOMIC_ACQUIRE);
+}
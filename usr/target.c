@@ -64,11 +64,22 @@ static struct device_type_template *device_type_lookup(int type)
 }
 
 static LIST_HEAD(target_list);
+static struct list_head target_hash[TGT_HASH_SIZE];
+
+static void __attribute__((constructor)) target_hash_init(void)
+{
+	int i;
+
+	for (i = 0; i < TGT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&target_hash[i]);
+}
 
 static struct target *target_lookup(int tid)
 {
 	struct target *target;
-	list_for_each_entry(target, &target_list, target_siblings)
+	struct list_head *head = &target_hash[tgt_hash(tid, TGT_HASH_BITS)];
+
+	list_for_each_entry(target, head, target_hlist)
 		if (target->tid == tid)
 			return target;
 	return NULL;
@@ -92,7 +103,9 @@ struct it_nexus *it_nexus_lookup(int tid, uint64_t itn_id)
 	if (!target)
 		return NULL;
 
-	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
+	list_for_each_entry(itn,
+		&target->it_nexus_hash[tgt_hash(itn_id, TGT_HASH_BITS)],
+		nexus_hlist) {
 		if (itn->itn_id == itn_id)
 			return itn;
 	}
@@ -206,9 +219,20 @@ static void it_nexus_del_lu_info(struct it_nexus *itn)
 		ua_sense_pending_del(itn_lu);
 
 		list_del(&itn_lu->itn_itl_info_siblings);
+		list_del(&itn_lu->itn_itl_info_hlist);
 		list_del(&itn_lu->lu_itl_info_siblings);
 		free(itn_lu);
 	}
+	itn->last_itn_lu = NULL;
+}
+
+static void it_nexus_add_lu_info(struct it_nexus *itn,
+				 struct it_nexus_lu_info *itn_lu)
+{
+	list_add(&itn_lu->itn_itl_info_siblings, &itn->itn_itl_info_list);
+	list_add(&itn_lu->itn_itl_info_hlist,
+		 &itn->itn_itl_info_hash[tgt_hash(itn_lu->lu->lun,
+						  ITL_HASH_BITS)]);
 }
 
 void ua_sense_add_other_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
@@ -289,6 +313,7 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 	struct scsi_lu *lu;
 	struct it_nexus_lu_info *itn_lu;
 	struct timeval tv;
+	int i;
 
 	dprintf("%d %" PRIu64 " %d\n", tid, itn_id, host_no);
 	/* for reserve/release code */
@@ -310,6 +335,8 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 	itn->nexus_target = target;
 	itn->info = info;
 	INIT_LIST_HEAD(&itn->itn_itl_info_list);
+	for (i = 0; i < ITL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&itn->itn_itl_info_hash[i]);
 	gettimeofday(&tv, NULL);
 	itn->ctime = tv.tv_sec;
 
@@ -330,13 +357,16 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 		list_add_tail(&itn_lu->lu_itl_info_siblings,
 			      &lu->lu_itl_info_list);
 
-		list_add(&itn_lu->itn_itl_info_siblings,
-			 &itn->itn_itl_info_list);
+		it_nexus_add_lu_info(itn, itn_lu);
 	}
 
 	INIT_LIST_HEAD(&itn->cmd_list);
+	for (i = 0; i < CMD_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&itn->cmd_hash[i]);
 
 	list_add_tail(&itn->nexus_siblings, &target->it_nexus_list);
+	list_add(&itn->nexus_hlist,
+		 &target->it_nexus_hash[tgt_hash(itn_id, TGT_HASH_BITS)]);
 
 	return 0;
 out:
@@ -367,6 +397,7 @@ int it_nexus_destroy(int tid, uint64_t itn_id)
 	it_nexus_del_lu_info(itn);
 
 	list_del(&itn->nexus_siblings);
+	list_del(&itn->nexus_hlist);
 	free(itn);
 	return 0;
 }
@@ -375,7 +406,8 @@ static struct scsi_lu *device_lookup(struct target *target, uint64_t lun)
 {
 	struct scsi_lu *lu;
 
-	list_for_each_entry(lu, &target->device_list, device_siblings)
+	list_for_each_entry(lu, &target->device_hash[tgt_hash(lun, TGT_HASH_BITS)],
+			    device_hlist)
 		if (lu->lun == lun)
 			return lu;
 	return NULL;
@@ -384,11 +416,14 @@ static struct scsi_lu *device_lookup(struct target *target, uint64_t lun)
 static void cmd_hlist_insert(struct it_nexus *itn, struct scsi_cmd *cmd)
 {
 	list_add(&cmd->c_hlist, &itn->cmd_list);
+	list_add(&cmd->c_tag_hlist,
+		 &itn->cmd_hash[tgt_hash(cmd->tag, CMD_HASH_BITS)]);
 }
 
 static void cmd_hlist_remove(struct scsi_cmd *cmd)
 {
 	list_del(&cmd->c_hlist);
+	list_del(&cmd->c_tag_hlist);
 }
 
 static void tgt_cmd_queue_init(struct tgt_cmd_queue *q)
@@ -662,6 +697,8 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 			break;
 	}
 	list_add_tail(&lu->device_siblings, &pos->device_siblings);
+	list_add(&lu->device_hlist,
+		 &target->device_hash[tgt_hash(lun, TGT_HASH_BITS)]);
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
 		itn_lu = zalloc(sizeof(*itn_lu));
@@ -687,8 +724,7 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		list_add_tail(&itn_lu->lu_itl_info_siblings,
 			      &lu->lu_itl_info_list);
 
-		list_add(&itn_lu->itn_itl_info_siblings,
-			 &itn->itn_itl_info_list);
+		it_nexus_add_lu_info(itn, itn_lu);
 	}
 
 	if (backing && !path)
@@ -755,7 +791,10 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 			if (itn_lu->lu == lu) {
 				ua_sense_pending_del(itn_lu);
 
+				if (itn->last_itn_lu == itn_lu)
+					itn->last_itn_lu = NULL;
 				list_del(&itn_lu->itn_itl_info_siblings);
+				list_del(&itn_lu->itn_itl_info_hlist);
 				list_del(&itn_lu->lu_itl_info_siblings);
 				free(itn_lu);
 				break;
@@ -764,6 +803,7 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 	}
 
 	list_del(&lu->device_siblings);
+	list_del(&lu->device_hlist);
 
 	list_for_each_entry_safe(reg, reg_next, &lu->registration_list,
 				 registration_siblings) {
@@ -1096,12 +1136,18 @@ static void cmd_post_perform(struct tgt_cmd_queue *q, struct scsi_cmd *cmd)
 static struct it_nexus_lu_info *it_nexus_lu_info_lookup(struct it_nexus *itn,
 							uint64_t lun)
 {
-	struct it_nexus_lu_info *itn_lu;
+	struct it_nexus_lu_info *itn_lu = itn->last_itn_lu;
+
+	if (itn_lu && itn_lu->lu->lun == lun)
+		return itn_lu;
 
-	list_for_each_entry(itn_lu, &itn->itn_itl_info_list,
-			    itn_itl_info_siblings) {
-		if (itn_lu->lu->lun == lun)
+	list_for_each_entry(itn_lu,
+		&itn->itn_itl_info_hash[tgt_hash(lun, ITL_HASH_BITS)],
+		itn_itl_info_hlist) {
+		if (itn_lu->lu->lun == lun) {
+			itn->last_itn_lu = itn_lu;
 			return itn_lu;
+		}
 	}
 	return NULL;
 }
@@ -1142,6 +1188,8 @@ int target_cmd_queue(int tid, struct scsi_cmd *cmd)
 	scsi_set_in_transfer_len(cmd, scsi_get_in_length(cmd));
 	scsi_set_out_resid(cmd, 0);
 	scsi_set_out_transfer_len(cmd, scsi_get_out_length(cmd));
+	cmd->in_ready = 0;
+	cmd->bs_ready_queued = 0;
 
 	/*
 	 * Call struct scsi_lu->cmd_perform() that will either be setup for
@@ -1179,6 +1227,8 @@ int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 		if (!cmd_async(cmd))
 			target_cmd_io_done(cmd, result);
 	} else {
+		/* it runs later on its own, not as part of this batch */
+		clear_cmd_not_last(cmd);
 		set_cmd_queued(cmd);
 		dprintf("blocked %" PRIx64 " %x %" PRIu64 " %d\n",
 			cmd->tag, cmd->scb[0], cmd->dev->lun, q->active_cmd);
@@ -1238,6 +1288,19 @@ void target_cmd_io_done(struct scsi_cmd *cmd, int result)
 	return;
 }
 
+/*
+ * Partial completion of a TGT_CMD_STREAM command: the first
+ * scsi_get_in_ready() bytes of the in buffer are valid and the
+ * transport may start sending them. target_cmd_io_done() follows.
+ */
+void target_cmd_data_ready(struct scsi_cmd *cmd)
+{
+	int lid = cmd->c_target->lid;
+
+	if (tgt_drivers[lid]->cmd_data_ready)
+		tgt_drivers[lid]->cmd_data_ready(cmd->cmd_itn_id, cmd);
+}
+
 static void post_cmd_done(struct tgt_cmd_queue *q)
 {
 	struct scsi_cmd *cmd, *tmp;
@@ -1246,13 +1309,8 @@ static void post_cmd_done(struct tgt_cmd_queue *q)
 	list_for_each_entry_safe(cmd, tmp, &q->queue, qlist) {
 		enabled = cmd_enabled(q, cmd);
 		if (enabled) {
-			int tid = cmd->c_target->tid;
-			uint64_t itn_id = cmd->cmd_itn_id;
-			struct it_nexus *nexus;
-
-			nexus = it_nexus_lookup(tid, itn_id);
-			if (!nexus)
-				eprintf("BUG: %" PRIu64 "\n", itn_id);
+			/* resolved by target_cmd_queue() */
+			struct it_nexus *nexus = cmd->it_nexus;
 
 			list_del(&cmd->qlist);
 			dprintf("perform %" PRIx64 " %x\n", cmd->tag,
@@ -1348,17 +1406,46 @@ static int abort_task_set(struct mgmt_req *mreq, struct target *target,
 
 	eprintf("found %" PRIx64 " %d\n", tag, all);
 
-	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
-		list_for_each_entry_safe(cmd, tmp, &itn->cmd_list, c_hlist) {
-			if ((all && itn->itn_id == itn_id) ||
-			    (cmd->tag == tag && itn->itn_id == itn_id) ||
-			    (lun && !memcmp(cmd->lun, lun, sizeof(cmd->lun)))) {
+	/* a LU reset aborts the commands of every nexus */
+	if (lun) {
+		list_for_each_entry(itn, &target->it_nexus_list,
+				    nexus_siblings) {
+			list_for_each_entry_safe(cmd, tmp, &itn->cmd_list,
+						 c_hlist) {
+				if (memcmp(cmd->lun, lun, sizeof(cmd->lun)))
+					continue;
 				err = abort_cmd(target, mreq, cmd);
 				if (err)
 					mreq->busy++;
 				count++;
 			}
 		}
+		return count;
+	}
+
+	itn = it_nexus_lookup(target->tid, itn_id);
+	if (!itn)
+		return 0;
+
+	if (all) {
+		list_for_each_entry_safe(cmd, tmp, &itn->cmd_list, c_hlist) {
+			err = abort_cmd(target, mreq, cmd);
+			if (err)
+				mreq->busy++;
+			count++;
+		}
+		return count;
+	}
+
+	list_for_each_entry_safe(cmd, tmp,
+				 &itn->cmd_hash[tgt_hash(tag, CMD_HASH_BITS)],
+				 c_tag_hlist) {
+		if (cmd->tag != tag)
+			continue;
+		err = abort_cmd(target, mreq, cmd);
+		if (err)
+			mreq->busy++;
+		count++;
 	}
 	return count;
 }
@@ -2026,7 +2113,7 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 			 target_state_name(target->target_state));
 
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi"))
-			iscsi_print_nop_settings(b, target->tid);
+			iscsi_print_target_settings(b, target->tid);
 
 		concat_printf(b, _TAB1 "I_T nexus information:\n");
 
@@ -2040,7 +2127,7 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 		}
 
 		concat_printf(b, _TAB1 "LUN information:\n");
-		list_for_each_entry(lu, &target->device_list, device_siblings)
+		list_for_each_entry(lu, &target->device_list, device_siblings) {
 			concat_printf(b,
 				_TAB2 "LUN: %" PRIu64 "\n"
 				_TAB3 "Type: %s\n"
@@ -2075,6 +2162,10 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 					open_flags_to_str(strflags,
 							  lu->bsoflags));
 
+			if (lu->bst && lu->bst->bs_show)
+				lu->bst->bs_show(lu, b);
+		}
+
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi") ||
 		    !strcmp(tgt_drivers[target->lid]->name, "iser")) {
 			int i, aid;
@@ -2123,6 +2214,7 @@ tgtadm_err tgt_target_create(int lld, int tid, char *args)
 	struct target *target, *pos;
 	char *p, *q, *targetname = NULL;
 	struct backingstore_template *bst;
+	int i;
 
 	p = args;
 	while ((q = strsep(&p, ","))) {
@@ -2185,6 +2277,8 @@ tgtadm_err tgt_target_create(int lld, int tid, char *args)
 	target->tid = tid;
 
 	INIT_LIST_HEAD(&target->device_list);
+	for (i = 0; i < TGT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&target->device_hash[i]);
 
 	target->bst = bst;
 
@@ -2196,10 +2290,14 @@ tgtadm_err tgt_target_create(int lld, int tid, char *args)
 			break;
 
 	list_add_tail(&target->target_siblings, &pos->target_siblings);
+	list_add(&target->target_hlist,
+		 &target_hash[tgt_hash(tid, TGT_HASH_BITS)]);
 
 	INIT_LIST_HEAD(&target->acl_list);
 	INIT_LIST_HEAD(&target->iqn_acl_list);
 	INIT_LIST_HEAD(&target->it_nexus_list);
+	for (i = 0; i < TGT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&target->it_nexus_hash[i]);
 
 	tgt_device_create(tid, TYPE_RAID, 0, NULL, 0);
 
@@ -2243,6 +2341,7 @@ tgtadm_err tgt_target_destroy(int lld_no, int tid, int force)
 		tgt_drivers[lld_no]->target_destroy(tid, force);
 
 	list_del(&target->target_siblings);
+	list_del(&target->target_hlist);
 
 	list_for_each_entry_safe(acl, tmp, &target->acl_list, aclent_list) {
 		list_del(&acl->aclent_list);
@@ -2316,6 +2415,31 @@ tgtadm_err tgt_portal_destroy(int lld, char *args)
 	return TGTADM_SUCCESS;
 }
 
+tgtadm_err tgt_portal_update(int lld, char *args)
+{
+	char *portals = NULL;
+
+	portals = strstr(args, "portal=");
+	if (!portals) {
+		eprintf("invalid option when updating portals: %s\n", args);
+		return TGTADM_INVALID_REQUEST;
+	}
+
+	if (tgt_drivers[lld]->portal_update) {
+		if (tgt_drivers[lld]->portal_update(portals)) {
+			eprintf("failed to update portal %s\n", portals);
+			return TGTADM_INVALID_REQUEST;
+		}
+	} else {
+		eprintf("can not update portals for for this lld type\n");
+		return TGTADM_INVALID_REQUEST;
+	}
+
+	dprintf("succeed to update portals %s\n", portals);
+
+	return TGTADM_SUCCESS;
+}
+
 tgtadm_err account_show(struct concat_buf *b)
 {
 	struct account_entry *ac;
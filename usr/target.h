@@ -3,6 +3,18 @@
 
 #include <limits.h>
 
+#define TGT_HASH_BITS	8
+#define TGT_HASH_SIZE	(1 << TGT_HASH_BITS)
+#define ITL_HASH_BITS	6
+#define ITL_HASH_SIZE	(1 << ITL_HASH_BITS)
+#define CMD_HASH_BITS	8
+#define CMD_HASH_SIZE	(1 << CMD_HASH_BITS)
+
+static inline unsigned int tgt_hash(uint64_t key, int bits)
+{
+	return (key * 0x9e37fffffffc0001ULL) >> (64 - bits);
+}
+
 struct acl_entry {
 	char *address;
 	struct list_head aclent_list;
@@ -29,10 +41,15 @@ struct target {
 	enum scsi_target_state target_state;
 
 	struct list_head target_siblings;
+	struct list_head target_hlist;
 
 	struct list_head device_list;
+	/* device_list hashed by lun */
+	struct list_head device_hash[TGT_HASH_SIZE];
 
 	struct list_head it_nexus_list;
+	/* it_nexus_list hashed by itn_id */
+	struct list_head it_nexus_hash[TGT_HASH_SIZE];
 
 	struct backingstore_template *bst;
 
@@ -50,16 +67,23 @@ struct it_nexus {
 	long ctime;
 
 	struct list_head cmd_list;
+	/* cmd_list hashed by tag */
+	struct list_head cmd_hash[CMD_HASH_SIZE];
 
 	struct target *nexus_target;
 
 	/* the list of i_t_nexus belonging to a target */
 	struct list_head nexus_siblings;
+	struct list_head nexus_hlist;
 
 	/* dirty hack for IBMVIO */
 	int host_no;
 
 	struct list_head itn_itl_info_list;
+	/* itn_itl_info_list hashed by lun */
+	struct list_head itn_itl_info_hash[ITL_HASH_SIZE];
+	/* the last one looked up, most initiators stick to a few LUNs */
+	struct it_nexus_lu_info *last_itn_lu;
 
 	/* only used for show operation */
 	char *info;
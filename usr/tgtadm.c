@@ -888,6 +888,7 @@ int main(int argc, char **argv)
 			}
 			break;
 		case OP_DELETE:
+		case OP_UPDATE:
 			rc = verify_mode_params(argc, argv, "LmoCP");
 			if (rc) {
 				eprintf("portal mode: option '-%c' is not "
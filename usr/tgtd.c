@@ -25,12 +25,14 @@
 #include <inttypes.h>
 #include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
@@ -46,22 +48,59 @@
 unsigned long pagesize, pageshift;
 
 int system_active = 1;
-static int ep_fd;
 static char program_name[] = "tgtd";
-static LIST_HEAD(tgt_events_list);
-static LIST_HEAD(tgt_sched_events_list);
+
+/*
+ * Each reactor owns an epoll instance and its own scheduled events.
+ * Reactor 0 runs in the main thread and serves everything registered
+ * with tgt_event_add(): the mgmt socket, the work timer, backing store
+ * completions and the iSCSI listeners.  Connections are spread over all
+ * the reactors with tgt_event_add_sharded(), or put on a given one with
+ * tgt_event_add_on().
+ *
+ * tgt_event_lock guards what the reactors share: targets, sessions,
+ * LUs, the backing stores, the pools and every reactor's event lists.
+ * A reactor takes it to run its handlers, but a reactor owns the
+ * connections put on it and their handlers drop it around the socket
+ * I/O and digests, see tgt_event_unlock().  Anything another reactor
+ * wants done on a connection, such as sending a completed command, is
+ * scheduled on the reactor owning it with tgt_add_sched_event_on(),
+ * which wakes that one up.
+ */
+struct tgt_reactor {
+	int idx;
+	int ep_fd;
+	int wake_fd[2];
+	int nr_sharded;
+	int need_refresh;
+	/* blocked in epoll_wait(), to be woken up for scheduled events */
+	int waiting;
+	/* the CPU the thread is pinned to, or -1 */
+	int cpu;
+	/* epoll_wait() calls so far */
+	unsigned int nr_passes;
+	pthread_t thread;
+	struct list_head events_list;
+	struct list_head sched_events_list;
+};
+
+int nr_reactors = 1;
+static struct tgt_reactor *reactors;
+static __thread struct tgt_reactor *cur_reactor;
+static pthread_mutex_t tgt_event_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static struct option const long_options[] = {
 	{"foreground", no_argument, 0, 'f'},
 	{"control-port", required_argument, 0, 'C'},
 	{"nr_iothreads", required_argument, 0, 't'},
+	{"nr_reactors", required_argument, 0, 'R'},
 	{"debug", required_argument, 0, 'd'},
 	{"version", no_argument, 0, 'V'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
 
-static char *short_options = "fC:d:t:Vh";
+static char *short_options = "fC:d:t:R:Vh";
 static char *spare_args;
 
 static void usage(int status)
@@ -76,7 +115,8 @@ static void usage(int status)
 		"Usage: %s [OPTION]\n"
 		"-f, --foreground        make the program run in the foreground\n"
 		"-C, --control-port NNNN use port NNNN for the mgmt channel\n"
-		"-t, --nr_iothreads NNNN specify the number of I/O threads\n"
+		"-t, --nr_iothreads NNNN specify the number of shared I/O threads\n"
+		"-R, --nr_reactors NNNN  specify the number of event loop threads\n"
 		"-d, --debug debuglevel  print debugging information\n"
 		"-V, --version           print version and exit\n"
 		"-h, --help              display this help and exit\n",
@@ -174,7 +214,8 @@ set_rlimit:
 	return 0;
 }
 
-int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+static int __tgt_event_add(struct tgt_reactor *r, int fd, int events,
+			   event_handler_t handler, void *data, int sharded)
 {
 	struct epoll_event ev;
 	struct event_data *tev;
@@ -184,6 +225,8 @@ int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
 	if (!tev)
 		return -ENOMEM;
 
+	tev->reactor = r;
+	tev->sharded = sharded;
 	tev->data = data;
 	tev->handler = handler;
 	tev->fd = fd;
@@ -191,32 +234,80 @@ int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = tev;
-	err = epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+	err = epoll_ctl(r->ep_fd, EPOLL_CTL_ADD, fd, &ev);
 	if (err) {
 		eprintf("Cannot add fd, %m\n");
 		free(tev);
-	} else
-		list_add(&tev->e_list, &tgt_events_list);
+	} else {
+		list_add(&tev->e_list, &r->events_list);
+		if (sharded)
+			r->nr_sharded++;
+	}
+
+	return err;
+}
+
+int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+{
+	return __tgt_event_add(&reactors[0], fd, events, handler, data, 0);
+}
+
+/* put the fd on reactor idx */
+int tgt_event_add_on(int idx, int fd, int events, event_handler_t handler,
+		     void *data, int sharded)
+{
+	int err;
+
+	err = __tgt_event_add(&reactors[idx], fd, events, handler, data,
+			      sharded);
+	if (!err)
+		dprintf("fd %d on reactor %d\n", fd, idx);
 
 	return err;
 }
 
+/* the reactor serving the fewest sharded fds */
+int tgt_reactor_least_loaded(void)
+{
+	static int next;
+	struct tgt_reactor *r, *best = NULL;
+	int i;
+
+	for (i = 0; i < nr_reactors; i++) {
+		r = &reactors[(next + i) % nr_reactors];
+		if (!best || r->nr_sharded < best->nr_sharded)
+			best = r;
+	}
+	next = (best->idx + 1) % nr_reactors;
+
+	return best->idx;
+}
+
+int tgt_event_add_sharded(int fd, int events, event_handler_t handler,
+			  void *data)
+{
+	return tgt_event_add_on(tgt_reactor_least_loaded(), fd, events,
+				handler, data, 1);
+}
+
 static struct event_data *tgt_event_lookup(int fd)
 {
 	struct event_data *tev;
+	int i;
 
-	list_for_each_entry(tev, &tgt_events_list, e_list) {
-		if (tev->fd == fd)
-			return tev;
+	for (i = 0; i < nr_reactors; i++) {
+		list_for_each_entry(tev, &reactors[i].events_list, e_list) {
+			if (tev->fd == fd)
+				return tev;
+		}
 	}
 	return NULL;
 }
 
-static int event_need_refresh;
-
 void tgt_event_del(int fd)
 {
 	struct event_data *tev;
+	struct tgt_reactor *r;
 	int ret;
 
 	tev = tgt_event_lookup(fd);
@@ -224,15 +315,18 @@ void tgt_event_del(int fd)
 		eprintf("Cannot find event %d\n", fd);
 		return;
 	}
+	r = tev->reactor;
 
-	ret = epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, NULL);
+	ret = epoll_ctl(r->ep_fd, EPOLL_CTL_DEL, fd, NULL);
 	if (ret < 0)
 		eprintf("fail to remove epoll event, %s\n", strerror(errno));
 
+	if (tev->sharded)
+		r->nr_sharded--;
 	list_del(&tev->e_list);
 	free(tev);
 
-	event_need_refresh = 1;
+	r->need_refresh = 1;
 }
 
 int tgt_event_modify(int fd, int events)
@@ -250,7 +344,39 @@ int tgt_event_modify(int fd, int events)
 	ev.events = events;
 	ev.data.ptr = tev;
 
-	return epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &ev);
+	return epoll_ctl(tev->reactor->ep_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * Counts the epoll_wait() calls of the reactor running the handler. A
+ * level-triggered fd that is still ready is reported again in the
+ * next pass.
+ */
+unsigned int tgt_event_pass(void)
+{
+	return cur_reactor->nr_passes;
+}
+
+/* the reactor running the handler, its scheduled events run there */
+int tgt_event_reactor_idx(void)
+{
+	return cur_reactor->idx;
+}
+
+/*
+ * Pin the thread of reactor idx to cpu once the reactors start. The
+ * main thread, reactor 0, is never pinned, the backing store threads
+ * it starts would inherit the mask.
+ */
+void tgt_reactor_set_cpu(int idx, int cpu)
+{
+	reactors[idx].cpu = cpu;
+}
+
+/* the cpu reactor idx is pinned to, or -1 */
+int tgt_reactor_cpu(int idx)
+{
+	return reactors[idx].cpu;
 }
 
 void tgt_init_sched_event(struct event_data *evt,
@@ -262,14 +388,37 @@ void tgt_init_sched_event(struct event_data *evt,
 	INIT_LIST_HEAD(&evt->e_list);
 }
 
-void tgt_add_sched_event(struct event_data *evt)
+static void reactor_wake(struct tgt_reactor *r)
+{
+	int ret;
+
+	do {
+		ret = write(r->wake_fd[1], "", 1);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/* run evt on reactor idx, the one owning what evt works on */
+void tgt_add_sched_event_on(int idx, struct event_data *evt)
 {
-	if (!evt->scheduled) {
-		evt->scheduled = 1;
-		list_add_tail(&evt->e_list, &tgt_sched_events_list);
+	struct tgt_reactor *r = &reactors[idx];
+
+	if (evt->scheduled)
+		return;
+
+	evt->scheduled = 1;
+	list_add_tail(&evt->e_list, &r->sched_events_list);
+
+	if (r->waiting) {
+		r->waiting = 0;
+		reactor_wake(r);
 	}
 }
 
+void tgt_add_sched_event(struct event_data *evt)
+{
+	tgt_add_sched_event_on(cur_reactor ? cur_reactor->idx : 0, evt);
+}
+
 void tgt_remove_sched_event(struct event_data *evt)
 {
 	if (evt->scheduled) {
@@ -298,148 +447,402 @@ void str_spacecpy(char **dest, const char *src)
 	*d = '\0';
 }
 
-int call_program(const char *cmd, void (*callback)(void *data, int result),
-		void *data, char *output, int op_len, int flags)
-{
+/*
+ * Programs run by call_program() are spawned without blocking the
+ * event loop.  Their stdout is read from a non-blocking pipe and the
+ * callback gets the length of the output, or -1 if the program could
+ * not be run or did not exit in time.  Only a few run at once, the
+ * rest wait for a free slot.
+ */
+#define PROGRAM_MAX_RUNNING	16
+#define PROGRAM_TIMEOUT_MSECS	1000
+#define PROGRAM_REAP_MSECS	100
+
+struct program_call {
+	struct list_head list;
+	char *cmd;
 	pid_t pid;
+	int fd;
+	char *output;
+	int op_len;
+	int len;
+	int reap_tries;
+	void (*callback)(void *data, int result);
+	void *data;
+	struct tgt_work work;
+};
+
+static LIST_HEAD(program_wait_list);
+static int nr_programs_running;
+
+static void program_start_next(void);
+
+static void program_reap(void *data)
+{
+	struct program_call *call = data;
+	int ret, status;
+
+	do {
+		ret = waitpid(call->pid, &status, WNOHANG);
+	} while (ret < 0 && errno == EINTR);
+
+	if (!ret) {
+		/* closed its stdout, but has not exited yet */
+		if (++call->reap_tries == PROGRAM_TIMEOUT_MSECS /
+		    PROGRAM_REAP_MSECS)
+			kill(call->pid, SIGKILL);
+		add_work_msecs(&call->work, PROGRAM_REAP_MSECS);
+		return;
+	}
+	if (ret < 0)
+		eprintf("waitpid failed for: %s, %m\n", call->cmd);
+
+	free(call->cmd);
+	free(call);
+}
+
+static void program_done(struct program_call *call, int result)
+{
+	tgt_event_del(call->fd);
+	close(call->fd);
+	del_work(&call->work);
+
+	nr_programs_running--;
+	program_start_next();
+
+	if (call->callback)
+		call->callback(call->data, result);
+
+	call->work.func = program_reap;
+	program_reap(call);
+}
+
+static void program_timeout(void *data)
+{
+	struct program_call *call = data;
+
+	eprintf("timeout on %s, terminating child pid %d\n", call->cmd,
+		call->pid);
+	kill(call->pid, SIGTERM);
+	program_done(call, -1);
+}
+
+static void program_output_handler(int fd, int events, void *data)
+{
+	struct program_call *call = data;
+	int ret;
+
+	do {
+		ret = read(fd, call->output + call->len,
+			   call->op_len - call->len);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return;
+		eprintf("failed to get output from: %s, %m\n", call->cmd);
+		program_done(call, -1);
+		return;
+	}
+
+	call->len += ret;
+	if (!ret || call->len == call->op_len)
+		program_done(call, call->len);
+}
+
+static int program_spawn(struct program_call *call)
+{
+	posix_spawn_file_actions_t actions;
 	int fds[2], ret, i;
 	char *pos, arg[256];
 	char *argv[sizeof(arg) / 2];
 
 	i = 0;
 	pos = arg;
-	str_spacecpy(&pos, cmd);
-	if (strchr(cmd, ' ')) {
+	str_spacecpy(&pos, call->cmd);
+	if (strchr(call->cmd, ' ')) {
 		while (pos != '\0')
 			argv[i++] = strsep(&pos, " ");
 	} else
 		argv[i++] = arg;
 	argv[i] =  NULL;
 
-	ret = pipe(fds);
+	/* close-on-exec, so that no other child holds the write end */
+	ret = pipe2(fds, O_CLOEXEC);
 	if (ret < 0) {
-		eprintf("pipe create failed for %s, %m\n", cmd);
+		eprintf("pipe create failed for %s, %m\n", call->cmd);
 		return ret;
 	}
 
-	dprintf("%s, pipe: %d %d\n", cmd, fds[0], fds[1]);
+	dprintf("%s, pipe: %d %d\n", call->cmd, fds[0], fds[1]);
 
-	pid = fork();
-	if (pid < 0) {
-		eprintf("fork failed for: %s, %m\n", cmd);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+	ret = posix_spawn(&call->pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+	if (ret) {
+		errno = ret;
+		eprintf("spawn failed for: %s, %m\n", call->cmd);
 		close(fds[0]);
-		close(fds[1]);
-		return pid;
+		return -1;
 	}
 
-	if (!pid) {
-		close(1);
-		ret = dup(fds[1]);
-		if (ret < 0) {
-			eprintf("dup failed for: %s, %m\n", cmd);
-			exit(-1);
-		}
-		close(fds[0]);
-		execv(argv[0], argv);
+	call->fd = fds[0];
+	fcntl(call->fd, F_SETFL, O_NONBLOCK);
+	ret = tgt_event_add(call->fd, EPOLLIN, program_output_handler, call);
+	if (ret) {
+		kill(call->pid, SIGTERM);
+		close(call->fd);
+		call->work.func = program_reap;
+		program_reap(call);
+		return 0;
+	}
 
-		eprintf("execv failed for: %s, %m\n", cmd);
-		exit(-1);
-	} else {
-		struct timeval tv;
-		fd_set rfds;
-		int ret_sel;
-
-		close(fds[1]);
-		/* 0.1 second is okay, as the initiator will retry anyway */
-		do {
-			FD_ZERO(&rfds);
-			FD_SET(fds[0], &rfds);
-			tv.tv_sec = 0;
-			tv.tv_usec = 100000;
-			ret_sel = select(fds[0]+1, &rfds, NULL, NULL, &tv);
-		} while (ret_sel < 0 && errno == EINTR);
-		if (ret_sel <= 0) { /* error or timeout */
-			eprintf("timeout on redirect callback, terminating "
-				"child pid %d\n", pid);
-			kill(pid, SIGTERM);
-		}
-		do {
-			ret = waitpid(pid, &i, 0);
-		} while (ret < 0 && errno == EINTR);
-		if (ret < 0) {
-			eprintf("waitpid failed for: %s, %m\n", cmd);
-			close(fds[0]);
-			return ret;
-		}
-		if (ret_sel > 0) {
-			ret = read(fds[0], output, op_len);
+	call->work.func = program_timeout;
+	add_work_msecs(&call->work, PROGRAM_TIMEOUT_MSECS);
+	nr_programs_running++;
+	return 1;
+}
+
+static void program_start_next(void)
+{
+	struct program_call *call;
+	int ret;
+
+	while (nr_programs_running < PROGRAM_MAX_RUNNING &&
+	       !list_empty(&program_wait_list)) {
+		call = list_first_entry(&program_wait_list,
+					struct program_call, list);
+		list_del(&call->list);
+
+		ret = program_spawn(call);
+		if (ret <= 0) {
+			if (call->callback)
+				call->callback(call->data, -1);
 			if (ret < 0) {
-				eprintf("failed to get output from: %s\n", cmd);
-				close(fds[0]);
-				return ret;
+				free(call->cmd);
+				free(call);
 			}
 		}
+	}
+}
 
-		if (callback)
-			callback(data, WEXITSTATUS(i));
-		close(fds[0]);
+/*
+ * Runs cmd and calls back with the first op_len bytes of its output in
+ * output, which has to stay around until then.  The callback may be
+ * called before this returns.
+ */
+int call_program(const char *cmd, void (*callback)(void *data, int result),
+		void *data, char *output, int op_len, int flags)
+{
+	struct program_call *call;
+
+	call = zalloc(sizeof(*call));
+	if (!call)
+		return -ENOMEM;
+
+	call->cmd = strdup(cmd);
+	if (!call->cmd) {
+		free(call);
+		return -ENOMEM;
 	}
+	call->output = output;
+	call->op_len = op_len;
+	call->callback = callback;
+	call->data = data;
+	call->fd = -1;
+	INIT_LIST_HEAD(&call->work.entry);
+	call->work.data = call;
+
+	list_add_tail(&call->list, &program_wait_list);
+	program_start_next();
 
 	return 0;
 }
 
-static int tgt_exec_scheduled(void)
+/*
+ * Execute only work scheduled till now.  A handler may drop the lock,
+ * so the events are taken off one by one; others may be removed from
+ * the batch meanwhile.
+ */
+static int tgt_exec_scheduled(struct tgt_reactor *r)
 {
-	struct list_head *last_sched;
-	struct event_data *tev, *tevn;
-	int work_remains = 0;
+	LIST_HEAD(batch);
+	struct event_data *tev;
 
-	if (!list_empty(&tgt_sched_events_list)) {
-		/* execute only work scheduled till now */
-		last_sched = tgt_sched_events_list.prev;
-		list_for_each_entry_safe(tev, tevn, &tgt_sched_events_list,
-					 e_list) {
-			tgt_remove_sched_event(tev);
-			tev->sched_handler(tev);
-			if (&tev->e_list == last_sched)
-				break;
-		}
-		if (!list_empty(&tgt_sched_events_list))
-			work_remains = 1;
+	list_splice_init(&r->sched_events_list, &batch);
+	while (!list_empty(&batch)) {
+		tev = list_first_entry(&batch, struct event_data, e_list);
+		tgt_remove_sched_event(tev);
+		tev->sched_handler(tev);
 	}
-	return work_remains;
+
+	return !list_empty(&r->sched_events_list);
+}
+
+/*
+ * For a handler of a connection owned by the reactor running it, to
+ * work on what no other reactor touches.  Everything else waits for
+ * tgt_event_lock() again.
+ */
+void tgt_event_unlock(void)
+{
+	pthread_mutex_unlock(&tgt_event_mutex);
+}
+
+void tgt_event_lock(void)
+{
+	pthread_mutex_lock(&tgt_event_mutex);
 }
 
-static void event_loop(void)
+static void event_loop(struct tgt_reactor *r)
 {
-	int nevent, i, sched_remains, timeout;
+	int nevent, i, sched_remains, timeout, err;
 	struct epoll_event events[1024];
 	struct event_data *tev;
 
+	cur_reactor = r;
+	tgt_event_lock();
 retry:
-	sched_remains = tgt_exec_scheduled();
+	sched_remains = tgt_exec_scheduled(r);
 	timeout = sched_remains ? 0 : -1;
 
-	nevent = epoll_wait(ep_fd, events, ARRAY_SIZE(events), timeout);
+	r->need_refresh = 0;
+	r->waiting = !sched_remains;
+	tgt_event_unlock();
+
+	nevent = epoll_wait(r->ep_fd, events, ARRAY_SIZE(events), timeout);
+	err = errno;
+
+	tgt_event_lock();
+	r->waiting = 0;
+	r->nr_passes++;
 	if (nevent < 0) {
-		if (errno != EINTR) {
-			eprintf("%m\n");
+		if (err != EINTR) {
+			eprintf("%s\n", strerror(err));
 			exit(1);
 		}
 	} else if (nevent) {
 		for (i = 0; i < nevent; i++) {
-			tev = (struct event_data *) events[i].data.ptr;
-			tev->handler(tev->fd, events[i].events, tev->data);
-
-			if (event_need_refresh) {
-				event_need_refresh = 0;
+			/*
+			 * Any reactor may have deleted one of our events
+			 * while we were waiting or in the previous handler.
+			 */
+			if (r->need_refresh) {
+				r->need_refresh = 0;
 				goto retry;
 			}
+
+			tev = (struct event_data *) events[i].data.ptr;
+			tev->handler(tev->fd, events[i].events, tev->data);
 		}
 	}
 
 	if (system_active)
 		goto retry;
+	tgt_event_unlock();
+}
+
+static void reactor_wake_handler(int fd, int events, void *data)
+{
+	char buf[64];
+	int ret;
+
+	do {
+		ret = read(fd, buf, sizeof(buf));
+	} while (ret < 0 && errno == EINTR);
+}
+
+static void reactor_pin(struct tgt_reactor *r)
+{
+	cpu_set_t set;
+	int err;
+
+	if (r->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(r->cpu, &set);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		eprintf("can't pin reactor %d to cpu %d, %s\n", r->idx, r->cpu,
+			strerror(err));
+}
+
+static void *reactor_thread_fn(void *arg)
+{
+	reactor_pin(arg);
+	event_loop(arg);
+	return NULL;
+}
+
+static int reactors_init(void)
+{
+	struct tgt_reactor *r;
+	int i, err;
+
+	reactors = zalloc(nr_reactors * sizeof(*reactors));
+	if (!reactors)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_reactors; i++) {
+		r = &reactors[i];
+		r->idx = i;
+		r->cpu = -1;
+		INIT_LIST_HEAD(&r->events_list);
+		INIT_LIST_HEAD(&r->sched_events_list);
+
+		r->ep_fd = epoll_create(4096);
+		if (r->ep_fd < 0) {
+			fprintf(stderr, "can't create epoll fd, %m\n");
+			return -errno;
+		}
+
+		err = pipe(r->wake_fd);
+		if (err) {
+			fprintf(stderr, "can't create reactor pipe, %m\n");
+			return -errno;
+		}
+		set_non_blocking(r->wake_fd[0]);
+		set_non_blocking(r->wake_fd[1]);
+
+		err = __tgt_event_add(r, r->wake_fd[0], EPOLLIN,
+				      reactor_wake_handler, r, 0);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* reactor 0 is run by the caller */
+static int reactors_start(void)
+{
+	int i, err;
+
+	for (i = 1; i < nr_reactors; i++) {
+		err = pthread_create(&reactors[i].thread, NULL,
+				     reactor_thread_fn, &reactors[i]);
+		if (err) {
+			eprintf("can't create reactor thread %d, %s\n", i,
+				strerror(err));
+			return -err;
+		}
+	}
+	return 0;
+}
+
+static void reactors_stop(void)
+{
+	int i;
+
+	for (i = 1; i < nr_reactors; i++) {
+		if (!reactors[i].thread)
+			continue;
+
+		reactor_wake(&reactors[i]);
+		pthread_join(reactors[i].thread, NULL);
+	}
 }
 
 int lld_init_one(int lld_index)
@@ -555,6 +958,11 @@ int main(int argc, char **argv)
 			if (ret)
 				bad_optarg(ret, ch, optarg);
 			break;
+		case 'R':
+			ret = str_to_int_range(optarg, nr_reactors, 1, 256);
+			if (ret)
+				bad_optarg(ret, ch, optarg);
+			break;
 		case 'd':
 			ret = str_to_int_range(optarg, is_debug, 0, 1);
 			if (ret)
@@ -578,11 +986,9 @@ int main(int argc, char **argv)
 		}
 	}
 
-	ep_fd = epoll_create(4096);
-	if (ep_fd < 0) {
-		fprintf(stderr, "can't create epoll fd, %m\n");
+	err = reactors_init();
+	if (err)
 		exit(1);
-	}
 
 	spare_args = optind < argc ? argv[optind] : NULL;
 
@@ -621,7 +1027,13 @@ int main(int argc, char **argv)
 	sd_notify(0, "READY=1\nSTATUS=Starting event loop...");
 #endif
 
-	event_loop();
+	err = reactors_start();
+	if (err)
+		exit(1);
+
+	event_loop(&reactors[0]);
+
+	reactors_stop();
 
 	lld_exit();
 
@@ -124,6 +124,7 @@ struct it_nexus_lu_info {
 	uint64_t itn_id;
 	struct lu_stat stat;
 	struct list_head itn_itl_info_siblings;
+	struct list_head itn_itl_info_hlist;
 	struct list_head lu_itl_info_siblings;
 	struct list_head pending_ua_sense_list;
 	int prevent; /* prevent removal on this itl nexus ? */
@@ -170,6 +171,9 @@ struct backingstore_template {
 	tgtadm_err (*bs_init)(struct scsi_lu *dev, char *bsopts);
 	void (*bs_exit)(struct scsi_lu *dev);
 	int (*bs_cmd_submit)(struct scsi_cmd *cmd);
+	/* submit the commands held back by not_last */
+	void (*bs_flush)(void);
+	void (*bs_show)(struct scsi_lu *dev, struct concat_buf *b);
 	int bs_oflags_supported;
 	unsigned long bs_supported_ops[NR_SCSI_OPCODES / __WORDSIZE];
 
@@ -205,6 +209,7 @@ struct scsi_lu {
 
 	/* the list of devices belonging to a target */
 	struct list_head device_siblings;
+	struct list_head device_hlist;
 
 	struct list_head lu_itl_info_list;
 
@@ -261,6 +266,7 @@ enum mgmt_req_result {
 extern int system_active;
 extern int is_debug;
 extern int nr_iothreads;
+extern int nr_reactors;
 extern struct list_head bst_list;
 
 extern int ipc_init(void);
@@ -285,6 +291,7 @@ int is_system_inactive(void);
 
 extern tgtadm_err tgt_portal_create(int lld, char *args);
 extern tgtadm_err tgt_portal_destroy(int lld, char *args);
+extern tgtadm_err tgt_portal_update(int lld, char *args);
 
 extern tgtadm_err tgt_bind_host_to_target(int tid, int host_no);
 extern tgtadm_err tgt_unbind_host_to_target(int tid, int host_no);
@@ -298,12 +305,24 @@ extern void tgt_init_sched_event(struct event_data *evt,
 typedef void (*event_handler_t)(int fd, int events, void *data);
 
 extern int tgt_event_add(int fd, int events, event_handler_t handler, void *data);
+extern int tgt_event_add_sharded(int fd, int events, event_handler_t handler,
+				 void *data);
+extern int tgt_event_add_on(int idx, int fd, int events,
+			    event_handler_t handler, void *data, int sharded);
+extern int tgt_reactor_least_loaded(void);
+extern void tgt_reactor_set_cpu(int idx, int cpu);
+extern int tgt_reactor_cpu(int idx);
 extern void tgt_event_del(int fd);
 
 extern void tgt_add_sched_event(struct event_data *evt);
+extern void tgt_add_sched_event_on(int idx, struct event_data *evt);
 extern void tgt_remove_sched_event(struct event_data *evt);
 
 extern int tgt_event_modify(int fd, int events);
+extern unsigned int tgt_event_pass(void);
+extern int tgt_event_reactor_idx(void);
+extern void tgt_event_lock(void);
+extern void tgt_event_unlock(void);
 extern int target_cmd_queue(int tid, struct scsi_cmd *cmd);
 extern int target_cmd_perform(int tid, struct scsi_cmd *cmd);
 extern int target_cmd_perform_passthrough(int tid, struct scsi_cmd *cmd);
@@ -317,6 +336,7 @@ extern enum mgmt_req_result target_mgmt_request(int tid, uint64_t itn_id,
 
 extern struct it_nexus *it_nexus_lookup(int tid, uint64_t itn_id);
 extern void target_cmd_io_done(struct scsi_cmd *cmd, int result);
+extern void target_cmd_data_ready(struct scsi_cmd *cmd);
 extern int ua_sense_del(struct scsi_cmd *cmd, int del);
 extern void ua_sense_clear(struct it_nexus_lu_info *itn_lu, uint16_t asc);
 extern void ua_sense_add_other_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
@@ -385,8 +405,13 @@ extern int lld_init_one(int lld_index);
 extern int setup_param(char *name, int (*parser)(char *));
 
 extern int bs_init(void);
+extern void bs_cmd_flush(void);
+
+struct tgt_reactor;
 
 struct event_data {
+	struct tgt_reactor *reactor;
+	int sharded;
 	union {
 		event_handler_t handler;
 		sched_event_handler_t sched_handler;
@@ -1,5 +1,5 @@
 /*
- * work scheduler, loosely timer-based
+ * work scheduler, hierarchical timer wheel with msec resolution
  *
  * Copyright (C) 2006-2007 FUJITA Tomonori <tomof@acm.org>
  * Copyright (C) 2006-2007 Mike Christie <michaelc@cs.wisc.edu>
@@ -20,9 +20,12 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
  * 02110-1301 USA
  */
+#include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
 
@@ -32,116 +35,272 @@
 #include "work.h"
 #include "tgtd.h"
 
-#define WORK_TIMER_INT_MSEC     500
-#define WORK_TIMER_INT_USEC     (WORK_TIMER_INT_MSEC * 1000)
-
-static struct itimerval work_timer = {
-	{0, WORK_TIMER_INT_USEC},
-	{0, WORK_TIMER_INT_USEC}
-};
-
-static unsigned int elapsed_msecs;
-static int timer_pending;
+/*
+ * Works are kept in a timer wheel ticking once per msec: tv1 holds the
+ * works expiring within the next 256 msecs, one slot per msec, and
+ * each of the tvn levels covers 64 times the range of the level below.
+ * A work is moved one level down when the wheel reaches its slot, so
+ * add and delete are O(1) and expiry is O(1) amortized per work.
+ *
+ * The timer is armed for the next slot with something in it rather
+ * than ticking periodically, so an idle wheel does not wake tgtd.
+ */
+#define TVN_BITS	6
+#define TVR_BITS	8
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_LEVELS	4
+
+#define TV_SHIFT(n)	(TVR_BITS + (n) * TVN_BITS)
+#define TV_INDEX(j, n)	(((j) >> TV_SHIFT(n)) & TVN_MASK)
+
+static struct list_head tv1[TVR_SIZE];
+static struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+
+/* the wheel has run everything that expired before this */
+static unsigned int wheel_msecs;
+static unsigned int nr_works;
+
+static int wheel_ready;
+static int timer_started;
+static int timer_armed;
+static unsigned int timer_expires;
 static int timer_fd[2] = {-1, -1};
 
-static LIST_HEAD(active_work_list);
-static LIST_HEAD(inactive_work_list);
-
 static void execute_work(void);
 
-static inline unsigned int timeval_to_msecs(struct timeval t)
+static unsigned int work_now(void)
 {
-	return t.tv_sec * 1000 + t.tv_usec / 1000;
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
 }
 
-static void work_timer_schedule_evt(void)
+static void work_timer_arm(unsigned int expires)
 {
-	unsigned int n = 0;
+	unsigned int now = work_now();
+	unsigned int msecs;
 	int err;
 
-	if (timer_pending || timer_fd[1] < 0)
-		return;
+	msecs = before(now, expires) ? expires - now : 0;
+
+	timer_armed = 1;
+	timer_expires = expires;
+
+	if (timer_fd[1] == -1)
+		err = __timerfd_arm(timer_fd[0], msecs);
+	else {
+		struct itimerval t;
+
+		memset(&t, 0, sizeof(t));
+		t.it_value.tv_sec = msecs / 1000;
+		t.it_value.tv_usec = (msecs % 1000) * 1000;
+		if (!msecs)
+			t.it_value.tv_usec = 1;
+
+		err = setitimer(ITIMER_REAL, &t, NULL);
+	}
+	if (err)
+		eprintf("failed to arm work timer, %m\n");
+}
+
+static void wheel_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&tv1[i]);
+	for (i = 0; i < TVN_LEVELS; i++)
+		for (j = 0; j < TVN_SIZE; j++)
+			INIT_LIST_HEAD(&tvn[i][j]);
+
+	wheel_msecs = work_now();
+	wheel_ready = 1;
+}
 
-	timer_pending = 1;
+static void work_timer_sig_handler(int data)
+{
+	unsigned int n = 0;
+	int err;
 
 	err = write(timer_fd[1], &n, sizeof(n));
 	if (err < 0)
 		eprintf("Failed to write to pipe, %m\n");
 }
 
-static void work_timer_sig_handler(int data)
+static void __add_work(struct tgt_work *work)
 {
-	work_timer_schedule_evt();
+	unsigned int expires = work->when;
+	unsigned int idx = expires - wheel_msecs;
+	struct list_head *vec;
+
+	if ((int)idx < 0)
+		/* already expired, run on the next tick */
+		vec = tv1 + (wheel_msecs & TVR_MASK);
+	else if (idx < 1U << TV_SHIFT(0))
+		vec = tv1 + (expires & TVR_MASK);
+	else if (idx < 1U << TV_SHIFT(1))
+		vec = tvn[0] + TV_INDEX(expires, 0);
+	else if (idx < 1U << TV_SHIFT(2))
+		vec = tvn[1] + TV_INDEX(expires, 1);
+	else if (idx < 1U << TV_SHIFT(3))
+		vec = tvn[2] + TV_INDEX(expires, 2);
+	else
+		vec = tvn[3] + TV_INDEX(expires, 3);
+
+	list_add_tail(&work->entry, vec);
+}
+
+/* move the works of one tvn slot down, returns the slot index */
+static int cascade(int level, int index)
+{
+	struct tgt_work *work, *n;
+	LIST_HEAD(list);
+
+	list_splice_init(&tvn[level][index], &list);
+
+	list_for_each_entry_safe(work, n, &list, entry) {
+		list_del(&work->entry);
+		__add_work(work);
+	}
+
+	return index;
+}
+
+/* does run_wheel() cascade any works when it gets to j */
+static int cascades_at(unsigned int j)
+{
+	int level, index;
+
+	if (j & TVR_MASK)
+		return 0;
+
+	for (level = 0; level < TVN_LEVELS; level++) {
+		index = TV_INDEX(j, level);
+		if (!list_empty(&tvn[level][index]))
+			return 1;
+		if (index)
+			/* the levels above are not cascaded at j */
+			break;
+	}
+
+	return 0;
+}
+
+/* earliest time the wheel has to run again */
+static unsigned int next_expiry(void)
+{
+	unsigned int boundary, j = wheel_msecs;
+	int i, level, index = j & TVR_MASK;
+
+	if (cascades_at(j))
+		return j;
+
+	for (i = index; i < TVR_SIZE; i++)
+		if (!list_empty(&tv1[i]))
+			return j + i - index;
+
+	/*
+	 * Nothing in tv1 before it wraps. Skip ahead to the first boundary
+	 * where a tvn slot with works in it gets cascaded.
+	 */
+	boundary = (j | TVR_MASK) + 1;
+	for (i = 0; i < index; i++)
+		if (!list_empty(&tv1[i]))
+			return boundary;
+
+	for (level = 0; level < TVN_LEVELS; level++) {
+		/* the slots of several levels may be cascaded at boundary */
+		if (cascades_at(boundary))
+			return boundary;
+
+		index = TV_INDEX(boundary, level);
+		for (i = index + 1; i < TVN_SIZE; i++) {
+			if (!list_empty(&tvn[level][i]))
+				return boundary +
+					((i - index) << TV_SHIFT(level));
+		}
+		if (!index)
+			/* the next level cascades at the same boundary */
+			continue;
+
+		/* slots before index are cascaded after this level wraps */
+		boundary = (boundary | ((1U << TV_SHIFT(level + 1)) - 1)) + 1;
+		for (i = 0; i < index; i++)
+			if (!list_empty(&tvn[level][i]))
+				return boundary;
+	}
+
+	return boundary;
+}
+
+static void run_wheel(unsigned int now)
+{
+	LIST_HEAD(active);
+	struct tgt_work *work;
+	int index;
+
+	while (!before(now, wheel_msecs)) {
+		index = wheel_msecs & TVR_MASK;
+
+		if (!index &&
+		    !cascade(0, TV_INDEX(wheel_msecs, 0)) &&
+		    !cascade(1, TV_INDEX(wheel_msecs, 1)) &&
+		    !cascade(2, TV_INDEX(wheel_msecs, 2)))
+			cascade(3, TV_INDEX(wheel_msecs, 3));
+
+		wheel_msecs++;
+		list_splice_tail_init(&tv1[index], &active);
+	}
+
+	/* a work may add or delete other works, take them one by one */
+	while (!list_empty(&active)) {
+		work = list_first_entry(&active, struct tgt_work, entry);
+		list_del_init(&work->entry);
+		nr_works--;
+		work->func(work->data);
+	}
 }
 
 static void work_timer_evt_handler(int fd, int events, void *data)
 {
+	unsigned long long s;
+	unsigned int n;
 	int err;
-	static int first = 1;
 
 	if (timer_fd[1] == -1) {
-		unsigned long long s;
-		struct timeval cur_time;
-
 		err = read(timer_fd[0], &s, sizeof(s));
 		if (err < 0) {
-			if (err != -EAGAIN)
+			if (errno != EAGAIN)
 				eprintf("failed to read from timerfd, %m\n");
 			return;
 		}
-
-		if (first) {
-			first = 0;
-			err = gettimeofday(&cur_time, NULL);
-			if (err) {
-				eprintf("gettimeofday failed, %m\n");
-				exit(1);
-			}
-			elapsed_msecs = timeval_to_msecs(cur_time);
-			return;
-		}
-
-		elapsed_msecs += (unsigned int)s * WORK_TIMER_INT_MSEC;
 	} else {
-		unsigned int n;
-		struct timeval cur_time;
-
 		err = read(timer_fd[0], &n, sizeof(n));
 		if (err < 0) {
 			eprintf("Failed to read from pipe, %m\n");
 			return;
 		}
-
-		timer_pending = 0;
-
-		err = gettimeofday(&cur_time, NULL);
-		if (err) {
-			eprintf("gettimeofday failed, %m\n");
-			exit(1);
-		}
-
-		elapsed_msecs = timeval_to_msecs(cur_time);
 	}
 
+	timer_armed = 0;
 	execute_work();
 }
 
 int work_timer_start(void)
 {
-	struct timeval t;
 	int err;
 
-	if (elapsed_msecs)
+	if (timer_started)
 		return 0;
 
-	err = gettimeofday(&t, NULL);
-	if (err) {
-		eprintf("gettimeofday failed, %m\n");
-		exit(1);
-	}
-	elapsed_msecs = timeval_to_msecs(t);
+	if (!wheel_ready)
+		wheel_init();
 
-	timer_fd[0] = __timerfd_create(WORK_TIMER_INT_USEC);
+	timer_fd[0] = __timerfd_create();
 	if (timer_fd[0] >= 0)
 		eprintf("use timer_fd based scheduler\n");
 	else {
@@ -159,12 +318,6 @@ int work_timer_start(void)
 			goto timer_err;
 		}
 
-		err = setitimer(ITIMER_REAL, &work_timer, 0);
-		if (err) {
-			eprintf("Failed to set timer\n");
-			goto timer_err;
-		}
-
 		err = pipe(timer_fd);
 		if (err) {
 			eprintf("Failed to open timer pipe\n");
@@ -178,7 +331,13 @@ int work_timer_start(void)
 		goto timer_err;
 	}
 
-	dprintf("started, timeout: %d msec\n", WORK_TIMER_INT_MSEC);
+	timer_started = 1;
+
+	/* works added before the timer was started */
+	if (nr_works)
+		work_timer_arm(next_expiry());
+
+	dprintf("started\n");
 	return 0;
 
 timer_err:
@@ -188,17 +347,13 @@ timer_err:
 
 void work_timer_stop(void)
 {
-	if (!elapsed_msecs)
-		return;
-
-	elapsed_msecs = 0;
-
-	tgt_event_del(timer_fd[0]);
-
-	if (timer_fd[0] > 0)
+	if (timer_fd[0] >= 0) {
+		if (timer_started)
+			tgt_event_del(timer_fd[0]);
 		close(timer_fd[0]);
+	}
 
-	if (timer_fd[1] > 0) {
+	if (timer_fd[1] >= 0) {
 		int ret;
 		close(timer_fd[1]);
 
@@ -208,55 +363,50 @@ void work_timer_stop(void)
 		else
 			dprintf("Timer stopped\n");
 	}
+
+	timer_fd[0] = timer_fd[1] = -1;
+	timer_started = 0;
+	timer_armed = 0;
 }
 
-void add_work(struct tgt_work *work, unsigned int second)
+void add_work_msecs(struct tgt_work *work, unsigned int msecs)
 {
-	struct tgt_work *ent;
-	struct timeval t;
-	int err;
+	unsigned int now = work_now();
 
-	if (second) {
-		err = gettimeofday(&t, NULL);
-		if (err) {
-			eprintf("gettimeofday failed, %m\n");
-			exit(1);
-		}
-		work->when = timeval_to_msecs(t) + second * 1000;
+	if (!wheel_ready)
+		wheel_init();
 
-		list_for_each_entry(ent, &inactive_work_list, entry) {
-			if (before(work->when, ent->when))
-				break;
-		}
+	/* don't make the wheel walk through a long idle period */
+	if (!nr_works)
+		wheel_msecs = now;
 
-		list_add_tail(&work->entry, &ent->entry);
-	} else {
-		list_add_tail(&work->entry, &active_work_list);
-		work_timer_schedule_evt();
-	}
+	work->when = now + msecs;
+	__add_work(work);
+	nr_works++;
+
+	if (timer_started &&
+	    (!timer_armed || before(work->when, timer_expires)))
+		work_timer_arm(work->when);
 }
 
-void del_work(struct tgt_work *work)
+void add_work(struct tgt_work *work, unsigned int second)
 {
-	list_del_init(&work->entry);
+	add_work_msecs(work, second * 1000);
 }
 
-static void execute_work()
+void del_work(struct tgt_work *work)
 {
-	struct tgt_work *work, *n;
+	if (list_empty(&work->entry))
+		return;
 
-	list_for_each_entry_safe(work, n, &inactive_work_list, entry) {
-		if (before(elapsed_msecs, work->when))
-			break;
+	list_del_init(&work->entry);
+	nr_works--;
+}
 
-		list_del(&work->entry);
-		list_add_tail(&work->entry, &active_work_list);
-	}
+static void execute_work(void)
+{
+	run_wheel(work_now());
 
-	while (!list_empty(&active_work_list)) {
-		work = list_first_entry(&active_work_list,
-					struct tgt_work, entry);
-		list_del_init(&work->entry);
-		work->func(work->data);
-	}
+	if (nr_works && timer_started)
+		work_timer_arm(next_expiry());
 }
@@ -5,37 +5,35 @@
 
 #include <sys/timerfd.h>
 
-static inline int __timerfd_create(unsigned int usec)
+static inline int __timerfd_create(void)
 {
-	struct itimerspec new_t, old_t;
-	int fd, err;
-
-	fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
-	if (fd < 0)
-		return -1;
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+}
 
-	new_t.it_value.tv_sec = 0;
-	new_t.it_value.tv_nsec = 1;
+static inline int __timerfd_arm(int fd, unsigned int msecs)
+{
+	struct itimerspec t;
 
-	new_t.it_interval.tv_sec = 0;
-	new_t.it_interval.tv_nsec = usec * 1000;
+	memset(&t, 0, sizeof(t));
+	t.it_value.tv_sec = msecs / 1000;
+	t.it_value.tv_nsec = (msecs % 1000) * 1000000;
+	/* zero would disarm it */
+	if (!msecs)
+		t.it_value.tv_nsec = 1;
 
-	err = timerfd_settime(fd, TFD_TIMER_ABSTIME, &new_t, &old_t);
-	if (err < 0) {
-		close(fd);
-		return -1;
-	}
-	return fd;
+	return timerfd_settime(fd, 0, &t, NULL);
 }
 
 #else
-	#define __timerfd_create(usec)	(-1)
+	#define __timerfd_create()	(-1)
+	#define __timerfd_arm(fd, msecs)	(-1)
 #endif
 
 struct tgt_work {
 	struct list_head entry;
 	void (*func)(void *);
 	void *data;
+	/* expiry in msecs of CLOCK_MONOTONIC */
 	unsigned int when;
 };
 
@@ -43,6 +41,7 @@ extern int work_timer_start(void);
 extern void work_timer_stop(void);
 
 extern void add_work(struct tgt_work *work, unsigned int second);
+extern void add_work_msecs(struct tgt_work *work, unsigned int msecs);
 extern void del_work(struct tgt_work *work);
 
 #endif